@@ -24,9 +24,15 @@
 
 #include <stdlib.h>
 #include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
 #include "udscs.h"
+#include "vdagentd-proto.h"
 #include "vdagentd-proto-strings.h"
 #include "vdagent-connection.h"
 
@@ -34,10 +40,30 @@ struct _UdscsConnection {
     VDAgentConnection parent_instance;
     int debug;
     udscs_read_callback read_callback;
+    VDAgentConnErrorCb error_cb;
+
+    /* body of the message being handled by read_callback */
+    uint8_t *message_data;
+    uint32_t message_size;
+    /* set if the body is already refcounted */
+    GBytes *message_bytes;
 };
 
 G_DEFINE_TYPE(UdscsConnection, udscs_connection, VDAGENT_TYPE_CONNECTION)
 
+/* Set in the type of a message whose body isn't sent through the socket,
+ * but in a sealed memfd passed along with the header. */
+#define UDSCS_TYPE_FD_PAYLOAD (1u << 31)
+
+/* Clipboard and file data of at least this size is passed as a memfd,
+ * so that it doesn't have to be copied through the socket buffers. */
+#define UDSCS_FD_PAYLOAD_MIN_SIZE (64 * 1024)
+
+#ifdef HAVE_MEMFD_CREATE
+#define UDSCS_FD_PAYLOAD_SEALS \
+    (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#endif
+
 static void debug_print_message_header(UdscsConnection             *conn,
                                        struct udscs_message_header *header,
                                        const gchar                 *direction)
@@ -54,10 +80,112 @@ static void debug_print_message_header(UdscsConnection             *conn,
         conn, direction, type, header->arg1, header->arg2, header->size);
 }
 
+/* Copies @vectors into a new sealed memfd, returns -1 on failure. */
+static gint create_payload_fd(struct iovec *vectors, gint n_vectors)
+{
+#ifdef HAVE_MEMFD_CREATE
+    gssize written;
+    gint fd;
+
+    fd = memfd_create("spice-vdagent-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return -1;
+    }
+
+    while (n_vectors > 0) {
+        written = writev(fd, vectors, n_vectors);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written <= 0) {
+            close(fd);
+            return -1;
+        }
+        while (n_vectors > 0 && written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            n_vectors--;
+        }
+        if (n_vectors > 0) {
+            vectors->iov_base = (uint8_t *)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, UDSCS_FD_PAYLOAD_SEALS) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* Maps the body of a message passed as a memfd,
+ * returns NULL with @err set if the peer didn't send a valid one. */
+static GBytes *map_payload_fd(UdscsConnection *self, uint32_t size,
+                              GError **err)
+{
+#ifdef HAVE_MEMFD_CREATE
+    GMappedFile *file;
+    GBytes *bytes, *payload;
+    gint seals;
+#endif
+    gint fd;
+
+    fd = vdagent_connection_steal_received_fd(VDAGENT_CONNECTION(self));
+    if (fd == -1) {
+        g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                            "message payload FD is missing");
+        return NULL;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+    /* the payload must not change under our hands */
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || (seals & UDSCS_FD_PAYLOAD_SEALS) != UDSCS_FD_PAYLOAD_SEALS) {
+        g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                            "message payload FD isn't sealed");
+        close(fd);
+        return NULL;
+    }
+
+    /* writable private mapping, so that the callbacks can modify the data */
+    file = g_mapped_file_new_from_fd(fd, TRUE, err);
+    close(fd);
+    if (file == NULL) {
+        g_prefix_error(err, "failed to map message payload: ");
+        return NULL;
+    }
+    bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+
+    if (g_bytes_get_size(bytes) < size) {
+        g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                            "message payload is too short");
+        g_bytes_unref(bytes);
+        return NULL;
+    }
+    payload = g_bytes_new_from_bytes(bytes, 0, size);
+    g_bytes_unref(bytes);
+    return payload;
+#else
+    g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "message payload FDs aren't supported");
+    close(fd);
+    return NULL;
+#endif
+}
+
 static gsize conn_handle_header(VDAgentConnection *conn,
                                 gpointer           header_buf)
 {
-    return ((struct udscs_message_header *)header_buf)->size;
+    struct udscs_message_header *header = header_buf;
+
+    if (header->type & UDSCS_TYPE_FD_PAYLOAD) {
+        return 0;
+    }
+    return header->size;
 }
 
 static void conn_handle_message(VDAgentConnection *conn,
@@ -66,10 +194,34 @@ static void conn_handle_message(VDAgentConnection *conn,
 {
     UdscsConnection *self = UDSCS_CONNECTION(conn);
     struct udscs_message_header *header = header_buf;
+    GError *err = NULL;
+
+    if (header->type & UDSCS_TYPE_FD_PAYLOAD) {
+        header->type &= ~UDSCS_TYPE_FD_PAYLOAD;
+        if (header->size == 0) {
+            g_set_error_literal(&err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "empty message with a payload FD");
+        } else {
+            self->message_bytes = map_payload_fd(self, header->size, &err);
+        }
+        /* the peer broke the protocol, a request this answers would
+         * never get its reply anyway */
+        if (err) {
+            self->error_cb(conn, err);
+            return;
+        }
+        data = (gpointer)g_bytes_get_data(self->message_bytes, NULL);
+    }
+    self->message_data = data;
+    self->message_size = header->size;
 
     debug_print_message_header(self, header, "received");
 
     self->read_callback(self, header, data);
+
+    self->message_data = NULL;
+    self->message_size = 0;
+    g_clear_pointer(&self->message_bytes, g_bytes_unref);
 }
 
 static void udscs_connection_init(UdscsConnection *self)
@@ -117,6 +269,7 @@ UdscsConnection *udscs_connect(const char *socketname,
     conn = g_object_new(UDSCS_TYPE_CONNECTION, NULL);
     conn->debug = debug;
     conn->read_callback = read_callback;
+    conn->error_cb = error_cb;
     vdagent_connection_setup(VDAGENT_CONNECTION(conn),
                              io_stream,
                              FALSE,
@@ -130,27 +283,177 @@ UdscsConnection *udscs_connect(const char *socketname,
     return conn;
 }
 
+GBytes *udscs_connection_ref_message_data(UdscsConnection *conn)
+{
+    if (conn->message_bytes) {
+        return g_bytes_ref(conn->message_bytes);
+    }
+    return g_bytes_new(conn->message_data, conn->message_size);
+}
+
+static gboolean use_payload_fd(uint32_t type, uint32_t size)
+{
+    return size >= UDSCS_FD_PAYLOAD_MIN_SIZE &&
+           (type == VDAGENTD_CLIPBOARD_DATA || type == VDAGENTD_FILE_XFER_DATA);
+}
+
+/* Queues @header of a message whose body is passed in the memfd @fd. */
+static void write_fd_payload_header(UdscsConnection             *conn,
+                                    struct udscs_message_header *header,
+                                    gint                         fd,
+                                    VDAgentConnPriority          priority)
+{
+    header->type |= UDSCS_TYPE_FD_PAYLOAD;
+    vdagent_connection_write_with_fd(VDAGENT_CONNECTION(conn),
+                                     g_memdup(header, sizeof(*header)),
+                                     sizeof(*header), fd, priority);
+}
+
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
     uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    udscs_write_with_priority(conn, type, arg1, arg2, data, size,
+                              VDAGENT_CONNECTION_PRIORITY_CONTROL);
+}
+
+void udscs_write_with_priority(UdscsConnection *conn, uint32_t type,
+    uint32_t arg1, uint32_t arg2, const uint8_t *data, uint32_t size,
+    VDAgentConnPriority priority)
 {
     gpointer buf;
     guint buf_size;
     struct udscs_message_header header;
+    gint fd = -1;
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
+
+    debug_print_message_header(conn, &header, "sent");
+
+    if (use_payload_fd(type, size)) {
+        struct iovec vector = { (gpointer)data, size };
+
+        /* fall back to sending the data inline if this fails */
+        fd = create_payload_fd(&vector, 1);
+    }
+    if (fd != -1) {
+        write_fd_payload_header(conn, &header, fd, priority);
+        return;
+    }
 
     buf_size = sizeof(header) + size;
     buf = g_malloc(buf_size);
 
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), data, size);
+
+    vdagent_connection_write_with_priority(VDAGENT_CONNECTION(conn), buf, buf_size,
+                                           priority);
+}
+
+void udscs_writev(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, GBytes **segments, guint n_segments,
+    VDAgentConnPriority priority)
+{
+    struct udscs_message_header header;
+    GBytes **msg_segments;
+    struct iovec *vectors;
+    gsize size = 0;
+    guint i;
+    gint fd = -1;
+
+    for (i = 0; i < n_segments; i++) {
+        size += g_bytes_get_size(segments[i]);
+    }
+    g_return_if_fail(size <= G_MAXUINT32);
+
     header.type = type;
     header.arg1 = arg1;
     header.arg2 = arg2;
     header.size = size;
 
-    memcpy(buf, &header, sizeof(header));
-    memcpy(buf + sizeof(header), data, size);
+    debug_print_message_header(conn, &header, "sent");
+
+    if (use_payload_fd(type, size)) {
+        vectors = g_new(struct iovec, n_segments);
+        for (i = 0; i < n_segments; i++) {
+            vectors[i].iov_base = (gpointer)g_bytes_get_data(segments[i],
+                                                             &vectors[i].iov_len);
+        }
+        fd = create_payload_fd(vectors, n_segments);
+        g_free(vectors);
+    }
+    if (fd != -1) {
+        write_fd_payload_header(conn, &header, fd, priority);
+        return;
+    }
+
+    msg_segments = g_new(GBytes *, n_segments + 1);
+    msg_segments[0] = g_bytes_new(&header, sizeof(header));
+    memcpy(msg_segments + 1, segments, n_segments * sizeof(GBytes *));
+
+    vdagent_connection_writev(VDAGENT_CONNECTION(conn), msg_segments, n_segments + 1,
+                              priority);
+
+    g_bytes_unref(msg_segments[0]);
+    g_free(msg_segments);
+}
+
+VDAgentConnMessage *udscs_write_begin(UdscsConnection *conn, uint32_t type,
+    uint32_t arg1, uint32_t arg2, uint32_t size)
+{
+    struct udscs_message_header header;
+    VDAgentConnMessage *msg;
+    GBytes *bytes;
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
 
     debug_print_message_header(conn, &header, "sent");
 
-    vdagent_connection_write(VDAGENT_CONNECTION(conn), buf, buf_size);
+    bytes = g_bytes_new(&header, sizeof(header));
+    msg = vdagent_connection_writev_begin(VDAGENT_CONNECTION(conn), &bytes, 1,
+                                          sizeof(header) + size,
+                                          VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    g_bytes_unref(bytes);
+    return msg;
+}
+
+void udscs_write_append(UdscsConnection *conn, VDAgentConnMessage *msg,
+    const uint8_t *data, uint32_t size)
+{
+    GBytes *bytes;
+
+    if (size == 0) {
+        return;
+    }
+    bytes = g_bytes_new(data, size);
+    vdagent_connection_append(VDAGENT_CONNECTION(conn), msg, bytes);
+    g_bytes_unref(bytes);
+}
+
+void udscs_write_chunked(UdscsConnection *conn, uint32_t begin_type,
+    uint32_t chunk_type, uint32_t arg1, uint32_t arg2, GBytes *data,
+    gsize chunk_size)
+{
+    gsize size = g_bytes_get_size(data), offset, n;
+    uint32_t total = size;
+    GBytes *chunk;
+
+    g_return_if_fail(size <= G_MAXUINT32 && chunk_size > 0);
+
+    udscs_write(conn, begin_type, arg1, arg2, (uint8_t *)&total, sizeof(total));
+    for (offset = 0; offset < size; offset += n) {
+        n = MIN(chunk_size, size - offset);
+        chunk = g_bytes_new_from_bytes(data, offset, n);
+        udscs_writev(conn, chunk_type, arg1, arg2, &chunk, 1,
+                     VDAGENT_CONNECTION_PRIORITY_CONTROL);
+        g_bytes_unref(chunk);
+    }
 }
 
 #ifndef UDSCS_NO_SERVER
@@ -159,7 +462,8 @@ void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
 
 struct udscs_server {
     GSocketService *service;
-    GList *connections;
+    /* set of the connected UdscsConnections */
+    GHashTable *connections;
 
     int debug;
     udscs_connect_callback connect_callback;
@@ -185,6 +489,7 @@ struct udscs_server *udscs_server_new(
     server->connect_callback = connect_callback;
     server->read_callback = read_callback;
     server->error_cb = error_cb;
+    server->connections = g_hash_table_new(NULL, NULL);
     server->service = g_socket_service_new();
     g_socket_service_stop(server->service);
 
@@ -232,16 +537,24 @@ void udscs_server_start(struct udscs_server *server)
 void udscs_server_destroy_connection(struct udscs_server *server,
                                      UdscsConnection     *conn)
 {
-    server->connections = g_list_remove(server->connections, conn);
+    g_hash_table_remove(server->connections, conn);
     vdagent_connection_destroy(conn);
 }
 
 void udscs_destroy_server(struct udscs_server *server)
 {
+    GHashTableIter iter;
+    gpointer conn;
+
     if (!server)
         return;
 
-    g_list_free_full(server->connections, vdagent_connection_destroy);
+    g_hash_table_iter_init(&iter, server->connections);
+    while (g_hash_table_iter_next(&iter, &conn, NULL)) {
+        g_hash_table_iter_remove(&iter);
+        vdagent_connection_destroy(conn);
+    }
+    g_hash_table_destroy(server->connections);
     g_object_unref(server->service);
     g_free(server);
 }
@@ -257,6 +570,7 @@ static gboolean udscs_server_accept_cb(GSocketService    *service,
     new_conn = g_object_new(UDSCS_TYPE_CONNECTION, NULL);
     new_conn->debug = server->debug;
     new_conn->read_callback = server->read_callback;
+    new_conn->error_cb = server->error_cb;
     g_object_ref(socket_conn);
     vdagent_connection_setup(VDAGENT_CONNECTION(new_conn),
                              G_IO_STREAM(socket_conn),
@@ -264,7 +578,7 @@ static gboolean udscs_server_accept_cb(GSocketService    *service,
                              sizeof(struct udscs_message_header),
                              server->error_cb);
 
-    server->connections = g_list_prepend(server->connections, new_conn);
+    g_hash_table_add(server->connections, new_conn);
 
     if (server->debug)
         syslog(LOG_DEBUG, "new client accepted: %p", new_conn);
@@ -279,27 +593,69 @@ void udscs_server_write_all(struct udscs_server *server,
         uint32_t type, uint32_t arg1, uint32_t arg2,
         const uint8_t *data, uint32_t size)
 {
-    GList *l;
-    for (l = server->connections; l; l = l->next) {
-        udscs_write(UDSCS_CONNECTION(l->data), type, arg1, arg2, data, size);
+    struct udscs_message_header header;
+    GHashTableIter iter;
+    gpointer conn;
+    GBytes *msg;
+    guint8 *buf;
+
+    /* every connection needs a memfd of its own */
+    if (use_payload_fd(type, size)) {
+        g_hash_table_iter_init(&iter, server->connections);
+        while (g_hash_table_iter_next(&iter, &conn, NULL)) {
+            udscs_write(conn, type, arg1, arg2, data, size);
+        }
+        return;
     }
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
+
+    /* serialize the message once and queue the same buffer everywhere */
+    buf = g_malloc(sizeof(header) + size);
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), data, size);
+    msg = g_bytes_new_take(buf, sizeof(header) + size);
+
+    g_hash_table_iter_init(&iter, server->connections);
+    while (g_hash_table_iter_next(&iter, &conn, NULL)) {
+        debug_print_message_header(conn, &header, "sent");
+        vdagent_connection_writev(conn, &msg, 1,
+                                  VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    }
+    g_bytes_unref(msg);
 }
 
 int udscs_server_for_all_clients(struct udscs_server *server,
     udscs_for_all_clients_callback func, void *priv)
 {
+    GPtrArray *conns;
+    GHashTableIter iter;
+    gpointer conn;
+    guint i;
     int r = 0;
-    GList *l, *next;
 
     if (!server)
         return 0;
 
-    l = server->connections;
-    while (l) {
-        next = l->next;
-        r += func(l->data, priv);
-        l = next;
+    /* func may disconnect clients, iterate over a snapshot */
+    conns = g_ptr_array_new_full(g_hash_table_size(server->connections),
+                                 g_object_unref);
+    g_hash_table_iter_init(&iter, server->connections);
+    while (g_hash_table_iter_next(&iter, &conn, NULL)) {
+        g_ptr_array_add(conns, g_object_ref(conn));
     }
+
+    for (i = 0; i < conns->len; i++) {
+        conn = g_ptr_array_index(conns, i);
+        if (g_hash_table_contains(server->connections, conn)) {
+            r += func(conn, priv);
+        }
+    }
+
+    g_ptr_array_unref(conns);
     return r;
 }
 
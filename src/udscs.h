@@ -60,10 +60,55 @@ UdscsConnection *udscs_connect(const char *socketname,
     int debug);
 
 /* Queue a message for delivery to the client connected through conn.
+ * Messages are delivered in the order they were queued.
  */
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write(), but the message is queued with the given priority
+ * instead of VDAGENT_CONNECTION_PRIORITY_CONTROL, so it may overtake
+ * messages of a lower priority. Only use this for messages that don't
+ * depend on the ones queued before them.
+ */
+void udscs_write_with_priority(UdscsConnection *conn, uint32_t type,
+        uint32_t arg1, uint32_t arg2, const uint8_t *data, uint32_t size,
+        VDAgentConnPriority priority);
+
+/* Like udscs_write_with_priority(), but the body of the message is made
+ * of @n_segments buffers that are queued by reference instead of being
+ * copied.
+ */
+void udscs_writev(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, GBytes **segments, guint n_segments,
+        VDAgentConnPriority priority);
+
+/* Start a message with a body of size bytes that is supplied piece by piece
+ * with udscs_write_append(), so that it can be relayed before all of it
+ * is available. Nothing else is sent on conn until the body is complete.
+ * Returns NULL if the message couldn't be started.
+ */
+VDAgentConnMessage *udscs_write_begin(UdscsConnection *conn, uint32_t type,
+    uint32_t arg1, uint32_t arg2, uint32_t size);
+
+void udscs_write_append(UdscsConnection *conn, VDAgentConnMessage *msg,
+    const uint8_t *data, uint32_t size);
+
+/* Send data as a message of begin_type, whose body is the size of data
+ * as a uint32_t, followed by messages of chunk_type carrying at most
+ * chunk_size bytes of data each. The chunks reference data, so the
+ * receiver can handle them as they come in without holding all of it.
+ */
+void udscs_write_chunked(UdscsConnection *conn, uint32_t begin_type,
+    uint32_t chunk_type, uint32_t arg1, uint32_t arg2, GBytes *data,
+    gsize chunk_size);
+
+/* Returns a reference to the body of the message that is currently
+ * being handled by the read callback of conn, so that it can be kept
+ * or relayed after the callback returns. The body is only copied
+ * if it isn't refcounted already.
+ */
+GBytes *udscs_connection_ref_message_data(UdscsConnection *conn);
+
 #ifndef UDSCS_NO_SERVER
 
 /* ---------- Server-side API ---------- */
@@ -110,7 +155,8 @@ void udscs_server_destroy_connection(struct udscs_server *server,
 void udscs_destroy_server(struct udscs_server *server);
 
 /* Like udscs_write, but then send the message to all clients connected to
- * the server.
+ * the server. The message is serialized only once and the same buffer
+ * is queued on all the connections.
  */
 void udscs_server_write_all(struct udscs_server *server,
     uint32_t type, uint32_t arg1, uint32_t arg2,
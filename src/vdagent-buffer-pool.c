@@ -0,0 +1,125 @@
+/*  vdagent-buffer-pool.c
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include "vdagent-buffer-pool.h"
+
+/* Size of the smallest class, must be large enough to hold a pointer */
+#define MIN_CLASS_SHIFT 4
+/* Size of the largest class, message bodies that don't fit into the read
+ * buffer of a connection and reassembled virtio messages are usually
+ * between a few KiB and a few hundred KiB */
+#define MAX_CLASS_SHIFT 20
+#define N_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define CLASS_SIZE(class_idx) ((gsize)1 << ((class_idx) + MIN_CLASS_SHIFT))
+
+/* Maximum number of free buffers kept around per class */
+#define MAX_FREE_PER_CLASS 32
+/* Maximum number of bytes kept around in all classes together */
+#define MAX_FREE_BYTES (4 * 1024 * 1024)
+
+G_STATIC_ASSERT((1 << MIN_CLASS_SHIFT) >= sizeof(gpointer));
+
+/* Free buffers are chained through their first bytes */
+typedef struct FreeBuffer {
+    struct FreeBuffer *next;
+} FreeBuffer;
+
+static struct {
+    FreeBuffer *free_list[N_CLASSES];
+    guint       n_free[N_CLASSES];
+    gsize       free_bytes;
+    guint64     hits;
+    guint64     misses;
+} pool;
+
+/* Returns the index of the smallest class that fits @size
+ * or -1 if @size is too large to be pooled. */
+static gint size_to_class(gsize size)
+{
+    gint class_idx = 0;
+
+    if (size > CLASS_SIZE(N_CLASSES - 1)) {
+        return -1;
+    }
+    while (CLASS_SIZE(class_idx) < size) {
+        class_idx++;
+    }
+    return class_idx;
+}
+
+gpointer vdagent_buffer_pool_alloc(gsize size)
+{
+    FreeBuffer *buf;
+    gint class_idx;
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    class_idx = size_to_class(size);
+    if (class_idx < 0) {
+        pool.misses++;
+        return g_malloc(size);
+    }
+
+    buf = pool.free_list[class_idx];
+    if (buf == NULL) {
+        pool.misses++;
+        return g_malloc(CLASS_SIZE(class_idx));
+    }
+
+    pool.free_list[class_idx] = buf->next;
+    pool.n_free[class_idx]--;
+    pool.free_bytes -= CLASS_SIZE(class_idx);
+    pool.hits++;
+    return buf;
+}
+
+void vdagent_buffer_pool_free(gpointer buf, gsize size)
+{
+    FreeBuffer *free_buf = buf;
+    gint class_idx;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    class_idx = size_to_class(size);
+    if (class_idx < 0 || pool.n_free[class_idx] >= MAX_FREE_PER_CLASS ||
+        pool.free_bytes + CLASS_SIZE(class_idx) > MAX_FREE_BYTES) {
+        g_free(buf);
+        return;
+    }
+
+    free_buf->next = pool.free_list[class_idx];
+    pool.free_list[class_idx] = free_buf;
+    pool.n_free[class_idx]++;
+    pool.free_bytes += CLASS_SIZE(class_idx);
+}
+
+void vdagent_buffer_pool_get_stats(guint64 *hits, guint64 *misses)
+{
+    if (hits) {
+        *hits = pool.hits;
+    }
+    if (misses) {
+        *misses = pool.misses;
+    }
+}
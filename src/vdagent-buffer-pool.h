@@ -0,0 +1,47 @@
+/*  vdagent-buffer-pool.h
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_BUFFER_POOL_H
+#define __VDAGENT_BUFFER_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Returns a buffer of at least @size bytes or NULL if @size is 0.
+ *
+ * Buffers up to 1 MiB are served from per-size-class free lists
+ * (power-of-two classes), larger ones are allocated with g_malloc().
+ * At most 4 MiB of free buffers are kept around.
+ *
+ * The pool is not thread-safe, it is meant to be used from the main loop. */
+gpointer vdagent_buffer_pool_alloc(gsize size);
+
+/* Return @buf to the pool.
+ * @size must be the same as the one passed to vdagent_buffer_pool_alloc().
+ * Does nothing if @buf is NULL. */
+void vdagent_buffer_pool_free(gpointer buf, gsize size);
+
+/* Retrieve the number of allocations that were served from the pool (@hits)
+ * and the number of allocations that had to fall back to g_malloc() (@misses).
+ * Either of the arguments may be NULL. */
+void vdagent_buffer_pool_get_stats(guint64 *hits, guint64 *misses);
+
+G_END_DECLS
+
+#endif
@@ -16,33 +16,156 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#ifdef HAVE_LIBURING
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+#include <glib-unix.h>
 #include <glib/gstdio.h>
+#include <gio/gunixfdmessage.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixsocketaddress.h>
 
 #include "vdagent-connection.h"
+#include "vdagent-buffer-pool.h"
+
+#ifdef HAVE_LIBURING
+typedef struct URingBackend URingBackend;
+#endif
+
+/* A message in the write queue, its segments are written back to back.
+ *
+ * Messages queued with vdagent_connection_writev_begin() are open
+ * until @available reaches @size, their segments are kept
+ * in a separately allocated array that grows as data is appended. */
+struct _VDAgentConnMessage {
+    gsize              size;
+    gsize              available;
+    /* FD to be sent along with the message or -1 */
+    gint               fd;
+    guint              n_segments;
+    guint              max_segments;
+    GBytes           **segments;
+    GBytes            *inline_segments[];
+};
+
+typedef VDAgentConnMessage WriteMessage;
 
 typedef struct {
     GIOStream         *io_stream;
     gboolean           opening;
+    /* timer that retries reading while opening, see handle_read() */
+    guint              open_retry_id;
+    guint              open_retry_ms;
+    gint64             open_start_time;
     VDAgentConnErrorCb error_cb;
     GCancellable      *cancellable;
 
-    GQueue            *write_queue;
+    /* queued messages, one queue per VDAgentConnPriority */
+    GQueue            *write_queues[VDAGENT_CONNECTION_N_PRIORITIES];
+    /* message that has been partially written */
+    WriteMessage      *write_head;
     gsize              bytes_written;
+    gsize              bytes_queued;
+    guint              msgs_queued;
+    /* writing stopped at an open message that's waiting for data */
+    gboolean           write_stalled;
+    /* messages_written is being called, writing continues afterwards */
+    gboolean           in_messages_written;
+    /* data held back by the subclass, see vdagent_connection_set_pending() */
+    gsize              pending_bytes;
+    guint              pending_msgs;
+
+    gsize              high_bytes;
+    gsize              low_bytes;
+    guint              high_msgs;
+    guint              low_msgs;
+    gboolean           queue_full;
+
+    /* ReceivedFds that haven't been claimed yet, oldest first */
+    GArray            *received_fds;
+    /* stream offset of the end of the data received so far
+     * and of the header that's being handled */
+    guint64            bytes_received;
+    guint64            header_offset;
+
+    GSource           *read_source;
+    gboolean           read_paused;
 
     gsize              header_size;
     gpointer           header_buf;
+    gboolean           header_read;
+    gsize              data_size;
     gpointer           data_buf;
+    gsize              data_read;
+
+    guint8            *read_buf;
+    gsize              read_start;
+    gsize              read_end;
+
+#ifdef HAVE_LIBURING
+    URingBackend      *uring;
+#endif
 } VDAgentConnectionPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE(VDAgentConnection, vdagent_connection, G_TYPE_OBJECT)
 
-static void read_next_message(VDAgentConnection *self);
+/* An FD received on the socket along with the data
+ * between the stream offsets @start and @end. */
+typedef struct {
+    gint    fd;
+    guint64 start;
+    guint64 end;
+} ReceivedFd;
+
+/* Size of the buffer that incoming data is read into.
+ * Bodies of larger messages are read into a dedicated buffer. */
+#define READ_BUF_SIZE 16384
+
+/* Message bodies passed to handle_message() from the read buffer
+ * must be aligned to this boundary, otherwise they are copied. */
+#define DATA_ALIGN 8
+
+/* Maximum number of received FDs waiting to be claimed,
+ * any FDs above this limit are closed right away. */
+#define RECEIVED_FDS_MAX 16
+
+/* Bounds of the interval between reads while the peer hasn't opened
+ * the connection yet, the interval doubles with each retry. */
+#define OPEN_RETRY_MIN_MS 1
+#define OPEN_RETRY_MAX_MS 10
+
+enum {
+    SIGNAL_QUEUE_FULL,
+    SIGNAL_QUEUE_DRAINED,
+    N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
+static void write_message_free(WriteMessage *msg);
+
+static gboolean in_stream_ready_cb(GObject *pollable_stream,
+                                   gpointer user_data);
+static gboolean out_stream_ready_cb(GObject *pollable_stream,
+                                    gpointer user_data);
+
+#ifdef HAVE_LIBURING
+static gboolean uring_setup(VDAgentConnection *self);
+static void uring_teardown(VDAgentConnection *self);
+static void uring_start_reading(VDAgentConnection *self);
+static void uring_start_writing(VDAgentConnection *self);
+static void uring_flush(VDAgentConnection *self);
+#endif
 
 GIOStream *vdagent_file_open(const gchar *path, GError **err)
 {
@@ -81,8 +204,13 @@ GIOStream *vdagent_socket_connect(const gchar *path, GError **err)
 static void vdagent_connection_init(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint prio;
+
     priv->cancellable = g_cancellable_new();
-    priv->write_queue = g_queue_new();
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        priv->write_queues[prio] = g_queue_new();
+    }
+    priv->received_fds = g_array_new(FALSE, FALSE, sizeof(ReceivedFd));
 }
 
 static void vdagent_connection_dispose(GObject *obj)
@@ -100,10 +228,20 @@ static void vdagent_connection_finalize(GObject *obj)
 {
     VDAgentConnection *self = VDAGENT_CONNECTION(obj);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint prio, i;
+
+    for (i = 0; i < priv->received_fds->len; i++) {
+        close(g_array_index(priv->received_fds, ReceivedFd, i).fd);
+    }
+    g_array_free(priv->received_fds, TRUE);
 
-    g_queue_free_full(priv->write_queue, (GDestroyNotify)g_bytes_unref);
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        g_queue_free_full(priv->write_queues[prio], (GDestroyNotify)write_message_free);
+    }
+    g_clear_pointer(&priv->write_head, write_message_free);
     g_free(priv->header_buf);
-    g_free(priv->data_buf);
+    vdagent_buffer_pool_free(priv->data_buf, priv->data_size);
+    g_free(priv->read_buf);
 
     G_OBJECT_CLASS(vdagent_connection_parent_class)->finalize(obj);
 }
@@ -113,6 +251,55 @@ static void vdagent_connection_class_init(VDAgentConnectionClass *klass)
     GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
     gobject_class->dispose  = vdagent_connection_dispose;
     gobject_class->finalize = vdagent_connection_finalize;
+
+    signals[SIGNAL_QUEUE_FULL] =
+        g_signal_new("queue-full",
+                     G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST,
+                     0, NULL, NULL, NULL,
+                     G_TYPE_NONE, 0);
+
+    signals[SIGNAL_QUEUE_DRAINED] =
+        g_signal_new("queue-drained",
+                     G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST,
+                     0, NULL, NULL, NULL,
+                     G_TYPE_NONE, 0);
+}
+
+static void start_reading(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GPollableInputStream *in;
+
+#ifdef HAVE_LIBURING
+    if (priv->uring) {
+        uring_start_reading(self);
+        return;
+    }
+#endif
+
+    if (priv->read_source || g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+
+    in = G_POLLABLE_INPUT_STREAM(g_io_stream_get_input_stream(priv->io_stream));
+
+    priv->read_source = g_pollable_input_stream_create_source(in, priv->cancellable);
+    g_source_set_callback(priv->read_source, (GSourceFunc) in_stream_ready_cb,
+        g_object_ref(self), g_object_unref);
+    g_source_attach(priv->read_source, NULL);
+}
+
+static void stop_reading(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GSource *source = g_steal_pointer(&priv->read_source);
+
+    if (source) {
+        g_source_destroy(source);
+        g_source_unref(source);
+    }
 }
 
 void vdagent_connection_setup(VDAgentConnection *self,
@@ -122,13 +309,21 @@ void vdagent_connection_setup(VDAgentConnection *self,
                               VDAgentConnErrorCb error_cb)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
     priv->io_stream = io_stream;
     priv->opening = wait_on_opening;
+    priv->open_start_time = g_get_monotonic_time();
     priv->header_size = header_size;
     priv->header_buf = g_malloc(header_size);
+    priv->read_buf = g_malloc(READ_BUF_SIZE);
     priv->error_cb = error_cb;
 
-    read_next_message(self);
+#ifdef HAVE_LIBURING
+    if (uring_setup(self)) {
+        return;
+    }
+#endif
+    start_reading(self);
 }
 
 void vdagent_connection_destroy(gpointer p)
@@ -138,6 +333,13 @@ void vdagent_connection_destroy(gpointer p)
     VDAgentConnection *self = VDAGENT_CONNECTION(p);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     g_cancellable_cancel(priv->cancellable);
+    if (priv->open_retry_id) {
+        g_source_remove(priv->open_retry_id);
+        priv->open_retry_id = 0;
+    }
+#ifdef HAVE_LIBURING
+    uring_teardown(self);
+#endif
     g_io_stream_close(priv->io_stream, NULL, NULL);
     g_object_unref(self);
 }
@@ -162,27 +364,360 @@ gint vdagent_connection_get_peer_pid(VDAgentConnection *self,
     return pid;
 }
 
-/* Performs single write operation,
- * returns TRUE if there's still data to be written, otherwise FALSE. */
-static gboolean do_write(VDAgentConnection *self, gboolean block)
+static void check_queue_watermarks(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    gsize bytes = priv->bytes_queued + priv->pending_bytes;
+    guint msgs = priv->msgs_queued + priv->pending_msgs;
+
+    if (!priv->queue_full) {
+        if ((priv->high_bytes && bytes > priv->high_bytes) ||
+            (priv->high_msgs && msgs > priv->high_msgs)) {
+            priv->queue_full = TRUE;
+            g_signal_emit(self, signals[SIGNAL_QUEUE_FULL], 0);
+        }
+    } else {
+        if (bytes <= priv->low_bytes && msgs <= priv->low_msgs) {
+            priv->queue_full = FALSE;
+            g_signal_emit(self, signals[SIGNAL_QUEUE_DRAINED], 0);
+        }
+    }
+}
+
+/* Maximum number of queued buffers flushed with a single write call. */
+#define WRITE_VECTORS_MAX 64
+
+G_STATIC_ASSERT(sizeof(GOutputVector) == sizeof(struct iovec));
+G_STATIC_ASSERT(G_STRUCT_OFFSET(GOutputVector, buffer) ==
+                G_STRUCT_OFFSET(struct iovec, iov_base));
+G_STATIC_ASSERT(G_STRUCT_OFFSET(GOutputVector, size) ==
+                G_STRUCT_OFFSET(struct iovec, iov_len));
+
+/* Writes as much of @vectors as possible using a single system call
+ * if the underlying stream allows it, otherwise only the first vector.
+ * If @send_fd isn't -1, it is sent along with the data (sockets only).
+ * Returns the number of bytes written or -1 with @err set. */
+static gssize write_vectors(VDAgentConnection *self,
+                            GOutputVector     *vectors,
+                            gint               n_vectors,
+                            gint               send_fd,
+                            gboolean           block,
+                            GError           **err)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GSocketControlMessage *fd_msg = NULL;
     GOutputStream *out;
-    GBytes *msg;
+    GSocket *sock;
     gssize res;
-    GError *err = NULL;
+    gint fd, errsv;
 
-    msg = g_queue_peek_head(priv->write_queue);
     out = g_io_stream_get_output_stream(priv->io_stream);
 
-    if (!msg) {
+    if (g_cancellable_set_error_if_cancelled(priv->cancellable, err)) {
+        return -1;
+    }
+
+    if (!block &&
+        !g_pollable_output_stream_is_writable(G_POLLABLE_OUTPUT_STREAM(out))) {
+        g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                            g_strerror(EAGAIN));
+        return -1;
+    }
+
+    if (G_IS_SOCKET_CONNECTION(priv->io_stream)) {
+        sock = g_socket_connection_get_socket(G_SOCKET_CONNECTION(priv->io_stream));
+        if (send_fd != -1) {
+            fd_msg = g_unix_fd_message_new();
+            if (!g_unix_fd_message_append_fd(G_UNIX_FD_MESSAGE(fd_msg), send_fd, err)) {
+                g_object_unref(fd_msg);
+                return -1;
+            }
+        }
+        /* a blocking GSocket waits until everything is sent,
+         * it must fail with G_IO_ERROR_WOULD_BLOCK instead */
+        g_socket_set_blocking(sock, block);
+        res = g_socket_send_message(sock, NULL, vectors, n_vectors,
+                                    fd_msg ? &fd_msg : NULL, fd_msg ? 1 : 0,
+                                    0, priv->cancellable, err);
+        g_clear_object(&fd_msg);
+        return res;
+    }
+
+    g_return_val_if_fail(send_fd == -1, -1);
+
+    if (G_IS_UNIX_OUTPUT_STREAM(out)) {
+        fd = g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(out));
+        do {
+            res = writev(fd, (struct iovec *)vectors, n_vectors);
+        } while (res == -1 && errno == EINTR);
+
+        if (res == -1) {
+            errsv = errno;
+            g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errsv),
+                        "Error writing to file descriptor: %s",
+                        g_strerror(errsv));
+        }
+        return res;
+    }
+
+    return g_pollable_stream_write(out, vectors[0].buffer, vectors[0].size,
+                                   block, priv->cancellable, err);
+}
+
+static WriteMessage *write_message_new(GBytes **segments,
+                                       guint    n_segments,
+                                       gint     fd)
+{
+    WriteMessage *msg;
+    guint i;
+
+    msg = g_malloc(sizeof(WriteMessage) + n_segments * sizeof(GBytes *));
+    msg->available = 0;
+    msg->fd = fd;
+    msg->n_segments = n_segments;
+    msg->max_segments = 0;
+    msg->segments = msg->inline_segments;
+    for (i = 0; i < n_segments; i++) {
+        msg->segments[i] = g_bytes_ref(segments[i]);
+        msg->available += g_bytes_get_size(segments[i]);
+    }
+    msg->size = msg->available;
+    return msg;
+}
+
+/* Appends @bytes to @msg that was created by write_message_new_open(). */
+static void write_message_append(WriteMessage *msg, GBytes *bytes)
+{
+    if (msg->n_segments == msg->max_segments) {
+        msg->max_segments *= 2;
+        msg->segments = g_renew(GBytes *, msg->segments, msg->max_segments);
+    }
+    msg->segments[msg->n_segments++] = g_bytes_ref(bytes);
+    msg->available += g_bytes_get_size(bytes);
+}
+
+/* Creates a message of @size bytes starting with @segments. */
+static WriteMessage *write_message_new_open(GBytes **segments,
+                                            guint    n_segments,
+                                            gsize    size)
+{
+    WriteMessage *msg;
+    guint i;
+
+    msg = g_malloc(sizeof(WriteMessage));
+    msg->size = size;
+    msg->available = 0;
+    msg->fd = -1;
+    msg->n_segments = 0;
+    msg->max_segments = MAX(n_segments, 8);
+    msg->segments = g_new(GBytes *, msg->max_segments);
+    for (i = 0; i < n_segments; i++) {
+        write_message_append(msg, segments[i]);
+    }
+    return msg;
+}
+
+static gboolean write_message_is_open(WriteMessage *msg)
+{
+    return msg->available < msg->size;
+}
+
+static void write_message_free(WriteMessage *msg)
+{
+    guint i;
+
+    if (msg->fd != -1) {
+        close(msg->fd);
+    }
+    for (i = 0; i < msg->n_segments; i++) {
+        g_bytes_unref(msg->segments[i]);
+    }
+    if (msg->segments != msg->inline_segments) {
+        g_free(msg->segments);
+    }
+    g_free(msg);
+}
+
+/* Closes the FD of @msg once it has been sent. */
+static void drop_write_fd(WriteMessage *msg)
+{
+    if (msg->fd != -1) {
+        close(msg->fd);
+        msg->fd = -1;
+    }
+}
+
+/* Fills @vectors with the segments of @msg, skipping the first @offset bytes,
+ * returns the number of used vectors, at most @max_vectors. */
+static gint add_message_vectors(WriteMessage  *msg,
+                                gsize          offset,
+                                GOutputVector *vectors,
+                                gint           max_vectors)
+{
+    const guint8 *data;
+    gsize size;
+    guint i;
+    gint n_vectors = 0;
+
+    for (i = 0; i < msg->n_segments && n_vectors < max_vectors; i++) {
+        data = g_bytes_get_data(msg->segments[i], &size);
+        if (offset >= size) {
+            offset -= size;
+            continue;
+        }
+        vectors[n_vectors].buffer = data + offset;
+        vectors[n_vectors].size = size - offset;
+        n_vectors++;
+        offset = 0;
+    }
+    return n_vectors;
+}
+
+/* Collects the messages to be written next into @msgs and their segments
+ * into @vectors, returns the number of collected vectors.
+ * @n_msgs is set to the number of collected messages and
+ * @send_fd to the FD that must be sent along with them or -1.
+ *
+ * A partially written message is always finished first,
+ * the rest is written in the order of priority.
+ * Messages are only collected as a whole unless they don't fit
+ * into @vectors on their own.
+ * Nothing is collected past an open message, since the rest of it
+ * must be written before anything else.
+ *
+ * The receiver gets an FD together with the first byte of the write
+ * it was sent with, so a message with an FD always starts a new write. */
+static gint gather_messages(VDAgentConnection *self,
+                            WriteMessage     **msgs,
+                            gint              *n_msgs,
+                            GOutputVector     *vectors,
+                            gint              *send_fd)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    WriteMessage *msg;
+    GList *l;
+    guint prio;
+    gint n_vectors = 0;
+
+    *n_msgs = 0;
+    *send_fd = -1;
+    if (priv->write_head) {
+        msgs[(*n_msgs)++] = priv->write_head;
+        n_vectors = add_message_vectors(priv->write_head, priv->bytes_written,
+                                        vectors, WRITE_VECTORS_MAX);
+        if (write_message_is_open(priv->write_head)) {
+            return n_vectors;
+        }
+    }
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        for (l = g_queue_peek_head_link(priv->write_queues[prio]);
+             l != NULL && *n_msgs < WRITE_VECTORS_MAX;
+             l = l->next) {
+            msg = l->data;
+            if (*n_msgs > 0 &&
+                (msg->fd != -1 || n_vectors + msg->n_segments > WRITE_VECTORS_MAX)) {
+                return n_vectors;
+            }
+            if (msg->fd != -1) {
+                *send_fd = msg->fd;
+            }
+            msgs[(*n_msgs)++] = msg;
+            n_vectors += add_message_vectors(msg, 0, vectors + n_vectors,
+                                             WRITE_VECTORS_MAX - n_vectors);
+            if (write_message_is_open(msg)) {
+                return n_vectors;
+            }
+        }
+    }
+
+    return n_vectors;
+}
+
+/* Removes @msg, which must be at the head of one of the write queues,
+ * from the queue. */
+static void take_queued_message(VDAgentConnection *self, WriteMessage *msg)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint prio;
+
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        if (g_queue_peek_head(priv->write_queues[prio]) == msg) {
+            g_queue_pop_head(priv->write_queues[prio]);
+            return;
+        }
+    }
+    g_warn_if_reached();
+}
+
+/* Updates the write queues after @written bytes of the messages
+ * previously collected by gather_messages() have been written. */
+static void consume_written(VDAgentConnection *self,
+                            WriteMessage     **msgs,
+                            gint               n_msgs,
+                            gsize              written)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    VDAgentConnectionClass *klass = VDAGENT_CONNECTION_GET_CLASS(self);
+    gsize total = written + priv->bytes_written;
+    gint i;
+
+    /* drop the messages that were written completely */
+    for (i = 0; i < n_msgs; i++) {
+        if (total < msgs[i]->size) {
+            break;
+        }
+        total -= msgs[i]->size;
+
+        if (msgs[i] == priv->write_head) {
+            priv->write_head = NULL;
+        } else {
+            take_queued_message(self, msgs[i]);
+        }
+        write_message_free(msgs[i]);
+        priv->msgs_queued--;
+    }
+
+    /* a partially written message must be finished before anything else */
+    if (total > 0 && msgs[i] != priv->write_head) {
+        take_queued_message(self, msgs[i]);
+        priv->write_head = msgs[i];
+    }
+    priv->bytes_written = total;
+    priv->bytes_queued -= written;
+
+    if (i > 0 && klass->messages_written) {
+        priv->in_messages_written = TRUE;
+        klass->messages_written(self, i);
+        priv->in_messages_written = FALSE;
+    }
+
+    check_queue_watermarks(self);
+}
+
+/* Performs single write operation that flushes as many queued messages
+ * as possible, returns TRUE if there's still data to be written,
+ * otherwise FALSE. */
+static gboolean do_write(VDAgentConnection *self, gboolean block)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GOutputVector vectors[WRITE_VECTORS_MAX];
+    WriteMessage *msgs[WRITE_VECTORS_MAX];
+    gint n_msgs, n_vectors, fd;
+    gssize res;
+    GError *err = NULL;
+
+    n_vectors = gather_messages(self, msgs, &n_msgs, vectors, &fd);
+    if (n_msgs == 0) {
+        return FALSE;
+    }
+    if (n_vectors == 0) {
+        /* resumed by vdagent_connection_append() */
+        priv->write_stalled = TRUE;
         return FALSE;
     }
 
-    res = g_pollable_stream_write(out,
-        g_bytes_get_data(msg, NULL) + priv->bytes_written,
-        g_bytes_get_size(msg) - priv->bytes_written,
-        block, priv->cancellable, &err);
+    res = write_vectors(self, vectors, n_vectors, fd, block, &err);
 
     if (err) {
         if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
@@ -197,14 +732,32 @@ static gboolean do_write(VDAgentConnection *self, gboolean block)
         }
     }
 
-    priv->bytes_written += res;
+    drop_write_fd(msgs[0]);
+    consume_written(self, msgs, n_msgs, res);
 
-    if (priv->bytes_written == g_bytes_get_size(msg)) {
-        g_bytes_unref(g_queue_pop_head(priv->write_queue));
-        priv->bytes_written = 0;
+    return priv->msgs_queued > 0;
+}
+
+static void start_writing(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GPollableOutputStream *out;
+    GSource *source;
+
+#ifdef HAVE_LIBURING
+    if (priv->uring) {
+        uring_start_writing(self);
+        return;
     }
+#endif
 
-    return !g_queue_is_empty(priv->write_queue);
+    out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(priv->io_stream));
+
+    source = g_pollable_output_stream_create_source(out, priv->cancellable);
+    g_source_set_callback(source, (GSourceFunc) out_stream_ready_cb,
+        g_object_ref(self), NULL);
+    g_source_attach(source, NULL);
+    g_source_unref(source);
 }
 
 static gboolean out_stream_ready_cb(GObject *pollable_stream,
@@ -217,106 +770,1073 @@ static gboolean out_stream_ready_cb(GObject *pollable_stream,
     return FALSE;
 }
 
-void vdagent_connection_write(VDAgentConnection *self,
-                              gpointer           data,
-                              gsize              size)
+static void queue_message(VDAgentConnection  *self,
+                          WriteMessage       *msg,
+                          VDAgentConnPriority priority)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GPollableOutputStream *out;
-    GSource *source;
 
-    g_queue_push_tail(priv->write_queue, g_bytes_new_take(data, size));
+    g_queue_push_tail(priv->write_queues[priority], msg);
+    /* open messages are accounted for as their data comes in */
+    priv->bytes_queued += msg->available;
+    priv->msgs_queued++;
 
-    if (g_queue_get_length(priv->write_queue) == 1) {
-        out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(priv->io_stream));
-
-        source = g_pollable_output_stream_create_source(out, priv->cancellable);
-        g_source_set_callback(source, (GSourceFunc) out_stream_ready_cb,
-            g_object_ref(self), NULL);
-        g_source_attach(source, NULL);
-        g_source_unref(source);
+    /* the write in progress picks up messages queued by messages_written */
+    if ((priv->msgs_queued == 1 && !priv->in_messages_written) ||
+        priv->write_stalled) {
+        priv->write_stalled = FALSE;
+        start_writing(self);
     }
+
+    check_queue_watermarks(self);
 }
 
-void vdagent_connection_flush(VDAgentConnection *self)
+void vdagent_connection_write_with_priority(VDAgentConnection  *self,
+                                            gpointer            data,
+                                            gsize               size,
+                                            VDAgentConnPriority priority)
 {
-    while (do_write(self, TRUE));
+    GBytes *segment;
+
+    g_return_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES);
+    g_return_if_fail(size > 0);
+
+    segment = g_bytes_new_take(data, size);
+    queue_message(self, write_message_new(&segment, 1, -1), priority);
+    g_bytes_unref(segment);
 }
 
-static void message_read_cb(GObject      *source_object,
-                            GAsyncResult *res,
-                            gpointer      user_data)
+void vdagent_connection_writev(VDAgentConnection  *self,
+                               GBytes            **segments,
+                               guint               n_segments,
+                               VDAgentConnPriority priority)
+{
+    WriteMessage *msg;
+
+    g_return_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES);
+
+    msg = write_message_new(segments, n_segments, -1);
+    if (msg->size == 0) {
+        g_warn_if_reached();
+        write_message_free(msg);
+        return;
+    }
+    queue_message(self, msg, priority);
+}
+
+void vdagent_connection_write_with_fd(VDAgentConnection  *self,
+                                      gpointer            data,
+                                      gsize               size,
+                                      gint                fd,
+                                      VDAgentConnPriority priority)
 {
-    VDAgentConnection *self = user_data;
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GInputStream *in = G_INPUT_STREAM(source_object);
-    GError *err = NULL;
-    gsize bytes_read, data_size;
+    GBytes *segment;
 
-    g_input_stream_read_all_finish(in, res, &bytes_read, &err);
-    if (err) {
-        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-            g_error_free(err);
-        } else {
-            priv->error_cb(self, err);
+    /* ownership of @data and @fd is taken in any case */
+    if (priority >= VDAGENT_CONNECTION_N_PRIORITIES || fd < 0 || size == 0 ||
+        !G_IS_SOCKET_CONNECTION(priv->io_stream)) {
+        g_warn_if_reached();
+        if (fd >= 0) {
+            close(fd);
         }
-        goto unref;
+        g_free(data);
+        return;
     }
 
-    if (bytes_read == 0) {
-        /* see virtio-port.c for the rationale behind this */
-        if (priv->opening) {
-            g_usleep(10000);
-            read_next_message(self);
-        } else {
-            priv->error_cb(self, NULL);
-        }
-        goto unref;
+    segment = g_bytes_new_take(data, size);
+    queue_message(self, write_message_new(&segment, 1, fd), priority);
+    g_bytes_unref(segment);
+}
+
+VDAgentConnMessage *vdagent_connection_writev_begin(VDAgentConnection  *self,
+                                                    GBytes            **segments,
+                                                    guint               n_segments,
+                                                    gsize               size,
+                                                    VDAgentConnPriority priority)
+{
+    WriteMessage *msg;
+    gsize available = 0;
+    guint i;
+
+    g_return_val_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES, NULL);
+
+    for (i = 0; i < n_segments; i++) {
+        available += g_bytes_get_size(segments[i]);
     }
-    priv->opening = FALSE;
+    g_return_val_if_fail(available <= size, NULL);
+
+    msg = write_message_new_open(segments, n_segments, size);
+    queue_message(self, msg, priority);
+    return msg;
+}
 
-    if (!priv->data_buf) {
-        /* we've read the message header, now let's read its body */
-        data_size = VDAGENT_CONNECTION_GET_CLASS(self)->handle_header(
-            self, priv->header_buf);
+void vdagent_connection_append(VDAgentConnection  *self,
+                               VDAgentConnMessage *msg,
+                               GBytes             *bytes)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
 
-        if (g_cancellable_is_cancelled(priv->cancellable)) {
-            goto unref;
+    g_return_if_fail(msg != NULL);
+    g_return_if_fail(msg->available + g_bytes_get_size(bytes) <= msg->size);
+
+    if (g_bytes_get_size(bytes) == 0) {
+        return;
+    }
+    write_message_append(msg, bytes);
+    priv->bytes_queued += g_bytes_get_size(bytes);
+    check_queue_watermarks(self);
+
+    if (priv->write_stalled) {
+        priv->write_stalled = FALSE;
+        start_writing(self);
+    }
+}
+
+gint vdagent_connection_steal_received_fd(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    ReceivedFd *received;
+    gint fd;
+
+    while (priv->received_fds->len > 0) {
+        received = &g_array_index(priv->received_fds, ReceivedFd, 0);
+        if (received->start > priv->header_offset) {
+            /* sent with a later message */
+            return -1;
         }
+        fd = received->fd;
+        if (received->end > priv->header_offset) {
+            g_array_remove_index(priv->received_fds, 0);
+            return fd;
+        }
+        /* sent with an earlier message that didn't claim it */
+        g_array_remove_index(priv->received_fds, 0);
+        close(fd);
+    }
+    return -1;
+}
+
+/* Stores FDs that came with the next @count bytes received on the socket
+ * until the subclass claims them. */
+static void store_received_fds(VDAgentConnection *self,
+                               const gint        *fds,
+                               gint               n_fds,
+                               gssize             count)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    ReceivedFd received;
+    gint i;
 
-        if (data_size > 0) {
-            priv->data_buf = g_malloc(data_size);
-            g_input_stream_read_all_async(in,
-                priv->data_buf, data_size,
-                G_PRIORITY_DEFAULT, priv->cancellable,
-                message_read_cb, g_object_ref(self));
-            goto unref;
+    received.start = priv->bytes_received;
+    received.end = priv->bytes_received + MAX(count, 0);
+    for (i = 0; i < n_fds; i++) {
+        if (count <= 0 || priv->received_fds->len >= RECEIVED_FDS_MAX) {
+            syslog(LOG_WARNING, "%p: unexpected FD received, closing", self);
+            close(fds[i]);
+            continue;
         }
+        received.fd = fds[i];
+        g_array_append_val(priv->received_fds, received);
     }
+}
+
+void vdagent_connection_write(VDAgentConnection *self,
+                              gpointer           data,
+                              gsize              size)
+{
+    vdagent_connection_write_with_priority(self, data, size,
+                                           VDAGENT_CONNECTION_PRIORITY_CONTROL);
+}
+
+void vdagent_connection_flush(VDAgentConnection *self)
+{
+#ifdef HAVE_LIBURING
+    uring_flush(self);
+#endif
+    while (do_write(self, TRUE));
+}
 
-    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
-        self, priv->header_buf, priv->data_buf);
+void vdagent_connection_set_write_watermarks(VDAgentConnection *self,
+                                             gsize              high_bytes,
+                                             gsize              low_bytes,
+                                             guint              high_msgs,
+                                             guint              low_msgs)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
 
-    g_clear_pointer(&priv->data_buf, g_free);
-    read_next_message(self);
+    g_return_if_fail(high_bytes == 0 || low_bytes <= high_bytes);
+    g_return_if_fail(high_msgs == 0 || low_msgs <= high_msgs);
 
-unref:
-    g_object_unref(self);
+    priv->high_bytes = high_bytes;
+    priv->low_bytes = high_bytes ? low_bytes : G_MAXSIZE;
+    priv->high_msgs = high_msgs;
+    priv->low_msgs = high_msgs ? low_msgs : G_MAXUINT;
+
+    check_queue_watermarks(self);
 }
 
-static void read_next_message(VDAgentConnection *self)
+void vdagent_connection_set_pending(VDAgentConnection *self,
+                                    gsize              bytes,
+                                    guint              msgs)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->pending_bytes = bytes;
+    priv->pending_msgs = msgs;
+    check_queue_watermarks(self);
+}
+
+gboolean vdagent_connection_is_write_queue_full(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    return priv->queue_full;
+}
+
+void vdagent_connection_set_read_paused(VDAgentConnection *self,
+                                        gboolean           paused)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GInputStream *in;
 
-    if (g_cancellable_is_cancelled(priv->cancellable)) {
+    if (priv->read_paused == paused) {
         return;
     }
+    priv->read_paused = paused;
 
-    in = g_io_stream_get_input_stream(priv->io_stream);
-
-    g_input_stream_read_all_async(in,
-        priv->header_buf, priv->header_size,
-        G_PRIORITY_DEFAULT, priv->cancellable,
-        message_read_cb, g_object_ref(self));
+    if (paused) {
+        stop_reading(self);
+    } else {
+        start_reading(self);
+    }
 }
+
+/* Parses all complete messages available in the read buffer
+ * and passes them to the subclass.
+ * Returns FALSE if the connection got cancelled meanwhile. */
+static gboolean dispatch_messages(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    VDAgentConnectionClass *klass = VDAGENT_CONNECTION_GET_CLASS(self);
+    gpointer data;
+    gsize avail;
+
+    while (TRUE) {
+        avail = priv->read_end - priv->read_start;
+
+        if (priv->data_buf && priv->data_read < priv->data_size) {
+            /* body is being read into data_buf directly */
+            return TRUE;
+        }
+
+        if (!priv->header_read) {
+            if (avail < priv->header_size) {
+                return TRUE;
+            }
+            /* the rest of the read buffer was received last */
+            priv->header_offset = priv->bytes_received - avail;
+            memcpy(priv->header_buf, priv->read_buf + priv->read_start,
+                   priv->header_size);
+            priv->read_start += priv->header_size;
+            avail -= priv->header_size;
+
+            priv->data_size = klass->handle_header(self, priv->header_buf);
+            if (g_cancellable_is_cancelled(priv->cancellable)) {
+                return FALSE;
+            }
+            priv->header_read = TRUE;
+        }
+
+        data = priv->data_buf;
+        if (data == NULL && priv->data_size > 0) {
+            if (priv->data_size > READ_BUF_SIZE) {
+                /* body doesn't fit into the read buffer,
+                 * read the rest of it into a separate one */
+                priv->data_buf = vdagent_buffer_pool_alloc(priv->data_size);
+                memcpy(priv->data_buf, priv->read_buf + priv->read_start, avail);
+                priv->data_read = avail;
+                priv->read_start = priv->read_end;
+                continue;
+            }
+            if (avail < priv->data_size) {
+                return TRUE;
+            }
+
+            data = priv->read_buf + priv->read_start;
+            if ((guintptr)data % DATA_ALIGN != 0 && !klass->unaligned_data) {
+                priv->data_buf = vdagent_buffer_pool_alloc(priv->data_size);
+                memcpy(priv->data_buf, data, priv->data_size);
+                data = priv->data_buf;
+            }
+            priv->read_start += priv->data_size;
+        }
+
+        priv->header_read = FALSE;
+        klass->handle_message(self, priv->header_buf, data);
+        vdagent_buffer_pool_free(priv->data_buf, priv->data_size);
+        priv->data_buf = NULL;
+
+        if (g_cancellable_is_cancelled(priv->cancellable)) {
+            return FALSE;
+        }
+    }
+}
+
+/* Returns the location the next read should store the data to. */
+static void get_read_target(VDAgentConnection *self,
+                            gpointer          *buf,
+                            gsize             *count)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->data_buf) {
+        *buf = priv->data_buf + priv->data_read;
+        *count = priv->data_size - priv->data_read;
+        return;
+    }
+
+    /* move the beginning of an incomplete message to the start */
+    if (priv->read_start > 0) {
+        memmove(priv->read_buf, priv->read_buf + priv->read_start,
+                priv->read_end - priv->read_start);
+        priv->read_end -= priv->read_start;
+        priv->read_start = 0;
+    }
+    *buf = priv->read_buf + priv->read_end;
+    *count = READ_BUF_SIZE - priv->read_end;
+}
+
+static gboolean open_retry_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->open_retry_id = 0;
+    if (!priv->read_paused) {
+        start_reading(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Processes @count bytes stored to the location from get_read_target(),
+ * returns TRUE if the connection should be read further, otherwise FALSE. */
+static gboolean handle_read(VDAgentConnection *self, gsize count)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (count == 0) {
+        /* see virtio-port.c for the rationale behind this,
+         * the port keeps being reported as hung up until it's opened,
+         * so the read is retried from a timer */
+        if (priv->opening) {
+            if (priv->open_retry_id == 0) {
+                priv->open_retry_ms = CLAMP(priv->open_retry_ms * 2,
+                                            OPEN_RETRY_MIN_MS, OPEN_RETRY_MAX_MS);
+                priv->open_retry_id = g_timeout_add_full(G_PRIORITY_DEFAULT,
+                                                         priv->open_retry_ms,
+                                                         open_retry_cb,
+                                                         g_object_ref(self),
+                                                         g_object_unref);
+            }
+            return FALSE;
+        }
+        priv->error_cb(self, NULL);
+        return FALSE;
+    }
+    if (priv->opening) {
+        priv->opening = FALSE;
+        if (priv->open_retry_ms) {
+            syslog(LOG_INFO, "%p: opened by the peer after %" G_GINT64_FORMAT " ms",
+                   self, (g_get_monotonic_time() - priv->open_start_time) / 1000);
+        }
+    }
+
+    priv->bytes_received += count;
+    if (priv->data_buf) {
+        priv->data_read += count;
+    } else {
+        priv->read_end += count;
+    }
+
+    return dispatch_messages(self);
+}
+
+/* Receives data from the socket without blocking,
+ * FDs that arrive along with it are stored.
+ * Returns the number of bytes read or -1 with @err set. */
+static gssize socket_receive(VDAgentConnection *self,
+                             gpointer           buf,
+                             gsize              count,
+                             GError           **err)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GSocketControlMessage **messages = NULL;
+    GInputVector vector = { buf, count };
+    GSocket *sock;
+    gint i, n_messages = 0, n_fds, *fds;
+    gssize res;
+
+    sock = g_socket_connection_get_socket(G_SOCKET_CONNECTION(priv->io_stream));
+    if (g_socket_condition_check(sock, G_IO_IN | G_IO_HUP | G_IO_ERR) == 0) {
+        g_set_error_literal(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                            g_strerror(EAGAIN));
+        return -1;
+    }
+
+    res = g_socket_receive_message(sock, NULL, &vector, 1,
+                                   &messages, &n_messages, NULL,
+                                   priv->cancellable, err);
+
+    for (i = 0; i < n_messages; i++) {
+        if (G_IS_UNIX_FD_MESSAGE(messages[i])) {
+            fds = g_unix_fd_message_steal_fds(G_UNIX_FD_MESSAGE(messages[i]), &n_fds);
+            store_received_fds(self, fds, n_fds, res);
+            g_free(fds);
+        }
+        g_object_unref(messages[i]);
+    }
+    g_free(messages);
+
+    return res;
+}
+
+/* Reads whatever data is available without blocking and dispatches
+ * all complete messages,
+ * returns TRUE if the connection should be read further, otherwise FALSE. */
+static gboolean do_read(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GPollableInputStream *in;
+    gpointer buf;
+    gsize count;
+    gssize res;
+    GError *err = NULL;
+
+    get_read_target(self, &buf, &count);
+
+    if (G_IS_SOCKET_CONNECTION(priv->io_stream)) {
+        res = socket_receive(self, buf, count, &err);
+    } else {
+        in = G_POLLABLE_INPUT_STREAM(g_io_stream_get_input_stream(priv->io_stream));
+        res = g_pollable_input_stream_read_nonblocking(in, buf, count,
+                                                       priv->cancellable, &err);
+    }
+    if (err) {
+        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+            g_error_free(err);
+            return TRUE;
+        } else if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_error_free(err);
+            return FALSE;
+        } else {
+            priv->error_cb(self, err);
+            return FALSE;
+        }
+    }
+
+    return handle_read(self, res);
+}
+
+static gboolean in_stream_ready_cb(GObject *pollable_stream,
+                                   gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (!g_cancellable_is_cancelled(priv->cancellable) && do_read(self)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* the source might have been removed by vdagent_connection_set_read_paused() */
+    if (priv->read_source == g_main_current_source()) {
+        g_clear_pointer(&priv->read_source, g_source_unref);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+#ifdef HAVE_LIBURING
+
+/* io_uring backend
+ *
+ * A read is kept posted on the FD of the stream unless reading is paused,
+ * queued messages are written with one IORING_OP_WRITEV at a time and
+ * all messages queued within a main loop iteration go out together.
+ * Sockets use IORING_OP_RECVMSG and IORING_OP_SENDMSG instead,
+ * so that FDs can be passed along with the messages.
+ * Completions are signalled through an eventfd watched by the default
+ * GMainContext. */
+
+/* Number of entries of the submission queue */
+#define URING_ENTRIES 8
+
+/* Maximum number of FDs received with a single IORING_OP_RECVMSG */
+#define URING_RECV_FDS_MAX 4
+
+enum {
+    URING_OP_READ = 1,
+    URING_OP_READ_POLL,
+    URING_OP_WRITE,
+    URING_OP_WRITE_POLL,
+    URING_OP_CANCEL,
+};
+
+struct URingBackend {
+    struct io_uring ring;
+    gint            fd;
+    gboolean        is_socket;
+    gint            event_fd;
+    GSource        *event_source;
+    guint           write_idle_id;
+    guint           n_unsubmitted;
+
+    gboolean        read_in_flight;
+    /* read completion reaped by uring_flush(),
+     * processed from the main loop later */
+    gboolean        read_deferred;
+    gint            read_deferred_res;
+    struct msghdr   read_msg;
+    struct iovec    read_vector;
+    union {
+        struct cmsghdr align;
+        gchar          buf[CMSG_SPACE(sizeof(gint) * URING_RECV_FDS_MAX)];
+    } read_control;
+
+    gboolean        write_in_flight;
+    WriteMessage   *write_msgs[WRITE_VECTORS_MAX];
+    GOutputVector   write_vectors[WRITE_VECTORS_MAX];
+    gint            n_write_msgs;
+    gint            n_write_vectors;
+    gint            write_fd;
+    struct msghdr   write_msg;
+    union {
+        struct cmsghdr align;
+        gchar          buf[CMSG_SPACE(sizeof(gint))];
+    } write_control;
+};
+
+static gint get_stream_fd(GIOStream *io_stream)
+{
+    GInputStream *in;
+    GSocket *sock;
+
+    if (G_IS_SOCKET_CONNECTION(io_stream)) {
+        sock = g_socket_connection_get_socket(G_SOCKET_CONNECTION(io_stream));
+        return g_socket_get_fd(sock);
+    }
+
+    in = g_io_stream_get_input_stream(io_stream);
+    if (G_IS_UNIX_INPUT_STREAM(in)) {
+        return g_unix_input_stream_get_fd(G_UNIX_INPUT_STREAM(in));
+    }
+
+    return -1;
+}
+
+static void uring_submit(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    GError *err;
+    gint ret;
+
+    if (uring == NULL || uring->n_unsubmitted == 0) {
+        return;
+    }
+    uring->n_unsubmitted = 0;
+
+    ret = io_uring_submit(&uring->ring);
+    if (ret < 0) {
+        /* nothing got submitted */
+        uring->read_in_flight = FALSE;
+        uring->write_in_flight = FALSE;
+        err = g_error_new(G_IO_ERROR, g_io_error_from_errno(-ret),
+                          "io_uring_submit failed: %s", g_strerror(-ret));
+        priv->error_cb(self, err);
+    }
+}
+
+/* Returns an entry of the submission queue for an operation that takes
+ * @n_sqes entries. The queued entries are submitted first if there isn't
+ * enough room for all of them, so that linked entries go out together.
+ * Returns NULL with the connection failed if the queue is full. */
+static struct io_uring_sqe *uring_get_sqe(VDAgentConnection *self, guint n_sqes)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    struct io_uring_sqe *sqe;
+
+    if (uring->n_unsubmitted + n_sqes > URING_ENTRIES) {
+        uring_submit(self);
+        if (priv->uring == NULL || g_cancellable_is_cancelled(priv->cancellable)) {
+            return NULL;
+        }
+    }
+
+    sqe = io_uring_get_sqe(&uring->ring);
+    if (sqe == NULL) {
+        priv->error_cb(self, g_error_new_literal(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                 "io_uring submission queue is full"));
+    }
+    return sqe;
+}
+
+/* Queues a poll for @events on the FD of the stream,
+ * the next queued operation is started once the FD is ready. */
+static void uring_prep_poll(URingBackend *uring, struct io_uring_sqe *sqe,
+                            guint events, guint op)
+{
+    io_uring_prep_poll_add(sqe, uring->fd, events);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(op));
+    sqe->flags |= IOSQE_IO_LINK;
+    uring->n_unsubmitted++;
+}
+
+static void uring_post_read(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    struct io_uring_sqe *sqe;
+    gpointer buf;
+    gsize count;
+
+    if (uring == NULL || uring->read_in_flight || uring->read_deferred ||
+        priv->read_paused || g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+
+    /* the FD might be non-blocking (GSocket),
+     * so wait until there's something to read */
+    sqe = uring_get_sqe(self, 2);
+    if (sqe == NULL) {
+        return;
+    }
+    uring_prep_poll(uring, sqe, POLLIN, URING_OP_READ_POLL);
+
+    get_read_target(self, &buf, &count);
+    sqe = uring_get_sqe(self, 1);
+    if (sqe == NULL) {
+        return;
+    }
+    if (uring->is_socket) {
+        uring->read_vector.iov_base = buf;
+        uring->read_vector.iov_len = count;
+        memset(&uring->read_msg, 0, sizeof(uring->read_msg));
+        uring->read_msg.msg_iov = &uring->read_vector;
+        uring->read_msg.msg_iovlen = 1;
+        uring->read_msg.msg_control = uring->read_control.buf;
+        uring->read_msg.msg_controllen = sizeof(uring->read_control.buf);
+        io_uring_prep_recvmsg(sqe, uring->fd, &uring->read_msg, MSG_CMSG_CLOEXEC);
+    } else {
+        io_uring_prep_read(sqe, uring->fd, buf, count, -1);
+    }
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_READ));
+    uring->n_unsubmitted++;
+    uring->read_in_flight = TRUE;
+}
+
+static void uring_post_write(VDAgentConnection *self, gboolean wait_writable)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    struct io_uring_sqe *sqe;
+    struct cmsghdr *cmsg;
+
+    if (uring == NULL || uring->write_in_flight ||
+        g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+
+    uring->n_write_vectors = gather_messages(self, uring->write_msgs,
+                                             &uring->n_write_msgs,
+                                             uring->write_vectors,
+                                             &uring->write_fd);
+    if (uring->n_write_msgs == 0) {
+        return;
+    }
+    if (uring->n_write_vectors == 0) {
+        /* resumed by vdagent_connection_append() */
+        priv->write_stalled = TRUE;
+        return;
+    }
+
+    if (wait_writable) {
+        sqe = uring_get_sqe(self, 2);
+        if (sqe == NULL) {
+            return;
+        }
+        uring_prep_poll(uring, sqe, POLLOUT, URING_OP_WRITE_POLL);
+    }
+
+    sqe = uring_get_sqe(self, 1);
+    if (sqe == NULL) {
+        return;
+    }
+    if (uring->is_socket) {
+        memset(&uring->write_msg, 0, sizeof(uring->write_msg));
+        uring->write_msg.msg_iov = (struct iovec *)uring->write_vectors;
+        uring->write_msg.msg_iovlen = uring->n_write_vectors;
+        if (uring->write_fd != -1) {
+            uring->write_msg.msg_control = uring->write_control.buf;
+            uring->write_msg.msg_controllen = sizeof(uring->write_control.buf);
+            cmsg = CMSG_FIRSTHDR(&uring->write_msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gint));
+            memcpy(CMSG_DATA(cmsg), &uring->write_fd, sizeof(gint));
+        }
+        io_uring_prep_sendmsg(sqe, uring->fd, &uring->write_msg, MSG_NOSIGNAL);
+    } else {
+        io_uring_prep_writev(sqe, uring->fd, (struct iovec *)uring->write_vectors,
+                             uring->n_write_vectors, -1);
+    }
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_WRITE));
+    uring->n_unsubmitted++;
+    uring->write_in_flight = TRUE;
+}
+
+/* Stores the FDs received by the last IORING_OP_RECVMSG
+ * along with @count bytes. */
+static void uring_store_received_fds(VDAgentConnection *self, gint count)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    struct msghdr *msg = &priv->uring->read_msg;
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            gint fds[URING_RECV_FDS_MAX];
+            gint n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(gint);
+
+            memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(gint));
+            store_received_fds(self, fds, n_fds, count);
+        }
+    }
+    if (msg->msg_flags & MSG_CTRUNC) {
+        syslog(LOG_WARNING, "%p: received FDs got truncated", self);
+    }
+}
+
+static void uring_read_done(VDAgentConnection *self, gint res)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    GError *err;
+
+    /* the connection was destroyed or the poll failed and was reported */
+    if (res == -ECANCELED || g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+
+    if (res == -EAGAIN || res == -EINTR) {
+        uring_post_read(self);
+        return;
+    }
+
+    if (res < 0) {
+        err = g_error_new(G_IO_ERROR, g_io_error_from_errno(-res),
+                          "Error reading from file descriptor: %s",
+                          g_strerror(-res));
+        priv->error_cb(self, err);
+        return;
+    }
+
+    if (uring->is_socket) {
+        uring_store_received_fds(self, res);
+    }
+
+    if (handle_read(self, res)) {
+        uring_post_read(self);
+    }
+}
+
+static void uring_write_done(VDAgentConnection *self, gint res)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    GError *err;
+
+    if (res == -ECANCELED || g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+
+    if (res == -EAGAIN || res == -EINTR) {
+        uring_post_write(self, TRUE);
+        return;
+    }
+
+    if (res < 0) {
+        err = g_error_new(G_IO_ERROR, g_io_error_from_errno(-res),
+                          "Error writing to file descriptor: %s",
+                          g_strerror(-res));
+        priv->error_cb(self, err);
+        return;
+    }
+
+    drop_write_fd(uring->write_msgs[0]);
+    consume_written(self, uring->write_msgs, uring->n_write_msgs, res);
+    uring_post_write(self, FALSE);
+}
+
+static void uring_handle_completion(VDAgentConnection *self,
+                                    guint              op,
+                                    gint               res,
+                                    gboolean           defer_read)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+    GError *err;
+
+    switch (op) {
+    case URING_OP_READ:
+        uring->read_in_flight = FALSE;
+        /* the read may have been posted before reading got paused,
+         * the data is held until it's resumed */
+        if (defer_read || priv->read_paused) {
+            uring->read_deferred = TRUE;
+            uring->read_deferred_res = res;
+        } else {
+            uring_read_done(self, res);
+        }
+        break;
+    case URING_OP_WRITE:
+        uring->write_in_flight = FALSE;
+        uring_write_done(self, res);
+        break;
+    case URING_OP_READ_POLL:
+    case URING_OP_WRITE_POLL:
+        /* the linked operation completes with -ECANCELED */
+        if (res < 0 && res != -ECANCELED &&
+            !g_cancellable_is_cancelled(priv->cancellable)) {
+            err = g_error_new(G_IO_ERROR, g_io_error_from_errno(-res),
+                              "Error polling file descriptor: %s",
+                              g_strerror(-res));
+            priv->error_cb(self, err);
+        }
+        break;
+    }
+}
+
+static void uring_process_completions(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    struct io_uring_cqe *cqe;
+    guint op;
+    gint res;
+
+    if (priv->uring && priv->uring->read_deferred && !priv->read_paused) {
+        priv->uring->read_deferred = FALSE;
+        uring_read_done(self, priv->uring->read_deferred_res);
+    }
+
+    /* the backend is torn down if the connection gets destroyed meanwhile */
+    while (priv->uring && io_uring_peek_cqe(&priv->uring->ring, &cqe) == 0) {
+        op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        res = cqe->res;
+        io_uring_cqe_seen(&priv->uring->ring, cqe);
+
+        uring_handle_completion(self, op, res, FALSE);
+    }
+
+    uring_submit(self);
+}
+
+static gboolean uring_event_cb(gint         fd,
+                               GIOCondition condition,
+                               gpointer     user_data)
+{
+    VDAgentConnection *self = user_data;
+    eventfd_t value;
+
+    eventfd_read(fd, &value);
+
+    g_object_ref(self);
+    uring_process_completions(self);
+    g_object_unref(self);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean uring_write_idle_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->uring) {
+        priv->uring->write_idle_id = 0;
+        uring_post_write(self, FALSE);
+        uring_submit(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean uring_setup(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring;
+    gint fd, ret;
+
+    fd = get_stream_fd(priv->io_stream);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    uring = g_new0(URingBackend, 1);
+    uring->fd = fd;
+    uring->is_socket = G_IS_SOCKET_CONNECTION(priv->io_stream);
+    uring->write_fd = -1;
+
+    ret = io_uring_queue_init(URING_ENTRIES, &uring->ring, 0);
+    if (ret < 0) {
+        syslog(LOG_WARNING, "io_uring unavailable, falling back to GIO: %s",
+               g_strerror(-ret));
+        g_free(uring);
+        return FALSE;
+    }
+
+    uring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uring->event_fd == -1 ||
+        io_uring_register_eventfd(&uring->ring, uring->event_fd) < 0) {
+        syslog(LOG_WARNING, "io_uring eventfd setup failed, falling back to GIO");
+        if (uring->event_fd != -1) {
+            close(uring->event_fd);
+        }
+        io_uring_queue_exit(&uring->ring);
+        g_free(uring);
+        return FALSE;
+    }
+
+    uring->event_source = g_unix_fd_source_new(uring->event_fd, G_IO_IN);
+    g_source_set_callback(uring->event_source, (GSourceFunc) uring_event_cb,
+        g_object_ref(self), g_object_unref);
+    g_source_attach(uring->event_source, NULL);
+
+    priv->uring = uring;
+    uring_start_reading(self);
+    return TRUE;
+}
+
+static void uring_teardown(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = g_steal_pointer(&priv->uring);
+    static const guint ops[] = {
+        URING_OP_READ_POLL, URING_OP_READ, URING_OP_WRITE_POLL, URING_OP_WRITE
+    };
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    guint i, op;
+    gint ret;
+
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->write_idle_id) {
+        g_source_remove(uring->write_idle_id);
+    }
+
+    /* the kernel might still be using our buffers,
+     * cancel the operations in flight and wait for them to complete,
+     * whatever is still queued is submitted first to make room */
+    io_uring_submit(&uring->ring);
+    for (i = 0; i < G_N_ELEMENTS(ops); i++) {
+        if ((ops[i] <= URING_OP_READ_POLL && !uring->read_in_flight) ||
+            (ops[i] > URING_OP_READ_POLL && !uring->write_in_flight)) {
+            continue;
+        }
+        sqe = io_uring_get_sqe(&uring->ring);
+        if (sqe == NULL) {
+            io_uring_submit(&uring->ring);
+            sqe = io_uring_get_sqe(&uring->ring);
+        }
+        g_return_if_fail(sqe != NULL);
+        io_uring_prep_cancel(sqe, GUINT_TO_POINTER(ops[i]), 0);
+        io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_CANCEL));
+    }
+    io_uring_submit(&uring->ring);
+
+    while (uring->read_in_flight || uring->write_in_flight) {
+        ret = io_uring_wait_cqe(&uring->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            break;
+        }
+        op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        if (op == URING_OP_READ) {
+            uring->read_in_flight = FALSE;
+        } else if (op == URING_OP_WRITE) {
+            uring->write_in_flight = FALSE;
+        }
+        io_uring_cqe_seen(&uring->ring, cqe);
+    }
+
+    io_uring_queue_exit(&uring->ring);
+    close(uring->event_fd);
+    g_source_destroy(uring->event_source);
+    g_source_unref(uring->event_source);
+    g_free(uring);
+}
+
+static void uring_start_reading(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    /* a read that completed while reading was paused is processed
+     * from the main loop, the caller might be dispatching messages */
+    if (priv->uring->read_deferred) {
+        eventfd_write(priv->uring->event_fd, 1);
+        return;
+    }
+    uring_post_read(self);
+    uring_submit(self);
+}
+
+/* Defer the submission to the end of the main loop iteration,
+ * so that all messages queued meanwhile are written together. */
+static void uring_start_writing(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    URingBackend *uring = priv->uring;
+
+    if (uring->write_idle_id == 0 && !uring->write_in_flight) {
+        uring->write_idle_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                               uring_write_idle_cb,
+                                               g_object_ref(self),
+                                               g_object_unref);
+    }
+}
+
+/* Wait until the queued messages are written. */
+static void uring_flush(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    struct io_uring_cqe *cqe;
+    guint op;
+    gint ret, res;
+
+    /* the completions may destroy the connection */
+    g_object_ref(self);
+
+    uring_post_write(self, FALSE);
+    uring_submit(self);
+
+    while (priv->uring && priv->uring->write_in_flight) {
+        ret = io_uring_wait_cqe(&priv->uring->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            break;
+        }
+        op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        res = cqe->res;
+        io_uring_cqe_seen(&priv->uring->ring, cqe);
+
+        /* don't dispatch incoming messages from within flush */
+        uring_handle_completion(self, op, res, TRUE);
+        uring_submit(self);
+    }
+
+    g_object_unref(self);
+}
+
+#endif /* HAVE_LIBURING */
@@ -48,6 +48,17 @@ struct _VDAgentConnectionClass {
     void (*handle_message) (VDAgentConnection *self,
                             gpointer           header_buf,
                             gpointer           data_buf);
+
+    /* Set to TRUE if handle_message copes with @data_buf
+    * at any alignment, otherwise unaligned bodies are copied first. */
+    gboolean unaligned_data;
+
+    /* Optional, called when @n_msgs queued messages have been written.
+    *
+    * Subclasses that hold messages back can queue more from here,
+    * they are picked up by the write in progress. */
+    void (*messages_written) (VDAgentConnection *self,
+                              guint              n_msgs);
 };
 
 /* Invoked when an error occurs during read or write.
@@ -69,7 +80,10 @@ GIOStream *vdagent_socket_connect(const gchar *path, GError **err);
 /* Set up @self to use @io_stream and start reading from it.
  *
  * If @wait_on_opening is set to TRUE, EOF won't be treated as an error
- * until the first message is successfully read or written to the @io_stream. */
+ * until the first message is successfully read or written to the @io_stream.
+ *
+ * When built with --enable-io-uring, the I/O on file and socket streams
+ * is done through io_uring, GIO is used if io_uring can't be set up. */
 void vdagent_connection_setup(VDAgentConnection *self,
                               GIOStream         *io_stream,
                               gboolean           wait_on_opening,
@@ -81,7 +95,21 @@ void vdagent_connection_setup(VDAgentConnection *self,
  * unref the VDAgentConnection object. */
 void vdagent_connection_destroy(gpointer p);
 
-/* Append a message to the write queue.
+/* Priority classes of outgoing messages.
+ *
+ * Queued messages are written in the order of their priority,
+ * messages with the same priority in the order they were queued.
+ * A message that has already been partially written
+ * is always finished before anything else. */
+typedef enum {
+    VDAGENT_CONNECTION_PRIORITY_INTERACTIVE,
+    VDAGENT_CONNECTION_PRIORITY_CONTROL,
+    VDAGENT_CONNECTION_PRIORITY_BULK,
+    VDAGENT_CONNECTION_N_PRIORITIES
+} VDAgentConnPriority;
+
+/* Append a message to the write queue
+ * with VDAGENT_CONNECTION_PRIORITY_CONTROL.
  *
  * VDAgentConnection takes ownership of @data
  * and frees it once the message is flushed. */
@@ -89,9 +117,99 @@ void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size);
 
+/* Like vdagent_connection_write(), but with the given @priority. */
+void vdagent_connection_write_with_priority(VDAgentConnection  *self,
+                                            gpointer            data,
+                                            gsize               size,
+                                            VDAgentConnPriority priority);
+
+/* Append a message made of @n_segments buffers to the write queue.
+ *
+ * The segments are written back to back without being copied together,
+ * VDAgentConnection holds a reference to each of them
+ * until the message is flushed. */
+void vdagent_connection_writev(VDAgentConnection  *self,
+                               GBytes            **segments,
+                               guint               n_segments,
+                               VDAgentConnPriority priority);
+
+typedef struct _VDAgentConnMessage VDAgentConnMessage;
+
+/* Like vdagent_connection_writev(), but the message is @size bytes long
+ * and the rest of it is supplied later with vdagent_connection_append().
+ *
+ * The message is written as the data comes in and nothing else is written
+ * on @self until it is complete, so the caller must keep appending.
+ * The returned handle is valid until the last byte has been appended.
+ * Returns NULL, without queuing anything, if @segments are larger
+ * than @size. */
+VDAgentConnMessage *vdagent_connection_writev_begin(VDAgentConnection  *self,
+                                                    GBytes            **segments,
+                                                    guint               n_segments,
+                                                    gsize               size,
+                                                    VDAgentConnPriority priority);
+
+/* Append @bytes to a message started with vdagent_connection_writev_begin(),
+ * the total must not go over the size the message was started with. */
+void vdagent_connection_append(VDAgentConnection  *self,
+                               VDAgentConnMessage *msg,
+                               GBytes             *bytes);
+
+/* Like vdagent_connection_write_with_priority(), but @fd is sent
+ * along with the message. Only supported on socket connections.
+ *
+ * VDAgentConnection takes ownership of @fd
+ * and closes it once it has been sent. */
+void vdagent_connection_write_with_fd(VDAgentConnection  *self,
+                                      gpointer            data,
+                                      gsize               size,
+                                      gint                fd,
+                                      VDAgentConnPriority priority);
+
+/* Returns the FD that was sent along with the message whose header
+ * was last passed to handle_header or -1 if there's none,
+ * the caller takes ownership of it.
+ *
+ * Unclaimed FDs that came with earlier messages are closed. */
+gint vdagent_connection_steal_received_fd(VDAgentConnection *self);
+
 /* Synchronously write all queued messages to the output stream. */
 void vdagent_connection_flush(VDAgentConnection *self);
 
+/* Set the limits of the write queue.
+ *
+ * Once more than @high_bytes bytes or more than @high_msgs messages
+ * are queued, the "queue-full" signal is emitted.
+ * Once the queue drops to @low_bytes bytes and @low_msgs messages or less,
+ * the "queue-drained" signal is emitted.
+ *
+ * Setting @high_bytes or @high_msgs to 0 disables the corresponding limit,
+ * no limits are set by default.
+ *
+ * The queue is never limited by VDAgentConnection itself,
+ * it is up to the callers to stop producing data when it's full. */
+void vdagent_connection_set_write_watermarks(VDAgentConnection *self,
+                                             gsize              high_bytes,
+                                             gsize              low_bytes,
+                                             guint              high_msgs,
+                                             guint              low_msgs);
+
+/* Report @bytes in @msgs messages that a subclass holds back
+ * before queueing them, so that the watermarks account for them. */
+void vdagent_connection_set_pending(VDAgentConnection *self,
+                                    gsize              bytes,
+                                    guint              msgs);
+
+/* Returns TRUE if the write queue went over the high watermark
+ * and hasn't drained below the low watermark yet. */
+gboolean vdagent_connection_is_write_queue_full(VDAgentConnection *self);
+
+/* Stop or resume reading from the underlying stream.
+ *
+ * Messages that have already been read are still dispatched. */
+void vdagent_connection_set_read_paused(VDAgentConnection *self,
+                                        gboolean           paused);
+
 /* Returns the PID of the foreign process connected to the socket
  * or -1 with @err set. */
 gint vdagent_connection_get_peer_pid(VDAgentConnection *self,
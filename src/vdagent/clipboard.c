@@ -17,14 +17,13 @@
 */
 #include <config.h>
 
+#include <syslog.h>
 #ifdef WITH_GTK
 # include <gtk/gtk.h>
-# include <syslog.h>
-
-# include "vdagentd-proto.h"
-# include "spice/vd_agent.h"
 #endif
 
+#include "vdagentd-proto.h"
+#include "spice/vd_agent.h"
 #include "clipboard.h"
 
 #ifdef WITH_GTK
@@ -81,6 +80,12 @@ struct _VDAgentClipboards {
 
     UdscsConnection *conn;
 
+    /* data coming in VDAGENTD_CLIPBOARD_DATA_CHUNK-s, or NULL */
+    GByteArray *incoming;
+    guint       incoming_sel_id;
+    guint       incoming_type;
+    guint32     incoming_remaining;
+
 #ifdef WITH_GTK
     Selection selections[SELECTION_COUNT];
 #else
@@ -276,7 +281,15 @@ static void clipboard_contents_received_cb(GtkClipboard     *clipboard,
     type = get_type_from_atom(gtk_selection_data_get_data_type(sel_data));
     target = get_type_from_atom(gtk_selection_data_get_target(sel_data));
 
-    if (type == target) {
+    if (type == target &&
+        gtk_selection_data_get_length(sel_data) > VDAGENTD_CLIPBOARD_CHUNK_SIZE) {
+        GBytes *bytes = g_bytes_new(gtk_selection_data_get_data(sel_data),
+                                    gtk_selection_data_get_length(sel_data));
+        udscs_write_chunked(c->conn, VDAGENTD_CLIPBOARD_DATA_BEGIN,
+                            VDAGENTD_CLIPBOARD_DATA_CHUNK, sel_id, type,
+                            bytes, VDAGENTD_CLIPBOARD_CHUNK_SIZE);
+        g_bytes_unref(bytes);
+    } else if (type == target) {
         udscs_write(c->conn, VDAGENTD_CLIPBOARD_DATA, sel_id, type,
                     gtk_selection_data_get_data(sel_data),
                     gtk_selection_data_get_length(sel_data));
@@ -370,12 +383,12 @@ void vdagent_clipboard_grab(VDAgentClipboards *c, guint sel_id,
 #endif
 }
 
-void vdagent_clipboard_data(VDAgentClipboards *c, guint sel_id,
-                            guint type, guchar *data, guint size)
+#ifdef WITH_GTK
+/* Answers the request of an app for @type, a negative @length
+   tells the app that there's no data */
+static void app_request_reply(VDAgentClipboards *c, guint sel_id,
+                              guint type, guchar *data, gint length)
 {
-#ifndef WITH_GTK
-    vdagent_x11_clipboard_data(c->x11, sel_id, type, data, size);
-#else
     g_return_if_fail(sel_id < SELECTION_COUNT);
     Selection *sel = &c->selections[sel_id];
     AppRequest *req;
@@ -395,9 +408,81 @@ void vdagent_clipboard_data(VDAgentClipboards *c, guint sel_id,
 
     gtk_selection_data_set(req->sel_data,
                            gtk_selection_data_get_target(req->sel_data),
-                           8, data, size);
+                           8, data, length);
 
     g_main_loop_quit(req->loop);
+}
+#endif
+
+void vdagent_clipboard_data(VDAgentClipboards *c, guint sel_id,
+                            guint type, guchar *data, guint size)
+{
+#ifndef WITH_GTK
+    vdagent_x11_clipboard_data(c->x11, sel_id, type, data, size);
+#else
+    app_request_reply(c, sel_id, type, data, size);
+#endif
+}
+
+static void clipboard_data_finish(VDAgentClipboards *c)
+{
+    GByteArray *data = c->incoming;
+
+    c->incoming = NULL;
+    vdagent_clipboard_data(c, c->incoming_sel_id, c->incoming_type,
+                           data->data, data->len);
+    g_byte_array_unref(data);
+}
+
+void vdagent_clipboard_data_begin(VDAgentClipboards *c, guint sel_id,
+                                  guint type, guint32 size)
+{
+    if (c->incoming) {
+        syslog(LOG_WARNING, "%s: sel_id=%u: previous clipboard data "
+                            "is incomplete, dropping it", __func__, sel_id);
+        vdagent_clipboard_data_abort(c, c->incoming_sel_id);
+    }
+
+    c->incoming = g_byte_array_sized_new(size);
+    c->incoming_sel_id = sel_id;
+    c->incoming_type = type;
+    c->incoming_remaining = size;
+    if (size == 0)
+        clipboard_data_finish(c);
+}
+
+void vdagent_clipboard_data_chunk(VDAgentClipboards *c, guint sel_id,
+                                  guchar *data, guint size)
+{
+    if (c->incoming == NULL || sel_id != c->incoming_sel_id) {
+        syslog(LOG_WARNING, "%s: sel_id=%u: clipboard data chunk without "
+                            "a beginning, ignoring", __func__, sel_id);
+        return;
+    }
+    if (size > c->incoming_remaining) {
+        syslog(LOG_WARNING, "%s: sel_id=%u: too much clipboard data, "
+                            "dropping it", __func__, sel_id);
+        vdagent_clipboard_data_abort(c, sel_id);
+        return;
+    }
+
+    g_byte_array_append(c->incoming, data, size);
+    c->incoming_remaining -= size;
+    if (c->incoming_remaining == 0)
+        clipboard_data_finish(c);
+}
+
+void vdagent_clipboard_data_abort(VDAgentClipboards *c, guint sel_id)
+{
+    if (c->incoming == NULL || sel_id != c->incoming_sel_id)
+        return;
+
+    g_clear_pointer(&c->incoming, g_byte_array_unref);
+    /* the request the data was meant for gets no answer */
+#ifndef WITH_GTK
+    vdagent_x11_clipboard_data(c->x11, sel_id, VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+#else
+    app_request_reply(c, sel_id, c->incoming_type, NULL, -1);
 #endif
 }
 
@@ -498,8 +583,10 @@ vdagent_clipboards_set_conn(VDAgentClipboards *self, UdscsConnection *conn)
 
 static void vdagent_clipboards_dispose(GObject *obj)
 {
-#ifdef WITH_GTK
     VDAgentClipboards *self = VDAGENT_CLIPBOARDS(obj);
+
+    g_clear_pointer(&self->incoming, g_byte_array_unref);
+#ifdef WITH_GTK
     guint sel_id;
 
     for (sel_id = 0; sel_id < SELECTION_COUNT; sel_id++)
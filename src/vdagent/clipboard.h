@@ -40,6 +40,16 @@ void vdagent_clipboards_release_all(VDAgentClipboards *c);
 void vdagent_clipboard_data(VDAgentClipboards *c, guint sel_id,
                             guint type, guchar *data, guint size);
 
+/* Data that's passed in several pieces, as vdagentd relays it from the
+   client. Aborted data isn't passed on and its request is refused. */
+void vdagent_clipboard_data_begin(VDAgentClipboards *c, guint sel_id,
+                                  guint type, guint32 size);
+
+void vdagent_clipboard_data_chunk(VDAgentClipboards *c, guint sel_id,
+                                  guchar *data, guint size);
+
+void vdagent_clipboard_data_abort(VDAgentClipboards *c, guint sel_id);
+
 void vdagent_clipboard_grab(VDAgentClipboards *c, guint sel_id,
                             guint32 *types, guint n_types);
 
@@ -191,6 +191,25 @@ static void daemon_read_complete(UdscsConnection *conn,
         vdagent_clipboard_data(agent->clipboards, header->arg1, header->arg2,
                                data, header->size);
         break;
+    case VDAGENTD_CLIPBOARD_DATA_BEGIN: {
+        guint32 size;
+
+        if (header->size != sizeof(size)) {
+            syslog(LOG_ERR, "invalid clipboard data begin, ignoring");
+            break;
+        }
+        memcpy(&size, data, sizeof(size));
+        vdagent_clipboard_data_begin(agent->clipboards, header->arg1,
+                                     header->arg2, size);
+        break;
+    }
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
+        vdagent_clipboard_data_chunk(agent->clipboards, header->arg1,
+                                     data, header->size);
+        break;
+    case VDAGENTD_CLIPBOARD_DATA_ABORT:
+        vdagent_clipboard_data_abort(agent->clipboards, header->arg1);
+        break;
     case VDAGENTD_CLIPBOARD_RELEASE:
         vdagent_clipboard_release(agent->clipboards, header->arg1);
         break;
@@ -1132,7 +1132,10 @@ no_info:
         }
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_GUEST_XORG_RESOLUTION, width, height,
-                (uint8_t *)res_array->data, res_array->len * sizeof(struct vdagentd_guest_xorg_resolution));
+    /* doesn't depend on any clipboard or file data queued before it */
+    udscs_write_with_priority(x11->vdagentd, VDAGENTD_GUEST_XORG_RESOLUTION,
+                              width, height, (uint8_t *)res_array->data,
+                              res_array->len * sizeof(struct vdagentd_guest_xorg_resolution),
+                              VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
     g_array_free(res_array, TRUE);
 }
@@ -895,8 +895,16 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         len = 0;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
+    if (len > VDAGENTD_CLIPBOARD_CHUNK_SIZE) {
+        GBytes *bytes = g_bytes_new(data, len);
+        udscs_write_chunked(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA_BEGIN,
+                            VDAGENTD_CLIPBOARD_DATA_CHUNK, selection, type,
+                            bytes, VDAGENTD_CLIPBOARD_CHUNK_SIZE);
+        g_bytes_unref(bytes);
+    } else {
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
+                    data, len);
+    }
     vdagent_x11_get_selection_free(x11, data, incr);
 
     vdagent_x11_next_conversion_request(x11);
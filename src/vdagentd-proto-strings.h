@@ -37,6 +37,9 @@ static const char * const vdagentd_messages[] = {
         "file xfer disable",
         "client disconnected",
         "graphics device info",
+        "clipboard data begin",
+        "clipboard data chunk",
+        "clipboard data abort",
 };
 
 #endif
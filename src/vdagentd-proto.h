@@ -45,9 +45,20 @@ enum {
     VDAGENTD_FILE_XFER_DISABLE,
     VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
     VDAGENTD_GRAPHICS_DEVICE_INFO,  /* daemon -> client */
+    VDAGENTD_CLIPBOARD_DATA_BEGIN,  /* arg1: sel, arg2: type,
+                                       data: uint32_t size of the data that
+                                       follows in VDAGENTD_CLIPBOARD_DATA_CHUNK-s */
+    VDAGENTD_CLIPBOARD_DATA_CHUNK,  /* arg1: sel, data: next part of the data */
+    VDAGENTD_CLIPBOARD_DATA_ABORT,  /* daemon -> client, arg1: sel, arg2: type,
+                                       the rest of the data isn't coming */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
+/* Clipboard data larger than this is sent in VDAGENTD_CLIPBOARD_DATA_CHUNK-s
+   of this size, so that vdagentd can pass it on without holding all of it.
+   Data relayed from the spice client comes in chunks of up to this size. */
+#define VDAGENTD_CLIPBOARD_CHUNK_SIZE (32 * 1024)
+
 struct vdagentd_guest_xorg_resolution {
     int width;
     int height;
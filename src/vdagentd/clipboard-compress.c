@@ -0,0 +1,342 @@
+/*  clipboard-compress.c vdagentd clipboard compression code
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+#include <gio/gio.h>
+#include "clipboard-compress.h"
+
+#define CONVERT_CHUNK_SIZE (64 * 1024)
+
+/* Compressed data must be at most 7/8 of the original size */
+#define COMPRESS_RATIO_NUM 7
+#define COMPRESS_RATIO_DEN 8
+
+struct ClipboardDeflater {
+    GConverter *compressor;
+    /* the size header and the compressed data */
+    GByteArray *out;
+    uint32_t size;
+    uint32_t in_size;
+    gboolean finished;
+};
+
+struct ClipboardInflater {
+    GConverter *decompressor;
+    uint8_t header[sizeof(uint32_t)];
+    guint header_len;
+    uint32_t size;
+    gsize out_size;
+    gboolean finished;
+};
+
+static gboolean compress_worth_it(gsize in_size, gsize out_size)
+{
+    return out_size * COMPRESS_RATIO_DEN <= in_size * COMPRESS_RATIO_NUM;
+}
+
+/* Runs @converter over the @in_size bytes of @in and appends the output
+ * to @out, which must not grow over @max_out bytes.
+ *
+ * With G_CONVERTER_FLUSH or G_CONVERTER_INPUT_AT_END, all of the pending
+ * output is written too. The number of bytes that were not consumed
+ * because the stream ended is stored in @in_left. */
+static GConverterResult convert(GConverter *converter,
+                                const uint8_t *in, gsize in_size,
+                                GConverterFlags flags,
+                                GByteArray *out, gsize max_out,
+                                gsize *in_left, GError **err)
+{
+    GConverterResult res;
+    GError *local_err = NULL;
+    gsize bytes_read, bytes_written, len;
+
+    do {
+        len = out->len;
+        g_byte_array_set_size(out, len + CONVERT_CHUNK_SIZE);
+        res = g_converter_convert(converter, in, in_size,
+                                  out->data + len, CONVERT_CHUNK_SIZE, flags,
+                                  &bytes_read, &bytes_written, &local_err);
+        if (res == G_CONVERTER_ERROR) {
+            g_byte_array_set_size(out, len);
+            /* the previous call happened to fill the output exactly */
+            if (in_size == 0 && flags == G_CONVERTER_NO_FLAGS &&
+                g_error_matches(local_err, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) {
+                g_clear_error(&local_err);
+                res = G_CONVERTER_CONVERTED;
+            }
+            break;
+        }
+        g_byte_array_set_size(out, len + bytes_written);
+        in += bytes_read;
+        in_size -= bytes_read;
+
+        if (out->len > max_out) {
+            g_set_error(&local_err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "Decompressed data is larger than announced");
+            res = G_CONVERTER_ERROR;
+            break;
+        }
+    } while (res == G_CONVERTER_CONVERTED &&
+             (in_size > 0 || bytes_written == CONVERT_CHUNK_SIZE ||
+              flags != G_CONVERTER_NO_FLAGS));
+
+    if (local_err)
+        g_propagate_error(err, local_err);
+    if (in_left)
+        *in_left = in_size;
+    return res;
+}
+
+GBytes *clipboard_compress(uint32_t data_type, GBytes *data)
+{
+    ClipboardDeflater *deflater;
+    GBytes *compressed = NULL;
+    const uint8_t *in;
+    gsize size;
+
+    in = g_bytes_get_data(data, &size);
+    if (size > G_MAXUINT32)
+        return NULL;
+
+    deflater = clipboard_deflater_new(data_type, size);
+    if (!deflater)
+        return NULL;
+    if (clipboard_deflater_feed(deflater, in, size))
+        compressed = clipboard_deflater_finish(deflater);
+    clipboard_deflater_free(deflater);
+    if (compressed && !compress_worth_it(size, g_bytes_get_size(compressed)))
+        g_clear_pointer(&compressed, g_bytes_unref);
+    return compressed;
+}
+
+ClipboardDeflater *clipboard_deflater_new(uint32_t data_type, uint32_t size)
+{
+    ClipboardDeflater *deflater;
+    uint32_t header;
+
+    switch (data_type) {
+    case VD_AGENT_CLIPBOARD_IMAGE_PNG:
+    case VD_AGENT_CLIPBOARD_IMAGE_JPG:
+        return NULL;
+    }
+    if (size < CLIPBOARD_COMPRESS_MIN_SIZE)
+        return NULL;
+
+    deflater = g_new0(ClipboardDeflater, 1);
+    deflater->compressor =
+        G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+    deflater->out =
+        g_byte_array_sized_new(MIN(size / 2, CLIPBOARD_COMPRESS_SAMPLE_SIZE));
+    deflater->size = size;
+    header = GUINT32_TO_LE(size);
+    g_byte_array_append(deflater->out, (const guint8 *)&header, sizeof(header));
+    return deflater;
+}
+
+static gboolean deflater_convert(ClipboardDeflater *deflater,
+                                 const uint8_t *data, gsize size)
+{
+    GConverterFlags flags = G_CONVERTER_NO_FLAGS;
+    GConverterResult res;
+
+    if (size == 0)
+        return TRUE;
+
+    /* the end of the sample is flushed to see how well it compressed */
+    deflater->in_size += size;
+    if (deflater->in_size == deflater->size)
+        flags = G_CONVERTER_INPUT_AT_END;
+    else if (deflater->in_size == CLIPBOARD_COMPRESS_SAMPLE_SIZE)
+        flags = G_CONVERTER_FLUSH;
+
+    res = convert(deflater->compressor, data, size, flags,
+                  deflater->out, G_MAXSIZE, NULL, NULL);
+    deflater->finished = res == G_CONVERTER_FINISHED;
+    return res != G_CONVERTER_ERROR;
+}
+
+gboolean clipboard_deflater_feed(ClipboardDeflater *deflater,
+                                 const uint8_t *data, gsize size)
+{
+    gsize n;
+
+    g_return_val_if_fail(size <= deflater->size - deflater->in_size, FALSE);
+
+    if (deflater->size > CLIPBOARD_COMPRESS_SAMPLE_SIZE &&
+        deflater->in_size < CLIPBOARD_COMPRESS_SAMPLE_SIZE) {
+        n = MIN(size, CLIPBOARD_COMPRESS_SAMPLE_SIZE - deflater->in_size);
+        if (!deflater_convert(deflater, data, n))
+            return FALSE;
+        data += n;
+        size -= n;
+        if (deflater->in_size == CLIPBOARD_COMPRESS_SAMPLE_SIZE &&
+            !compress_worth_it(CLIPBOARD_COMPRESS_SAMPLE_SIZE,
+                               deflater->out->len - sizeof(uint32_t)))
+            return FALSE;
+    }
+    return deflater_convert(deflater, data, size);
+}
+
+GBytes *clipboard_deflater_finish(ClipboardDeflater *deflater)
+{
+    GBytes *bytes;
+
+    if (!deflater->finished)
+        return NULL;
+
+    bytes = g_byte_array_free_to_bytes(deflater->out);
+    deflater->out = NULL;
+    return bytes;
+}
+
+void clipboard_deflater_free(ClipboardDeflater *deflater)
+{
+    g_object_unref(deflater->compressor);
+    if (deflater->out)
+        g_byte_array_unref(deflater->out);
+    g_free(deflater);
+}
+
+ClipboardInflater *clipboard_inflater_new(void)
+{
+    ClipboardInflater *inflater = g_new0(ClipboardInflater, 1);
+
+    inflater->decompressor =
+        G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+    return inflater;
+}
+
+GBytes *clipboard_inflater_feed(ClipboardInflater *inflater,
+                                const uint8_t *data, gsize size,
+                                GError **err)
+{
+    GConverterResult res;
+    GByteArray *out;
+    gsize n, left;
+
+    if (inflater->header_len < sizeof(inflater->header)) {
+        n = MIN(size, sizeof(inflater->header) - inflater->header_len);
+        memcpy(inflater->header + inflater->header_len, data, n);
+        inflater->header_len += n;
+        data += n;
+        size -= n;
+
+        if (inflater->header_len == sizeof(inflater->header)) {
+            memcpy(&inflater->size, inflater->header, sizeof(inflater->size));
+            inflater->size = GUINT32_FROM_LE(inflater->size);
+            if (inflater->size > CLIPBOARD_DECOMPRESS_MAX_SIZE) {
+                g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                            "Compressed clipboard is too large (%u bytes)",
+                            inflater->size);
+                return NULL;
+            }
+        }
+    }
+
+    out = g_byte_array_new();
+    if (size == 0)
+        return g_byte_array_free_to_bytes(out);
+
+    if (inflater->finished) {
+        left = size;
+    } else {
+        res = convert(inflater->decompressor, data, size, G_CONVERTER_NO_FLAGS,
+                      out, inflater->size - inflater->out_size, &left, err);
+        if (res == G_CONVERTER_ERROR) {
+            g_byte_array_unref(out);
+            return NULL;
+        }
+        inflater->out_size += out->len;
+        inflater->finished = res == G_CONVERTER_FINISHED;
+    }
+
+    if (left > 0) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Unexpected data after the compressed clipboard");
+        g_byte_array_unref(out);
+        return NULL;
+    }
+    return g_byte_array_free_to_bytes(out);
+}
+
+uint32_t clipboard_inflater_get_size(ClipboardInflater *inflater)
+{
+    return inflater->size;
+}
+
+gboolean clipboard_inflater_is_done(ClipboardInflater *inflater)
+{
+    return inflater->finished && inflater->out_size == inflater->size;
+}
+
+void clipboard_inflater_free(ClipboardInflater *inflater)
+{
+    g_object_unref(inflater->decompressor);
+    g_free(inflater);
+}
+
+GBytes *clipboard_decompress(const uint8_t *prefix, gsize prefix_size,
+                             const uint8_t *data, gsize size, GError **err)
+{
+    GConverter *decompressor;
+    GConverterResult res;
+    GByteArray *out;
+    uint32_t out_size;
+    gsize left;
+
+    if (size < sizeof(out_size)) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Compressed clipboard is truncated");
+        return NULL;
+    }
+    memcpy(&out_size, data, sizeof(out_size));
+    out_size = GUINT32_FROM_LE(out_size);
+    if (out_size > CLIPBOARD_DECOMPRESS_MAX_SIZE) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Compressed clipboard is too large (%u bytes)", out_size);
+        return NULL;
+    }
+
+    /* convert() never needs more room than this, so the data
+       is written in place and handed out without being copied */
+    out = g_byte_array_sized_new(prefix_size + out_size + CONVERT_CHUNK_SIZE);
+    g_byte_array_append(out, prefix, prefix_size);
+    decompressor = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+    res = convert(decompressor, data + sizeof(out_size), size - sizeof(out_size),
+                  G_CONVERTER_NO_FLAGS, out, prefix_size + out_size, &left, err);
+    g_object_unref(decompressor);
+
+    if (res == G_CONVERTER_ERROR) {
+        g_byte_array_unref(out);
+        return NULL;
+    }
+    if (res != G_CONVERTER_FINISHED || out->len != prefix_size + out_size) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Compressed clipboard is truncated");
+        g_byte_array_unref(out);
+        return NULL;
+    }
+    if (left > 0) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Unexpected data after the compressed clipboard");
+        g_byte_array_unref(out);
+        return NULL;
+    }
+    return g_byte_array_free_to_bytes(out);
+}
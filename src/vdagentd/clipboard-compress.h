@@ -0,0 +1,110 @@
+/*  clipboard-compress.h vdagentd clipboard compression header file
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_CLIPBOARD_COMPRESS_H
+#define __VDAGENTD_CLIPBOARD_COMPRESS_H
+
+#include <stdint.h>
+#include <glib.h>
+#include <spice/vd_agent.h>
+
+/* Clipboard compression isn't part of spice-protocol, which defines
+   neither a capability nor a payload format for it, and no SPICE client
+   implements it. It's only offered when built with
+   --enable-clipboard-compression, for clients implementing the format
+   below, until spice-protocol defines one.
+
+   Both sides announce VDAGENTD_CAP_CLIPBOARD_COMPRESSION. Once they
+   have, either of them may set VD_AGENT_CLIPBOARD_COMPRESSED in the type
+   of a VD_AGENT_CLIPBOARD message; the type without it is the data type.
+   The data after the VDAgentClipboard header then is:
+
+     uint32_t size;    size of the uncompressed data, little-endian
+     uint8_t data[];   the data as a raw deflate stream (RFC 1951,
+                       without a zlib or gzip header)
+
+   Without the capability the flag has no meaning and types are taken
+   as they are. */
+#define VDAGENTD_CAP_CLIPBOARD_COMPRESSION 31
+#define VD_AGENT_CLIPBOARD_COMPRESSED 0x80000000u
+
+/* Data smaller than this is always sent as is */
+#define CLIPBOARD_COMPRESS_MIN_SIZE 1024
+
+/* The first part of the data is compressed on its own to find out
+   whether the rest is worth compressing */
+#define CLIPBOARD_COMPRESS_SAMPLE_SIZE (64 * 1024)
+
+/* Uncompressed data larger than this is rejected */
+#define CLIPBOARD_DECOMPRESS_MAX_SIZE (256 * 1024 * 1024)
+
+/* Returns the compressed form of @data, including the size header,
+   or NULL if @data_type or the data itself doesn't compress well
+   enough to be worth it. Data that is already compressed is
+   detected early, without compressing all of it. */
+GBytes *clipboard_compress(uint32_t data_type, GBytes *data);
+
+/* Streaming compression of data whose size is known beforehand,
+   so that it can be compressed piece by piece as it comes in. */
+typedef struct ClipboardDeflater ClipboardDeflater;
+
+/* Returns NULL if data of @data_type and @size isn't worth compressing */
+ClipboardDeflater *clipboard_deflater_new(uint32_t data_type, uint32_t size);
+
+/* Compresses the next @size bytes of the data. Returns FALSE if the data
+   turns out not to compress well enough, which is known by the end of
+   the sample, the rest shouldn't be fed then. */
+gboolean clipboard_deflater_feed(ClipboardDeflater *deflater,
+                                 const uint8_t *data, gsize size);
+
+/* Returns the compressed data, including the size header, once all of
+   the data has been fed. It's returned even if the data after the sample
+   compressed worse, as the data may not be around to be sent as is. */
+GBytes *clipboard_deflater_finish(ClipboardDeflater *deflater);
+
+void clipboard_deflater_free(ClipboardDeflater *deflater);
+
+/* Streaming decompression of the data of a compressed VD_AGENT_CLIPBOARD
+   message, including the size header. */
+typedef struct ClipboardInflater ClipboardInflater;
+
+ClipboardInflater *clipboard_inflater_new(void);
+
+/* Returns the data decompressed from the next @size bytes, which may be
+   empty, or NULL with @err set if the stream is corrupt or larger
+   than announced. */
+GBytes *clipboard_inflater_feed(ClipboardInflater *inflater,
+                                const uint8_t *data, gsize size,
+                                GError **err);
+
+/* Returns the uncompressed size from the header or 0 if it hasn't been
+   fed yet */
+uint32_t clipboard_inflater_get_size(ClipboardInflater *inflater);
+
+/* Returns TRUE once the end of the stream and all of the announced data
+   has been decompressed */
+gboolean clipboard_inflater_is_done(ClipboardInflater *inflater);
+
+void clipboard_inflater_free(ClipboardInflater *inflater);
+
+/* Decompresses all of the @size bytes of @data at once, the result starts
+   with the @prefix_size bytes of @prefix, e.g. the header of the message.
+   Returns NULL with @err set on failure. */
+GBytes *clipboard_decompress(const uint8_t *prefix, gsize prefix_size,
+                             const uint8_t *data, gsize size, GError **err);
+
+#endif
@@ -0,0 +1,71 @@
+/*  clipboard-prefetch.c vdagentd clipboard prefetch code
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include "clipboard-prefetch.h"
+
+gboolean clipboard_prefetch_begin(ClipboardPrefetch *prefetch)
+{
+    if (*prefetch != CLIPBOARD_PREFETCH_NONE)
+        return FALSE;
+
+    *prefetch = CLIPBOARD_PREFETCH_PENDING;
+    return TRUE;
+}
+
+void clipboard_prefetch_cancel(ClipboardPrefetch *prefetch)
+{
+    /* a response the agent is waiting for is still relayed */
+    if (*prefetch == CLIPBOARD_PREFETCH_PENDING)
+        *prefetch = CLIPBOARD_PREFETCH_STALE;
+}
+
+gboolean clipboard_prefetch_agent_request(ClipboardPrefetch *prefetch)
+{
+    if (*prefetch == CLIPBOARD_PREFETCH_PENDING) {
+        *prefetch = CLIPBOARD_PREFETCH_FOR_AGENT;
+        return TRUE;
+    }
+
+    /* Should the client still answer the outstanding request, the agent
+       gets that response, which is no worse than a paste that never
+       completes */
+    *prefetch = CLIPBOARD_PREFETCH_NONE;
+    return FALSE;
+}
+
+int clipboard_prefetch_match(ClipboardPrefetch *prefetch, gboolean claim)
+{
+    int ret;
+
+    switch (*prefetch) {
+    case CLIPBOARD_PREFETCH_PENDING:
+        ret = CLIPBOARD_RESPONSE_PREFETCH;
+        break;
+    case CLIPBOARD_PREFETCH_STALE:
+        ret = CLIPBOARD_RESPONSE_STALE;
+        break;
+    default:
+        ret = CLIPBOARD_RESPONSE_AGENT;
+        break;
+    }
+
+    if (claim)
+        *prefetch = CLIPBOARD_PREFETCH_NONE;
+    return ret;
+}
@@ -0,0 +1,61 @@
+/*  clipboard-prefetch.h vdagentd clipboard prefetch header file
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_CLIPBOARD_PREFETCH_H
+#define __VDAGENTD_CLIPBOARD_PREFETCH_H
+
+#include <glib.h>
+
+/* Tracks the prefetch request of a selection. Responses carry neither
+   a serial nor a request id, they're matched to the requests in order,
+   so at most one prefetch request is outstanding at a time. */
+typedef enum {
+    /* no prefetch request outstanding */
+    CLIPBOARD_PREFETCH_NONE,
+    /* the response is to be cached */
+    CLIPBOARD_PREFETCH_PENDING,
+    /* the agent asked for the data meanwhile, the response is relayed */
+    CLIPBOARD_PREFETCH_FOR_AGENT,
+    /* the selection changed hands since, the response is dropped */
+    CLIPBOARD_PREFETCH_STALE,
+} ClipboardPrefetch;
+
+/* Who a response from the client is for */
+enum {
+    CLIPBOARD_RESPONSE_AGENT,
+    CLIPBOARD_RESPONSE_PREFETCH,
+    CLIPBOARD_RESPONSE_STALE,
+};
+
+/* Returns FALSE if the response to the previous request is still
+   to come, no request should be sent then */
+gboolean clipboard_prefetch_begin(ClipboardPrefetch *prefetch);
+
+/* Called when the selection changes hands */
+void clipboard_prefetch_cancel(ClipboardPrefetch *prefetch);
+
+/* Called when the agent requests the prefetched type. Returns TRUE if
+   the response to the prefetch will answer it, otherwise the request is
+   to be sent on. A stale prefetch the client may never answer is given
+   up on, so that it can't take the response meant for the agent. */
+gboolean clipboard_prefetch_agent_request(ClipboardPrefetch *prefetch);
+
+/* Returns who a response of the prefetched type is for, the prefetch
+   is only marked as answered if @claim is TRUE */
+int clipboard_prefetch_match(ClipboardPrefetch *prefetch, gboolean claim);
+
+#endif
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <glib.h>
+#include <glib-unix.h>
 
 struct session_info {
     DBusConnection *connection;
@@ -39,6 +40,26 @@ struct session_info {
     gchar *match_session_signals;
     gboolean session_is_locked;
     gboolean session_idle_hint;
+    /* Session the cached result of session_info_is_user() is for */
+    gchar *user_session;
+    gboolean is_user;
+    /* Serial of the GetSessionType request ConsoleKit hasn't answered yet */
+    dbus_uint32_t session_type_serial;
+    /* GetSessionForUnixProcess calls waiting for a reply */
+    GList *pid_lookups;
+    /* Answered lookups, their callbacks are run from finish_idle_id */
+    GQueue finished_lookups;
+    guint finish_idle_id;
+    guint read_idle_id;
+    guint write_watch_id;
+};
+
+struct si_pid_lookup {
+    dbus_uint32_t serial;
+    char *ssid;
+    session_info_session_cb cb;
+    gpointer user_data;
+    GDestroyNotify notify;
 };
 
 #define INTERFACE_CONSOLE_KIT "org.freedesktop.ConsoleKit"
@@ -60,15 +81,58 @@ struct session_info {
 
 static char *console_kit_get_first_seat(struct session_info *info);
 static char *console_kit_check_active_session_change(struct session_info *info);
+static void console_kit_read_session_for_pid(struct session_info *info,
+                                             DBusMessage *reply);
+static void console_kit_read_session_type(struct session_info *info,
+                                          DBusMessage *reply);
+static void console_kit_request_session_type(struct session_info *info);
+static void si_dbus_read_signals(struct session_info *info);
+
+static gboolean console_kit_read_idle(gpointer user_data)
+{
+    struct session_info *info = user_data;
 
+    info->read_idle_id = 0;
+    si_dbus_read_signals(info);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean si_dbus_write_cb(gint fd, GIOCondition condition,
+                                 gpointer user_data)
+{
+    struct session_info *info = user_data;
+
+    info->write_watch_id = 0;
+    /* Nothing is written while read messages wait to be popped */
+    si_dbus_read_signals(info);
+    return G_SOURCE_REMOVE;
+}
+
+/* Writes the queued messages as far as the socket takes them without
+ * blocking, the rest is written once it becomes writable again */
+static void si_dbus_send_queued(struct session_info *info)
+{
+    dbus_connection_read_write(info->connection, 0);
+    if (dbus_connection_has_messages_to_send(info->connection) &&
+        info->write_watch_id == 0)
+        info->write_watch_id = g_unix_fd_add(info->fd, G_IO_OUT,
+                                             si_dbus_write_cb, info);
+
+    /* Messages read along the way won't wake up the fd watch,
+     * so make sure they're looked at */
+    if (dbus_connection_get_dispatch_status(info->connection) ==
+            DBUS_DISPATCH_DATA_REMAINS && info->read_idle_id == 0)
+        info->read_idle_id = g_idle_add(console_kit_read_idle, info);
+}
+
+/* The match rules are changed without a DBusError, so that the bus
+ * isn't waited for */
 static void si_dbus_match_remove(struct session_info *info)
 {
-    DBusError error;
     if (info->match_seat_signals != NULL) {
-        dbus_error_init(&error);
         dbus_bus_remove_match(info->connection,
                               info->match_seat_signals,
-                              &error);
+                              NULL);
         if (info->verbose)
             syslog(LOG_DEBUG, "(console-kit) seat match removed: %s",
                    info->match_seat_signals);
@@ -76,10 +140,9 @@ static void si_dbus_match_remove(struct session_info *info)
     }
 
     if (info->match_session_signals != NULL) {
-        dbus_error_init(&error);
         dbus_bus_remove_match(info->connection,
                               info->match_session_signals,
-                              &error);
+                              NULL);
 
         if (info->verbose)
             syslog(LOG_DEBUG, "(console-kit) session match removed: %s",
@@ -90,8 +153,6 @@ static void si_dbus_match_remove(struct session_info *info)
 
 static void si_dbus_match_rule_update(struct session_info *info)
 {
-    DBusError error;
-
     if (info->connection == NULL)
         return;
 
@@ -108,16 +169,9 @@ static void si_dbus_match_rule_update(struct session_info *info)
             syslog(LOG_DEBUG, "(console-kit) seat match: %s",
                    info->match_seat_signals);
 
-        dbus_error_init(&error);
         dbus_bus_add_match(info->connection,
                            info->match_seat_signals,
-                           &error);
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-                   error.message);
-            dbus_error_free(&error);
-            g_clear_pointer(&info->match_seat_signals, g_free);
-        }
+                           NULL);
     }
 
     /* Session signals */
@@ -130,17 +184,14 @@ static void si_dbus_match_rule_update(struct session_info *info)
             syslog(LOG_DEBUG, "(console-kit) session match: %s",
                    info->match_session_signals);
 
-        dbus_error_init(&error);
         dbus_bus_add_match(info->connection,
                            info->match_session_signals,
-                           &error);
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-                   error.message);
-            dbus_error_free(&error);
-            g_clear_pointer(&info->match_session_signals, g_free);
-        }
+                           NULL);
     }
+
+    if (g_strcmp0(info->user_session, info->active_session) != 0)
+        console_kit_request_session_type(info);
+    si_dbus_send_queued(info);
 }
 
 static void
@@ -152,14 +203,26 @@ si_dbus_read_signals(struct session_info *info)
     message = dbus_connection_pop_message(info->connection);
     while (message != NULL) {
         const char *member;
+        int message_type;
 
+        message_type = dbus_message_get_type(message);
         member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SEAT_SIGNAL_ACTIVE_SESSION_CHANGED) == 0) {
+        if (message_type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+            message_type == DBUS_MESSAGE_TYPE_ERROR) {
+            if (info->session_type_serial != 0 &&
+                dbus_message_get_reply_serial(message) ==
+                    info->session_type_serial)
+                console_kit_read_session_type(info, message);
+            else
+                console_kit_read_session_for_pid(info, message);
+        } else if (g_strcmp0(member, SEAT_SIGNAL_ACTIVE_SESSION_CHANGED) == 0) {
             DBusMessageIter iter;
             gint type;
             gchar *session;
 
             g_clear_pointer(&info->active_session, g_free);
+            /* A pending GetSessionType is for the previous session */
+            info->session_type_serial = 0;
 
             dbus_message_iter_init(message, &iter);
             type = dbus_message_iter_get_arg_type(&iter);
@@ -200,7 +263,7 @@ si_dbus_read_signals(struct session_info *info)
                        type);
             }
         } else {
-            if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
+            if (message_type != DBUS_MESSAGE_TYPE_SIGNAL) {
                 syslog(LOG_WARNING, "(console-kit) received non signal message");
             } else if (info->verbose) {
                 syslog(LOG_DEBUG, "(console-kit) Signal not handled: %s", member);
@@ -211,6 +274,12 @@ si_dbus_read_signals(struct session_info *info)
         dbus_connection_read_write(info->connection, 0);
         message = dbus_connection_pop_message(info->connection);
     }
+
+    /* What the socket didn't take yet */
+    if (dbus_connection_has_messages_to_send(info->connection) &&
+        info->write_watch_id == 0)
+        info->write_watch_id = g_unix_fd_add(info->fd, G_IO_OUT,
+                                             si_dbus_write_cb, info);
 }
 
 struct session_info *session_info_create(int verbose)
@@ -220,6 +289,7 @@ struct session_info *session_info_create(int verbose)
 
     info = g_new0(struct session_info, 1);
     info->verbose = verbose;
+    g_queue_init(&info->finished_lookups);
     info->session_is_locked = FALSE;
     info->session_idle_hint = FALSE;
 
@@ -251,15 +321,33 @@ struct session_info *session_info_create(int verbose)
     return info;
 }
 
+static void si_pid_lookup_free(struct si_pid_lookup *lookup)
+{
+    if (lookup->notify)
+        lookup->notify(lookup->user_data);
+    free(lookup->ssid);
+    g_free(lookup);
+}
+
 void session_info_destroy(struct session_info *info)
 {
     if (!info)
         return;
 
+    if (info->read_idle_id)
+        g_source_remove(info->read_idle_id);
+    if (info->finish_idle_id)
+        g_source_remove(info->finish_idle_id);
+    if (info->write_watch_id)
+        g_source_remove(info->write_watch_id);
+    g_list_free_full(info->pid_lookups, (GDestroyNotify)si_pid_lookup_free);
+    while (!g_queue_is_empty(&info->finished_lookups))
+        si_pid_lookup_free(g_queue_pop_head(&info->finished_lookups));
     si_dbus_match_remove(info);
     dbus_connection_close(info->connection);
     g_free(info->seat);
     g_free(info->active_session);
+    g_free(info->user_session);
     g_free(info);
 }
 
@@ -399,16 +487,19 @@ exit:
     return console_kit_check_active_session_change(info);
 }
 
-char *session_info_session_for_pid(struct session_info *info, uint32_t pid)
+void session_info_session_for_pid_async(struct session_info *info, uint32_t pid,
+                                        session_info_session_cb cb,
+                                        gpointer user_data,
+                                        GDestroyNotify notify)
 {
-    DBusError error;
     DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
     DBusMessageIter args;
-    char *ssid = NULL;
+    struct si_pid_lookup *lookup;
 
-    if (!info)
-        return NULL;
+    lookup = g_new0(struct si_pid_lookup, 1);
+    lookup->cb = cb;
+    lookup->user_data = user_data;
+    lookup->notify = notify;
 
     message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
                                            OBJ_PATH_CONSOLE_KIT_MANAGER,
@@ -416,56 +507,94 @@ char *session_info_session_for_pid(struct session_info *info, uint32_t pid)
                                            "GetSessionForUnixProcess");
     if (message == NULL) {
         syslog(LOG_ERR, "Unable to create dbus message");
-        goto exit;
+        goto error;
     }
 
     dbus_message_iter_init_append(message, &args);
     if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT32, &pid)) {
         syslog(LOG_ERR, "Unable to append dbus message args");
-        goto exit;
+        goto error;
     }
 
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(info->connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL || dbus_error_is_set(&error)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "GetSessionForUnixProcess failed: %s",
-                   error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "GetSessionForUnixProcess failed");
-        goto exit;
+    if (!dbus_connection_send(info->connection, message, &lookup->serial)) {
+        syslog(LOG_ERR, "GetSessionForUnixProcess failed");
+        goto error;
     }
+    dbus_message_unref(message);
 
-    dbus_error_init(&error);
-    if (!dbus_message_get_args(reply,
-                               &error,
-                               DBUS_TYPE_OBJECT_PATH, &ssid,
-                               DBUS_TYPE_INVALID)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "error get ssid from reply: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "error getting ssid from reply");
-        ssid = NULL;
-        goto exit;
-    }
+    /* The reply is picked up by si_dbus_read_signals() once the
+     * connection's fd becomes readable */
+    info->pid_lookups = g_list_append(info->pid_lookups, lookup);
+    si_dbus_send_queued(info);
+    return;
+
+error:
+    if (message != NULL)
+        dbus_message_unref(message);
+    cb(NULL, user_data);
+    si_pid_lookup_free(lookup);
+}
 
-    ssid = strdup(ssid);
+/* Runs the callback of one answered lookup at a time, the callback
+ * may destroy info */
+static gboolean console_kit_finish_lookups(gpointer user_data)
+{
+    struct session_info *info = user_data;
+    struct si_pid_lookup *lookup;
+    gboolean more;
+
+    lookup = g_queue_pop_head(&info->finished_lookups);
+    more = !g_queue_is_empty(&info->finished_lookups);
+    if (!more)
+        info->finish_idle_id = 0;
+
+    lookup->cb(lookup->ssid, lookup->user_data);
+    lookup->ssid = NULL;
+    si_pid_lookup_free(lookup);
+    return more;
+}
 
-exit:
-    if (reply != NULL) {
-            dbus_message_unref(reply);
+static void console_kit_read_session_for_pid(struct session_info *info,
+                                             DBusMessage *reply)
+{
+    DBusError error;
+    struct si_pid_lookup *lookup;
+    char *ssid = NULL;
+    GList *l;
+
+    for (l = info->pid_lookups; l != NULL; l = l->next) {
+        lookup = l->data;
+        if (lookup->serial == dbus_message_get_reply_serial(reply))
+            break;
+    }
+    if (l == NULL) {
+        syslog(LOG_WARNING, "(console-kit) received unexpected reply");
+        return;
     }
+    lookup = l->data;
+    info->pid_lookups = g_list_delete_link(info->pid_lookups, l);
 
-    if (message != NULL) {
-            dbus_message_unref(message);
+    dbus_error_init(&error);
+    if (dbus_set_error_from_message(&error, reply)) {
+        syslog(LOG_ERR, "GetSessionForUnixProcess failed: %s", error.message);
+        dbus_error_free(&error);
+    } else if (!dbus_message_get_args(reply,
+                                      &error,
+                                      DBUS_TYPE_OBJECT_PATH, &ssid,
+                                      DBUS_TYPE_INVALID)) {
+        syslog(LOG_ERR, "error get ssid from reply: %s", error.message);
+        dbus_error_free(&error);
+        ssid = NULL;
+    } else {
+        ssid = strdup(ssid);
     }
 
-    return ssid;
+    /* Not called from here, the callback may well end up in
+     * si_dbus_read_signals() again or destroy info */
+    lookup->ssid = ssid;
+    g_queue_push_tail(&info->finished_lookups, lookup);
+    if (info->finish_idle_id == 0)
+        info->finish_idle_id = g_idle_add(console_kit_finish_lookups, info);
 }
 
 static char *console_kit_check_active_session_change(struct session_info *info)
@@ -498,19 +627,15 @@ gboolean session_info_session_is_locked(struct session_info *info)
     return locked;
 }
 
-/* This function should only be called after session_info_get_active_session
- * in order to verify if active session belongs to user (non greeter) */
-gboolean session_info_is_user(struct session_info *info)
+/* Ask ConsoleKit for the type of the active session,
+ * the reply is picked up by si_dbus_read_signals() */
+static void console_kit_request_session_type(struct session_info *info)
 {
-    DBusError error;
-    DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
-    gchar *session_type = NULL;
-    gboolean ret = TRUE;
+    DBusMessage *message;
 
-    g_return_val_if_fail (info != NULL, TRUE);
-    g_return_val_if_fail (info->connection != NULL, TRUE);
-    g_return_val_if_fail (info->active_session != NULL, TRUE);
+    info->session_type_serial = 0;
+    if (info->active_session == NULL)
+        return;
 
     message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
                                            info->active_session,
@@ -519,52 +644,78 @@ gboolean session_info_is_user(struct session_info *info)
     if (message == NULL) {
         syslog(LOG_ERR,
                "(console-kit) Unable to create dbus message for GetSessionType");
-        return TRUE;
+        return;
     }
 
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(info->connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL || dbus_error_is_set(&error)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "GetSessionType failed: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "GetSessionType failed");
-        goto exit;
+    if (!dbus_connection_send(info->connection, message,
+                              &info->session_type_serial)) {
+        syslog(LOG_ERR, "GetSessionType failed");
+        info->session_type_serial = 0;
     }
+    dbus_message_unref(message);
+}
+
+static void console_kit_read_session_type(struct session_info *info,
+                                          DBusMessage *reply)
+{
+    DBusError error;
+    gchar *session_type = NULL;
+
+    info->session_type_serial = 0;
 
     dbus_error_init(&error);
+    if (dbus_set_error_from_message(&error, reply)) {
+        syslog(LOG_ERR, "GetSessionType failed: %s", error.message);
+        dbus_error_free(&error);
+        return;
+    }
+
     if (!dbus_message_get_args(reply,
                                &error,
                                DBUS_TYPE_STRING, &session_type,
                                DBUS_TYPE_INVALID)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR,
-                   "(console-kit) fail to get session-type from reply: %s",
-                   error.message);
-            dbus_error_free(&error);
-        } else {
-            syslog(LOG_ERR, "(console-kit) fail to get session-type from reply");
-        }
-        session_type = NULL;
-        goto exit;
+        syslog(LOG_ERR,
+               "(console-kit) fail to get session-type from reply: %s",
+               error.message);
+        dbus_error_free(&error);
+        return;
     }
 
     /* Empty session_type means user */
     if (info->verbose)
         syslog(LOG_DEBUG, "(console-kit) session-type is '%s'", session_type);
 
-    ret = (g_strcmp0 (session_type, "LoginWindow") != 0);
+    g_free(info->user_session);
+    info->user_session = g_strdup(info->active_session);
+    info->is_user = (g_strcmp0 (session_type, "LoginWindow") != 0);
+}
 
-exit:
-    if (reply != NULL) {
-        dbus_message_unref(reply);
-    }
-    if (message != NULL) {
-        dbus_message_unref(message);
+/* This function should only be called after session_info_get_active_session
+ * in order to verify if active session belongs to user (non greeter).
+ * The session type is asked for when the session becomes the active one,
+ * until ConsoleKit answered, the session isn't taken to belong to a user. */
+gboolean session_info_is_user(struct session_info *info)
+{
+    g_return_val_if_fail (info != NULL, TRUE);
+    g_return_val_if_fail (info->connection != NULL, TRUE);
+    g_return_val_if_fail (info->active_session != NULL, TRUE);
+
+    si_dbus_read_signals(info);
+    if (g_strcmp0(info->user_session, info->active_session) == 0)
+        return info->is_user;
+
+    /* Asking failed, try again */
+    if (info->session_type_serial == 0) {
+        console_kit_request_session_type(info);
+        si_dbus_send_queued(info);
     }
-    return ret;
+    return FALSE;
+}
+
+gboolean session_info_is_user_known(struct session_info *info)
+{
+    g_return_val_if_fail (info != NULL, TRUE);
+
+    return info->active_session == NULL ||
+           g_strcmp0(info->user_session, info->active_session) == 0;
 }
@@ -41,9 +41,14 @@ const char *session_info_get_active_session(struct session_info *si)
     return NULL;
 }
 
-char *session_info_session_for_pid(struct session_info *si, uint32_t pid)
+void session_info_session_for_pid_async(struct session_info *si, uint32_t pid,
+                                        session_info_session_cb cb,
+                                        gpointer user_data,
+                                        GDestroyNotify notify)
 {
-    return NULL;
+    cb(NULL, user_data);
+    if (notify)
+        notify(user_data);
 }
 
 gboolean session_info_is_user(struct session_info *si)
@@ -51,6 +56,11 @@ gboolean session_info_is_user(struct session_info *si)
     return TRUE;
 }
 
+gboolean session_info_is_user_known(G_GNUC_UNUSED struct session_info *si)
+{
+    return TRUE;
+}
+
 gboolean session_info_session_is_locked(G_GNUC_UNUSED struct session_info *si)
 {
     return FALSE;
@@ -34,10 +34,27 @@ void session_info_destroy(struct session_info *ck);
 int session_info_get_fd(struct session_info *ck);
 
 const char *session_info_get_active_session(struct session_info *ck);
-/* Note result must be free()-ed by caller */
-char *session_info_session_for_pid(struct session_info *ck, uint32_t pid);
 
+/* Called with the session of the process looked up with
+ * session_info_session_for_pid_async() or NULL if it has none.
+ * Note session must be free()-ed by the callback */
+typedef void (*session_info_session_cb)(char *session, gpointer user_data);
+
+/* Look up the session of pid without waiting for the session manager,
+ * cb may be called before this function returns. notify is called
+ * on user_data once the lookup is done, or without cb being called
+ * if ck is destroyed first. */
+void session_info_session_for_pid_async(struct session_info *ck, uint32_t pid,
+                                        session_info_session_cb cb,
+                                        gpointer user_data,
+                                        GDestroyNotify notify);
+
+/* Answers from the state kept up to date through the session manager's
+ * signals, without waiting for it */
 gboolean session_info_session_is_locked(struct session_info *si);
 gboolean session_info_is_user(struct session_info *si);
+/* Returns FALSE while the session manager hasn't told yet whether the
+ * active session belongs to a user, session_info_is_user() is FALSE then */
+gboolean session_info_is_user_known(struct session_info *si);
 
 #endif
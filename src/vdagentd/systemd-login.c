@@ -27,6 +27,7 @@
 #include <syslog.h>
 #include <systemd/sd-login.h>
 #include <dbus/dbus.h>
+#include <glib-unix.h>
 
 struct session_info {
     int verbose;
@@ -35,6 +36,10 @@ struct session_info {
     struct {
         DBusConnection *system_connection;
         char *match_session_signals;
+        char *match_properties_changed;
+        /* Serial of the LockedHint request logind hasn't answered yet */
+        dbus_uint32_t locked_hint_serial;
+        guint write_watch_id;
     } dbus;
     gboolean session_is_locked;
     gboolean session_locked_hint;
@@ -50,6 +55,8 @@ struct session_info {
 #define SESSION_SIGNAL_LOCK         "Lock"
 #define SESSION_SIGNAL_UNLOCK       "Unlock"
 
+#define PROPERTIES_SIGNAL_CHANGED   "PropertiesChanged"
+
 #define SESSION_PROP_LOCKED_HINT    "LockedHint"
 
 /* dbus related */
@@ -73,62 +80,63 @@ static DBusConnection *si_dbus_get_system_bus(void)
     return connection;
 }
 
-static void si_dbus_match_remove(struct session_info *si)
-{
-    DBusError error;
-    if (si->dbus.match_session_signals == NULL)
-        return;
+static void si_dbus_read_signals(struct session_info *si);
 
-    dbus_error_init(&error);
-    dbus_bus_remove_match(si->dbus.system_connection,
-                          si->dbus.match_session_signals,
-                          &error);
+static gboolean si_dbus_write_cb(gint fd, GIOCondition condition,
+                                 gpointer user_data)
+{
+    struct session_info *si = user_data;
 
-    g_clear_pointer(&si->dbus.match_session_signals, g_free);
+    si->dbus.write_watch_id = 0;
+    /* Nothing is written while read messages wait to be popped */
+    si_dbus_read_signals(si);
+    return G_SOURCE_REMOVE;
 }
 
-static void si_dbus_match_rule_update(struct session_info *si)
+/* Watches for the socket to take what it didn't yet */
+static void si_dbus_watch_write(struct session_info *si)
 {
-    DBusError error;
+    int fd;
 
-    if (si->dbus.system_connection == NULL ||
-            si->session == NULL)
+    if (si->dbus.write_watch_id != 0 ||
+        !dbus_connection_has_messages_to_send(si->dbus.system_connection))
         return;
 
-    si_dbus_match_remove(si);
-
-    si->dbus.match_session_signals =
-        g_strdup_printf ("type='signal',interface='%s',path='"
-                         LOGIND_SESSION_OBJ_TEMPLATE"'",
-                         LOGIND_SESSION_INTERFACE,
-                         si->session);
-    if (si->verbose)
-        syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_session_signals);
+    if (dbus_connection_get_unix_fd(si->dbus.system_connection, &fd))
+        si->dbus.write_watch_id = g_unix_fd_add(fd, G_IO_OUT,
+                                                si_dbus_write_cb, si);
+}
 
-    dbus_error_init(&error);
-    dbus_bus_add_match(si->dbus.system_connection,
-                       si->dbus.match_session_signals,
-                       &error);
-    if (dbus_error_is_set(&error)) {
-        syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-               error.message);
-        dbus_error_free(&error);
+/* The match rules are changed without a DBusError, so that the bus
+ * isn't waited for; they're sent along with the next messages */
+static void si_dbus_match_remove(struct session_info *si)
+{
+    if (si->dbus.match_session_signals != NULL) {
+        dbus_bus_remove_match(si->dbus.system_connection,
+                              si->dbus.match_session_signals,
+                              NULL);
         g_clear_pointer(&si->dbus.match_session_signals, g_free);
     }
+
+    if (si->dbus.match_properties_changed != NULL) {
+        dbus_bus_remove_match(si->dbus.system_connection,
+                              si->dbus.match_properties_changed,
+                              NULL);
+        g_clear_pointer(&si->dbus.match_properties_changed, g_free);
+    }
 }
 
+/* Ask logind for the LockedHint of the active session,
+ * the reply is picked up by si_dbus_read_signals() */
 static void
-si_dbus_read_properties(struct session_info *si)
+si_dbus_request_locked_hint(struct session_info *si)
 {
-    dbus_bool_t locked_hint, ret;
-    DBusMessageIter iter, iter_variant;
-    gint type;
-    DBusError error;
-    DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
+    dbus_bool_t ret;
+    DBusMessage *message;
     gchar *session_object;
     const gchar *interface, *property;
 
+    si->dbus.locked_hint_serial = 0;
     if (si->session == NULL)
         return;
 
@@ -140,7 +148,7 @@ si_dbus_read_properties(struct session_info *si)
     g_free (session_object);
     if (message == NULL) {
         syslog(LOG_ERR, "Unable to create dbus message");
-        goto exit;
+        return;
     }
 
     interface = LOGIND_SESSION_INTERFACE;
@@ -149,49 +157,148 @@ si_dbus_read_properties(struct session_info *si)
                                    DBUS_TYPE_STRING, &interface,
                                    DBUS_TYPE_STRING, &property,
                                    DBUS_TYPE_INVALID);
-    if (!ret) {
+    if (!ret ||
+        !dbus_connection_send(si->dbus.system_connection, message,
+                              &si->dbus.locked_hint_serial)) {
         syslog(LOG_ERR, "Unable to request locked-hint");
-        goto exit;
+        si->dbus.locked_hint_serial = 0;
     }
 
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(si->dbus.system_connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s", error.message);
-            dbus_error_free(&error);
-        } else {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
+    dbus_message_unref(message);
+}
+
+static void si_dbus_match_rule_update(struct session_info *si)
+{
+    if (si->dbus.system_connection == NULL)
+        return;
+
+    si_dbus_match_remove(si);
+
+    /* The cached state belongs to the previous session */
+    si->session_locked_hint = FALSE;
+    si->dbus.locked_hint_serial = 0;
+
+    if (si->session != NULL) {
+        si->dbus.match_session_signals =
+            g_strdup_printf ("type='signal',interface='%s',path='"
+                             LOGIND_SESSION_OBJ_TEMPLATE"'",
+                             LOGIND_SESSION_INTERFACE,
+                             si->session);
+        si->dbus.match_properties_changed =
+            g_strdup_printf ("type='signal',interface='%s',member='%s',path='"
+                             LOGIND_SESSION_OBJ_TEMPLATE"'",
+                             DBUS_PROPERTIES_INTERFACE,
+                             PROPERTIES_SIGNAL_CHANGED,
+                             si->session);
+        if (si->verbose) {
+            syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_session_signals);
+            syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_properties_changed);
         }
-        goto exit;
+
+        dbus_bus_add_match(si->dbus.system_connection,
+                           si->dbus.match_session_signals,
+                           NULL);
+        dbus_bus_add_match(si->dbus.system_connection,
+                           si->dbus.match_properties_changed,
+                           NULL);
+        si_dbus_request_locked_hint(si);
     }
 
-    dbus_message_iter_init(reply, &iter);
-    type = dbus_message_iter_get_arg_type(&iter);
+    /* Writes as much as the socket takes without blocking */
+    dbus_connection_read_write(si->dbus.system_connection, 0);
+    si_dbus_watch_write(si);
+}
+
+/* Read the LockedHint from the variant @iter points to */
+static void
+si_dbus_read_locked_hint(struct session_info *si, DBusMessageIter *iter)
+{
+    dbus_bool_t locked_hint;
+    DBusMessageIter iter_variant;
+    gint type;
+
+    type = dbus_message_iter_get_arg_type(iter);
     if (type != DBUS_TYPE_VARIANT) {
         syslog(LOG_ERR, "expected a variant, got a '%c' instead", type);
-        goto exit;
+        return;
     }
 
-    dbus_message_iter_recurse(&iter, &iter_variant);
+    dbus_message_iter_recurse(iter, &iter_variant);
     type = dbus_message_iter_get_arg_type(&iter_variant);
     if (type != DBUS_TYPE_BOOLEAN) {
         syslog(LOG_ERR, "expected a boolean, got a '%c' instead", type);
-        goto exit;
+        return;
     }
     dbus_message_iter_get_basic(&iter_variant, &locked_hint);
 
     si->session_locked_hint = (locked_hint) ? TRUE : FALSE;
-exit:
-    if (reply != NULL) {
-        dbus_message_unref(reply);
+}
+
+static void
+si_dbus_read_reply(struct session_info *si, DBusMessage *reply)
+{
+    DBusMessageIter iter;
+
+    if (si->dbus.locked_hint_serial == 0 ||
+        dbus_message_get_reply_serial(reply) != si->dbus.locked_hint_serial) {
+        /* The answer to a request for a previous session */
+        return;
     }
+    si->dbus.locked_hint_serial = 0;
 
-    if (message != NULL) {
-        dbus_message_unref(message);
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s",
+               dbus_message_get_error_name(reply));
+        return;
+    }
+
+    dbus_message_iter_init(reply, &iter);
+    si_dbus_read_locked_hint(si, &iter);
+}
+
+static void
+si_dbus_read_properties_changed(struct session_info *si, DBusMessage *message)
+{
+    DBusMessageIter iter, iter_array, iter_entry;
+    const gchar *interface, *property;
+
+    if (!dbus_message_iter_init(message, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return;
+
+    dbus_message_iter_get_basic(&iter, &interface);
+    if (g_strcmp0(interface, LOGIND_SESSION_INTERFACE) != 0)
+        return;
+
+    /* Changed properties along with their new values */
+    if (!dbus_message_iter_next(&iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&iter_array, &iter_entry);
+        if (dbus_message_iter_get_arg_type(&iter_entry) == DBUS_TYPE_STRING) {
+            dbus_message_iter_get_basic(&iter_entry, &property);
+            if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0 &&
+                dbus_message_iter_next(&iter_entry))
+                si_dbus_read_locked_hint(si, &iter_entry);
+        }
+        dbus_message_iter_next(&iter_array);
+    }
+
+    /* Changed properties whose values have to be asked for */
+    if (!dbus_message_iter_next(&iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&iter_array, &property);
+        /* written by si_dbus_read_signals() */
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0)
+            si_dbus_request_locked_hint(si);
+        dbus_message_iter_next(&iter_array);
     }
 }
 
@@ -200,18 +307,28 @@ si_dbus_read_signals(struct session_info *si)
 {
     DBusMessage *message = NULL;
 
+    if (si->dbus.system_connection == NULL)
+        return;
+
     dbus_connection_read_write(si->dbus.system_connection, 0);
     message = dbus_connection_pop_message(si->dbus.system_connection);
     while (message != NULL) {
         const char *member;
+        int type;
 
+        type = dbus_message_get_type(message);
         member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
+        if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+            type == DBUS_MESSAGE_TYPE_ERROR) {
+            si_dbus_read_reply(si, message);
+        } else if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
             si->session_is_locked = TRUE;
         } else if (g_strcmp0(member, SESSION_SIGNAL_UNLOCK) == 0) {
             si->session_is_locked = FALSE;
+        } else if (g_strcmp0(member, PROPERTIES_SIGNAL_CHANGED) == 0) {
+            si_dbus_read_properties_changed(si, message);
         } else {
-            if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
+            if (type != DBUS_MESSAGE_TYPE_SIGNAL) {
                 syslog(LOG_WARNING, "(systemd-login) received non signal message");
             } else if (si->verbose) {
                 syslog(LOG_DEBUG, "(systemd-login) Signal not handled: %s", member);
@@ -222,6 +339,8 @@ si_dbus_read_signals(struct session_info *si)
         dbus_connection_read_write(si->dbus.system_connection, 0);
         message = dbus_connection_pop_message(si->dbus.system_connection);
     }
+
+    si_dbus_watch_write(si);
 }
 
 struct session_info *session_info_create(int verbose)
@@ -249,6 +368,8 @@ void session_info_destroy(struct session_info *si)
     if (!si)
         return;
 
+    if (si->dbus.write_watch_id)
+        g_source_remove(si->dbus.write_watch_id);
     si_dbus_match_remove(si);
     if (si->dbus.system_connection) {
         dbus_connection_close(si->dbus.system_connection);
@@ -280,13 +401,15 @@ const char *session_info_get_active_session(struct session_info *si)
         syslog(LOG_INFO, "Active session: %s", si->session);
 
     sd_login_monitor_flush(si->mon);
+
+    if (g_strcmp0(old_session, si->session) != 0)
+        si_dbus_match_rule_update(si);
     g_free(old_session);
 
-    si_dbus_match_rule_update(si);
     return si->session;
 }
 
-char *session_info_session_for_pid(struct session_info *si, uint32_t pid)
+static char *si_session_for_pid(struct session_info *si, uint32_t pid)
 {
     int i;
     int r;
@@ -352,6 +475,18 @@ out:
     return session;
 }
 
+void session_info_session_for_pid_async(struct session_info *si, uint32_t pid,
+                                        session_info_session_cb cb,
+                                        gpointer user_data,
+                                        GDestroyNotify notify)
+{
+    /* sd-login reads the session from /proc and /run,
+     * there's no need to wait for logind */
+    cb(si_session_for_pid(si, pid), user_data);
+    if (notify)
+        notify(user_data);
+}
+
 gboolean session_info_session_is_locked(struct session_info *si)
 {
     gboolean locked;
@@ -359,9 +494,11 @@ gboolean session_info_session_is_locked(struct session_info *si)
     g_return_val_if_fail (si != NULL, FALSE);
 
     si_dbus_read_signals(si);
-    si_dbus_read_properties(si);
 
-    locked = (si->session_is_locked || si->session_locked_hint);
+    /* Rather than waiting for logind, the session counts as locked
+     * until it has told us the LockedHint of the session */
+    locked = (si->session_is_locked || si->session_locked_hint ||
+              si->dbus.locked_hint_serial != 0);
     if (si->verbose) {
         syslog(LOG_DEBUG, "(systemd-login) session is locked: %s",
                locked ? "yes" : "no");
@@ -394,3 +531,9 @@ gboolean session_info_is_user(struct session_info *si)
 
     return ret;
 }
+
+gboolean session_info_is_user_known(G_GNUC_UNUSED struct session_info *si)
+{
+    /* sd-login answers right away */
+    return TRUE;
+}
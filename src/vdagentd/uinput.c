@@ -22,6 +22,7 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,14 +33,25 @@
 #include <glib.h>
 #include "uinput.h"
 
+/* Position of a screen on the guest's desktop */
+struct screen_offset {
+    gboolean valid;
+    int x;
+    int y;
+};
+
+/* Display ids above this are ignored, they are small in practice */
+#define DISPLAY_ID_MAX 1024
+
 struct vdagentd_uinput {
     const char *devname;
     int fd;
     int debug;
     int width;
     int height;
-    struct vdagentd_guest_xorg_resolution *screen_info;
-    int screen_count;
+    /* indexed by display_id, see update_screens() */
+    struct screen_offset *screens;
+    int n_screens;
     VDAgentMouseState last;
     int fake;
 };
@@ -72,25 +84,91 @@ void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp)
 
     if (uinput->fd != -1)
         close(uinput->fd);
+    g_free(uinput->screens);
     g_clear_pointer(uinputp, g_free);
 }
 
+/* The tablet reports positions in this range whatever the size of
+ * the guest's desktop is, so that it never needs to be recreated */
+#define TABLET_ABS_MAX 32767
+
+/* Maps @pos on a desktop that's @size pixels wide or high to the tablet,
+ * so that the last pixel is TABLET_ABS_MAX */
+static int scale_position(struct vdagentd_uinput *uinput, int pos, int size)
+{
+    /* the events of the fake device are read by Xspice,
+       which takes the positions in pixels */
+    if (uinput->fake)
+        return pos;
+    return (gint64)pos * TABLET_ABS_MAX / MAX(size - 1, 1);
+}
+
+/* Describe the device to uinput, returns FALSE on error with errno set */
+static gboolean uinput_setup_device(struct vdagentd_uinput *uinput)
+{
+    struct uinput_user_dev device = {
+        .name = "spice vdagent tablet",
+        .absmax  [ ABS_X ] = TABLET_ABS_MAX,
+        .absmax  [ ABS_Y ] = TABLET_ABS_MAX,
+    };
+#ifdef UI_DEV_SETUP
+    struct uinput_setup setup = {
+        .name = "spice vdagent tablet",
+    };
+    struct uinput_abs_setup abs_setup = {
+        .absinfo.maximum = TABLET_ABS_MAX,
+    };
+
+    if (ioctl(uinput->fd, UI_DEV_SETUP, &setup) == 0) {
+        abs_setup.code = ABS_X;
+        if (ioctl(uinput->fd, UI_ABS_SETUP, &abs_setup) < 0)
+            return FALSE;
+        abs_setup.code = ABS_Y;
+        return ioctl(uinput->fd, UI_ABS_SETUP, &abs_setup) == 0;
+    }
+    /* kernels older than 4.5 only support struct uinput_user_dev */
+#endif
+    return write(uinput->fd, &device, sizeof(device)) == sizeof(device);
+}
+
+/* Rebuild the table that maps display ids to the offsets of
+ * the screens on the desktop, so that vdagentd_uinput_do_mouse()
+ * doesn't need to look for the screen of every event */
+static void update_screens(struct vdagentd_uinput *uinput,
+    struct vdagentd_guest_xorg_resolution *screen_info, int screen_count)
+{
+    struct screen_offset *screen;
+    int i, n_screens = 0;
+
+    for (i = 0; i < screen_count; i++) {
+        if (screen_info[i].display_id >= 0 &&
+            screen_info[i].display_id < DISPLAY_ID_MAX)
+            n_screens = MAX(n_screens, screen_info[i].display_id + 1);
+        else
+            syslog(LOG_WARNING, "ignoring screen with display id %d",
+                   screen_info[i].display_id);
+    }
+
+    g_free(uinput->screens);
+    uinput->screens = g_new0(struct screen_offset, n_screens);
+    uinput->n_screens = n_screens;
+    for (i = 0; i < screen_count; i++) {
+        if (screen_info[i].display_id < 0 ||
+            screen_info[i].display_id >= DISPLAY_ID_MAX)
+            continue;
+        screen = &uinput->screens[screen_info[i].display_id];
+        screen->valid = TRUE;
+        screen->x = screen_info[i].x;
+        screen->y = screen_info[i].y;
+    }
+}
+
 void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
         int screen_count)
 {
     struct vdagentd_uinput *uinput = *uinputp;
-    struct uinput_user_dev device = {
-        .name = "spice vdagent tablet",
-#ifdef WITH_STATIC_UINPUT
-        .absmax  [ ABS_X ] = 32767,
-        .absmax  [ ABS_Y ] = 32767,
-#else
-        .absmax  [ ABS_X ] = width - 1,
-        .absmax  [ ABS_Y ] = height - 1,
-#endif
-    };
     int i, rc;
 
     if (uinput->debug) {
@@ -100,21 +178,13 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         }
     }
 
-    uinput->screen_info  = screen_info;
-    uinput->screen_count = screen_count;
-
-    if (uinput->width == width && uinput->height == height)
-        return;
-
     uinput->width  = width;
     uinput->height = height;
+    update_screens(uinput, screen_info, screen_count);
 
+    /* positions are scaled to the new size by vdagentd_uinput_do_mouse() */
     if (uinput->fd != -1)
-#ifndef WITH_STATIC_UINPUT
-        close(uinput->fd);
-#else
         return;
-#endif
 
     uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
     if (uinput->fd == -1) {
@@ -128,13 +198,6 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         return;
     }
 
-    rc = write(uinput->fd, &device, sizeof(device));
-    if (rc != sizeof(device)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-        return;
-    }
-
     /* buttons */
     ioctl(uinput->fd, UI_SET_EVBIT, EV_KEY);
     ioctl(uinput->fd, UI_SET_KEYBIT, BTN_LEFT);
@@ -150,6 +213,12 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_X);
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_Y);
 
+    if (!uinput_setup_device(uinput)) {
+        syslog(LOG_ERR, "setup %s: %m", uinput->devname);
+        vdagentd_uinput_destroy(uinputp);
+        return;
+    }
+
     rc = ioctl(uinput->fd, UI_DEV_CREATE);
     if (rc < 0) {
         syslog(LOG_ERR, "create %s: %m", uinput->devname);
@@ -157,34 +226,42 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     }
 }
 
-static void uinput_send_event(struct vdagentd_uinput **uinputp,
+/* Events of one mouse state: ABS_X, ABS_Y, three buttons,
+ * two wheel directions and SYN_REPORT */
+#define FRAME_EVENTS_MAX 8
+
+struct event_frame {
+    struct input_event events[FRAME_EVENTS_MAX];
+    int count;
+};
+
+static void frame_add_event(struct event_frame *frame,
     __u16 type, __u16 code, __s32 value)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
-    struct input_event event = {
-        .type  = type,
-        .code  = code,
-        .value = value,
-    };
-    int rc;
+    struct input_event *event;
 
-    rc = write(uinput->fd, &event, sizeof(event));
-    if (rc != sizeof(event)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-    }
+    g_return_if_fail(frame->count < FRAME_EVENTS_MAX);
+
+    event = &frame->events[frame->count++];
+    memset(event, 0, sizeof(*event));
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
 }
 
-static struct vdagentd_guest_xorg_resolution* lookup_screen_info(struct vdagentd_uinput *uinput, int display_id)
+/* Write all the events of @frame at once */
+static void uinput_send_frame(struct vdagentd_uinput **uinputp,
+    struct event_frame *frame)
 {
-    int i;
-    for (i = 0; i < uinput->screen_count; i++) {
-        if (uinput->screen_info[i].display_id == display_id) {
-            return &uinput->screen_info[i];
-        }
+    struct vdagentd_uinput *uinput = *uinputp;
+    ssize_t size = frame->count * sizeof(struct input_event);
+    ssize_t rc;
+
+    rc = write(uinput->fd, frame->events, size);
+    if (rc != size) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        vdagentd_uinput_destroy(uinputp);
     }
-    syslog(LOG_WARNING, "Unable to find output index for display id %d", display_id);
-    return NULL;
 }
 
 void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
@@ -205,37 +282,37 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         { .name = "up",     .mask =  VD_AGENT_UBUTTON_MASK, .btn = 1  },
         { .name = "down",   .mask =  VD_AGENT_DBUTTON_MASK, .btn = -1 },
     };
+    struct screen_offset *screen;
+    struct event_frame frame = { .count = 0 };
     int i, down;
 
-    if (*uinputp) {
-        struct vdagentd_guest_xorg_resolution *screen_info = lookup_screen_info(uinput, mouse->display_id);
-        if (screen_info == NULL) {
-            syslog(LOG_WARNING, "mouse event for unknown monitor %d",
-                   mouse->display_id);
-            return;
-        }
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
-                   mouse->x, mouse->y);
-        mouse->x += screen_info->x;
-        mouse->y += screen_info->y;
-#ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
-#endif
-    }
+    if (!*uinputp)
+        return;
 
-    if (*uinputp && uinput->last.x != mouse->x) {
+    if (mouse->display_id >= (uint32_t)uinput->n_screens ||
+        !uinput->screens[mouse->display_id].valid) {
+        syslog(LOG_WARNING, "mouse event for unknown monitor %d",
+               mouse->display_id);
+        return;
+    }
+    screen = &uinput->screens[mouse->display_id];
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
+               mouse->x, mouse->y);
+    mouse->x = scale_position(uinput, mouse->x + screen->x, uinput->width);
+    mouse->y = scale_position(uinput, mouse->y + screen->y, uinput->height);
+
+    if (uinput->last.x != mouse->x) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-x %d", mouse->x);
-        uinput_send_event(uinputp, EV_ABS, ABS_X, mouse->x);
+        frame_add_event(&frame, EV_ABS, ABS_X, mouse->x);
     }
-    if (*uinputp && uinput->last.y != mouse->y) {
+    if (uinput->last.y != mouse->y) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-y %d", mouse->y);
-        uinput_send_event(uinputp, EV_ABS, ABS_Y, mouse->y);
+        frame_add_event(&frame, EV_ABS, ABS_Y, mouse->y);
     }
-    for (i = 0; i < sizeof(btns)/sizeof(btns[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++) {
         if ((uinput->last.buttons & btns[i].mask) ==
                 (mouse->buttons & btns[i].mask))
             continue;
@@ -243,24 +320,23 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: btn-%s %s",
                     btns[i].name, down ? "down" : "up");
-        uinput_send_event(uinputp, EV_KEY, btns[i].btn, down);
+        frame_add_event(&frame, EV_KEY, btns[i].btn, down);
     }
-    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]); i++) {
         if ((uinput->last.buttons & wheel[i].mask) ==
                 (mouse->buttons & wheel[i].mask))
             continue;
         if (mouse->buttons & wheel[i].mask) {
             if (uinput->debug)
                 syslog(LOG_DEBUG, "mouse: wheel-%s", wheel[i].name);
-            uinput_send_event(uinputp, EV_REL, REL_WHEEL, wheel[i].btn);
+            frame_add_event(&frame, EV_REL, REL_WHEEL, wheel[i].btn);
         }
     }
 
-    if (*uinputp) {
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse: syn");
-        uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
-    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse: syn");
+    frame_add_event(&frame, EV_SYN, SYN_REPORT, 0);
+    uinput_send_frame(uinputp, &frame);
 
     if (*uinputp)
         uinput->last = *mouse;
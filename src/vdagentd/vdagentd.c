@@ -38,20 +38,31 @@
 #endif /* WITH_SYSTEMD_SOCKET_ACTIVATION */
 
 #include "udscs.h"
+#include "vdagent-buffer-pool.h"
 #include "vdagentd-proto.h"
 #include "uinput.h"
 #include "xorg-conf.h"
 #include "virtio-port.h"
 #include "session-info.h"
+#include "clipboard-compress.h"
+#include "clipboard-prefetch.h"
 
 #define DEFAULT_UINPUT_DEVICE "/dev/uinput"
 
+/* Write queue limits, once a queue gets full,
+ * the bulk data that feeds it is held back, see update_flow_control() */
+#define WRITE_QUEUE_HIGH_BYTES (8 * 1024 * 1024)
+#define WRITE_QUEUE_LOW_BYTES  (2 * 1024 * 1024)
+#define WRITE_QUEUE_HIGH_MSGS  4096
+#define WRITE_QUEUE_LOW_MSGS   1024
+
 struct agent_data {
     char *session;
     int width;
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    gboolean file_xfer_disabled;
 };
 
 /* variables */
@@ -65,6 +76,7 @@ static gboolean uinput_fake = FALSE;
 static gboolean only_once = FALSE;
 static gboolean do_daemonize = TRUE;
 static gboolean want_session_info = TRUE;
+static int clipboard_prefetch_max = 0;
 
 static struct udscs_server *server = NULL;
 static VirtioPort *virtio_port = NULL;
@@ -72,25 +84,176 @@ static GHashTable *active_xfers = NULL;
 static struct session_info *session_info = NULL;
 static struct vdagentd_uinput *uinput = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
-static uint32_t *capabilities = NULL;
-static int capabilities_size = 0;
+/* Capabilities of the client that are checked per message,
+   see client_caps_update() */
+static struct {
+    gboolean clipboard_by_demand;
+    gboolean clipboard_selection;
+    gboolean clipboard_grab_serial;
+    gboolean clipboard_compression;
+    gboolean file_xfer_detailed_errors;
+} client_caps;
 static const char *active_session = NULL;
+/* session id -> GPtrArray of the agents connected from the session */
+static GHashTable *session_agents = NULL;
 static unsigned int session_count = 0;
 static UdscsConnection *active_session_conn = NULL;
 static int agent_owns_clipboard[256] = { 0, };
+/* Relay of clipboard and file data that's passed to an agent
+   as it comes in from the virtio port, per chunk port */
+struct stream_relay {
+    UdscsConnection *conn;
+    /* open file-xfer data message, clipboard data is relayed
+       in VDAGENTD_CLIPBOARD_DATA_CHUNK-s instead */
+    VDAgentConnMessage *msg;
+    /* clipboard data for the next VDAGENTD_CLIPBOARD_DATA_CHUNK */
+    GByteArray *chunk;
+    /* bytes of the message body that are still to come from the client */
+    uint32_t remaining;
+    /* bytes that are still to be relayed to the agent, these differ
+       from remaining if the data is decompressed on the way */
+    uint32_t out_remaining;
+    ClipboardInflater *inflater;
+    /* the rest of the data is dropped */
+    gboolean discard;
+    /* relayed clipboard data to be cached once complete, or NULL */
+    GByteArray *cache;
+    uint8_t selection;
+    uint32_t data_type;
+};
+static struct stream_relay stream_relays[VDP_END_PORT];
 static int retval = 0;
 static int client_connected = 0;
 static int max_clipboard = -1;
 static uint32_t clipboard_serial[256];
 
+/* Clipboard data received from the client per selection and type,
+   so that repeated requests of the agent can be answered right away.
+   Entries are only valid for the grab they were received under. */
+#define CLIPBOARD_CACHE_MAX (16 * 1024 * 1024)
+/* Data relayed to the agent as it comes in is only cached up to this size,
+   larger data isn't held by the daemon on its way */
+#define CLIPBOARD_STREAM_CACHE_MAX (1024 * 1024)
+struct clipboard_cache {
+    uint32_t serial;
+    /* data type -> GBytes */
+    GHashTable *data;
+    gsize size;
+};
+static struct clipboard_cache clipboard_cache[256];
+
+/* With --clipboard-prefetch, text is requested from the client as soon
+   as it grabs a selection, so that it's cached before the guest pastes.
+   Responses are matched by type, as the client answers requests
+   of the same type in order. */
+#define CLIPBOARD_PREFETCH_TYPE VD_AGENT_CLIPBOARD_UTF8_TEXT
+static ClipboardPrefetch clipboard_prefetch[256];
+
+/* Clipboard data the agent sends in VDAGENTD_CLIPBOARD_DATA_CHUNK-s,
+   agents send their clipboard data one at a time. */
+struct clipboard_stream {
+    UdscsConnection *conn;
+    /* open VD_AGENT_CLIPBOARD message the data is appended to */
+    VirtioPortMessage *msg;
+    /* compresses the data to be sent once complete, or NULL */
+    ClipboardDeflater *deflater;
+    /* the start of the data until it's known to compress well */
+    GByteArray *sample;
+    uint8_t selection;
+    uint32_t data_type;
+    uint32_t size;
+    uint32_t remaining;
+};
+static struct clipboard_stream clipboard_stream;
+
+/* Streamed data up to this size is compressed if the client supports it,
+   larger data is sent on as it comes */
+#define CLIPBOARD_STREAM_COMPRESS_MAX (4 * 1024 * 1024)
+
 static GMainLoop *loop;
 
+static void client_caps_update(const uint32_t *caps, int caps_size);
+static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
+    uint32_t data_type, GBytes *data);
+static void check_active_session_is_user(void);
+
 static void vdagentd_quit(gint exit_code)
 {
     retval = exit_code;
     g_main_loop_quit(loop);
 }
 
+static int set_agent_read_paused(UdscsConnection *conn, void *virtio_full)
+{
+    /* everything queued for the client waits for the rest of an open
+       clipboard message, so the agent streaming it is always read */
+    gboolean paused = virtio_full && conn == active_session_conn &&
+                      conn != clipboard_stream.conn;
+
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(conn), paused);
+    return 0;
+}
+
+/* Only bulk data is held back, per destination.
+ *
+ * File transfers are pushed by the client as fast as the virtio port
+ * is read, so it isn't read while an agent that's receiving a transfer
+ * can't keep up. Clipboard data is only sent to an agent on its request
+ * and the other messages from the client are small, so a full queue
+ * alone doesn't stop reading. Reading doesn't stop in the middle of
+ * a relayed message either, the agent's queue only drains once the rest
+ * of the message is there.
+ *
+ * Only the active session agent sends data to the client,
+ * so it's the only one that's held back while the virtio port is full. */
+static void update_flow_control(void)
+{
+    gboolean virtio_full = FALSE, virtio_paused = FALSE;
+    GHashTableIter iter;
+    gpointer conn;
+    int i;
+
+    if (virtio_port) {
+        virtio_full = vdagent_connection_is_write_queue_full(
+            VDAGENT_CONNECTION(virtio_port));
+
+        if (active_xfers) {
+            g_hash_table_iter_init(&iter, active_xfers);
+            while (!virtio_paused && g_hash_table_iter_next(&iter, NULL, &conn))
+                virtio_paused = vdagent_connection_is_write_queue_full(conn);
+        }
+        for (i = 0; i < VDP_END_PORT; i++) {
+            if (stream_relays[i].conn)
+                virtio_paused = FALSE;
+        }
+        vdagent_connection_set_read_paused(VDAGENT_CONNECTION(virtio_port),
+                                           virtio_paused);
+    }
+
+    udscs_server_for_all_clients(server, set_agent_read_paused,
+                                 GINT_TO_POINTER(virtio_full));
+}
+
+static void write_queue_changed_cb(VDAgentConnection *conn, gpointer state)
+{
+    if (debug)
+        syslog(LOG_DEBUG, "%p write queue %s", conn, (const gchar *)state);
+    update_flow_control();
+}
+
+static void setup_flow_control(VDAgentConnection *conn)
+{
+    vdagent_connection_set_write_watermarks(conn,
+                                            WRITE_QUEUE_HIGH_BYTES,
+                                            WRITE_QUEUE_LOW_BYTES,
+                                            WRITE_QUEUE_HIGH_MSGS,
+                                            WRITE_QUEUE_LOW_MSGS);
+    g_signal_connect(conn, "queue-full",
+                     G_CALLBACK(write_queue_changed_cb), "full");
+    g_signal_connect(conn, "queue-drained",
+                     G_CALLBACK(write_queue_changed_cb), "drained");
+}
+
 /* utility functions */
 static void virtio_msg_uint32_to_le(uint8_t *_msg, uint32_t size, uint32_t offset)
 {
@@ -142,6 +305,9 @@ static void send_capabilities(VirtioPort *vport,
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_GRAPHICS_DEVICE_INFO);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_NO_RELEASE_ON_REGRAB);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+#ifdef WITH_CLIPBOARD_COMPRESSION
+    VD_AGENT_SET_CAPABILITY(caps->caps, VDAGENTD_CAP_CLIPBOARD_COMPRESSION);
+#endif
     virtio_msg_uint32_to_le((uint8_t *)caps, size, 0);
 
     vdagent_virtio_port_write(vport, VDP_CLIENT_PORT,
@@ -150,8 +316,132 @@ static void send_capabilities(VirtioPort *vport,
     g_free(caps);
 }
 
+static gsize clipboard_cache_limit(void)
+{
+    if (max_clipboard >= 0)
+        return MIN(max_clipboard, CLIPBOARD_CACHE_MAX);
+    return CLIPBOARD_CACHE_MAX;
+}
+
+static void clipboard_cache_clear(uint8_t selection)
+{
+    struct clipboard_cache *cache = &clipboard_cache[selection];
+
+    g_clear_pointer(&cache->data, g_hash_table_destroy);
+    cache->size = 0;
+}
+
+static void clipboard_cache_clear_all(void)
+{
+    guint sel;
+
+    for (sel = 0; sel < G_N_ELEMENTS(clipboard_cache); sel++)
+        clipboard_cache_clear(sel);
+}
+
+/* Keeps a reference to @bytes if it fits into the cache */
+static void clipboard_cache_store(uint8_t selection, uint32_t data_type,
+                                  GBytes *bytes)
+{
+    struct clipboard_cache *cache = &clipboard_cache[selection];
+    gsize size = g_bytes_get_size(bytes);
+    GBytes *old;
+
+    if (data_type == VD_AGENT_CLIPBOARD_NONE || size > clipboard_cache_limit())
+        return;
+
+    if (cache->data && cache->serial != clipboard_serial[selection])
+        clipboard_cache_clear(selection);
+    if (cache->data == NULL)
+        cache->data = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, (GDestroyNotify)g_bytes_unref);
+
+    old = g_hash_table_lookup(cache->data, GUINT_TO_POINTER(data_type));
+    if (old)
+        cache->size -= g_bytes_get_size(old);
+    if (cache->size + size > clipboard_cache_limit()) {
+        /* make room by dropping the other types */
+        g_hash_table_remove_all(cache->data);
+        cache->size = 0;
+    }
+
+    g_hash_table_insert(cache->data, GUINT_TO_POINTER(data_type),
+                        g_bytes_ref(bytes));
+    cache->size += size;
+    cache->serial = clipboard_serial[selection];
+}
+
+/* Returns the cached data or NULL, no reference is added */
+static GBytes *clipboard_cache_lookup(uint8_t selection, uint32_t data_type)
+{
+    struct clipboard_cache *cache = &clipboard_cache[selection];
+
+    if (cache->data == NULL || cache->serial != clipboard_serial[selection])
+        return NULL;
+    return g_hash_table_lookup(cache->data, GUINT_TO_POINTER(data_type));
+}
+
+static void clipboard_prefetch_start(uint8_t selection,
+                                     const uint32_t *types, guint n_types)
+{
+    guint i;
+
+    if (clipboard_prefetch_max <= 0 || !client_caps.clipboard_by_demand)
+        return;
+
+    for (i = 0; i < n_types; i++) {
+        if (types[i] == CLIPBOARD_PREFETCH_TYPE)
+            break;
+    }
+    if (i == n_types)
+        return;
+
+    if (!clipboard_prefetch_begin(&clipboard_prefetch[selection]))
+        return;
+    virtio_write_clipboard(selection, VD_AGENT_CLIPBOARD_REQUEST,
+                           CLIPBOARD_PREFETCH_TYPE, NULL);
+}
+
+/* Returns who the clipboard data of @data_type from the client is for,
+   the matching prefetch is only marked as done if @claim is TRUE */
+static int clipboard_response_match(uint8_t selection, uint32_t data_type,
+                                    gboolean claim)
+{
+    if (data_type != CLIPBOARD_PREFETCH_TYPE)
+        return CLIPBOARD_RESPONSE_AGENT;
+    return clipboard_prefetch_match(&clipboard_prefetch[selection], claim);
+}
+
+/* Returns TRUE if @clipboard was the response to a prefetch
+   and has been taken care of */
+static gboolean clipboard_prefetch_response(uint8_t selection,
+                                            VDAgentClipboard *clipboard,
+                                            uint32_t size)
+{
+    GBytes *bytes;
+
+    switch (clipboard_response_match(selection, clipboard->type, TRUE)) {
+    case CLIPBOARD_RESPONSE_STALE:
+        if (debug)
+            syslog(LOG_DEBUG, "dropping outdated clipboard prefetch");
+        return TRUE;
+    case CLIPBOARD_RESPONSE_PREFETCH:
+        if (size > 0 && size <= (uint32_t)clipboard_prefetch_max) {
+            bytes = g_bytes_new(clipboard->data, size);
+            clipboard_cache_store(selection, clipboard->type, bytes);
+            g_bytes_unref(bytes);
+        }
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
 static void do_client_disconnect(void)
 {
+    clipboard_cache_clear_all();
+    /* the responses to any requests in flight won't come anymore */
+    memset(clipboard_prefetch, 0, sizeof(clipboard_prefetch));
     if (client_connected) {
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
                                NULL, 0);
@@ -183,8 +473,9 @@ void do_client_mouse(struct vdagentd_uinput **uinputp, VDAgentMouseState *mouse)
 }
 
 static void do_client_monitors(VirtioPort *vport, int port_nr,
-    VDAgentMessage *message_header, VDAgentMonitorsConfig *new_monitors)
+    VDAgentMessage *message_header, uint8_t *data)
 {
+    VDAgentMonitorsConfig *new_monitors = (VDAgentMonitorsConfig *)data;
     VDAgentReply reply;
     uint32_t size;
 
@@ -203,8 +494,10 @@ static void do_client_monitors(VirtioPort *vport, int port_nr,
 
     /* Send monitor config to currently active agent */
     if (active_session_conn)
-        udscs_write(active_session_conn, VDAGENTD_MONITORS_CONFIG, 0, 0,
-                    (uint8_t *)mon_config, size);
+        udscs_write_with_priority(active_session_conn,
+                                  VDAGENTD_MONITORS_CONFIG, 0, 0,
+                                  (uint8_t *)mon_config, size,
+                                  VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
 
     /* Acknowledge reception of monitors config to spice server / client */
     reply.type  = GUINT32_TO_LE(VD_AGENT_MONITORS_CONFIG);
@@ -214,9 +507,10 @@ static void do_client_monitors(VirtioPort *vport, int port_nr,
 }
 
 static void do_client_volume_sync(VirtioPort *vport, int port_nr,
-    VDAgentMessage *message_header,
-    VDAgentAudioVolumeSync *avs)
+    VDAgentMessage *message_header, uint8_t *data)
 {
+    VDAgentAudioVolumeSync *avs = (VDAgentAudioVolumeSync *)data;
+
     if (active_session_conn == NULL) {
         syslog(LOG_DEBUG, "No active session - Can't volume-sync");
         return;
@@ -226,13 +520,13 @@ static void do_client_volume_sync(VirtioPort *vport, int port_nr,
                 (uint8_t *)avs, message_header->size);
 }
 
-static void do_client_capabilities(VirtioPort *vport,
-    VDAgentMessage *message_header,
-    VDAgentAnnounceCapabilities *caps)
+static void do_client_capabilities(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
 {
-    capabilities_size = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size);
-    g_free(capabilities);
-    capabilities = g_memdup(caps->caps, capabilities_size * sizeof(uint32_t));
+    VDAgentAnnounceCapabilities *caps = (VDAgentAnnounceCapabilities *)data;
+
+    client_caps_update(caps->caps,
+                       VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size));
 
     if (caps->request) {
         /* Report the previous client has disconnected. */
@@ -245,13 +539,26 @@ static void do_client_capabilities(VirtioPort *vport,
     }
 }
 
-static void do_client_clipboard(VirtioPort *vport,
+static void do_client_clipboard(VirtioPort *vport, int port_nr,
     VDAgentMessage *message_header, uint8_t *data)
 {
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
     uint32_t serial;
 
+    if (client_caps.clipboard_selection) {
+      selection = data[0];
+      data += 4;
+      size -= 4;
+    }
+
+    /* prefetched data is kept even if there's no agent to relay it to */
+    if (message_header->type == VD_AGENT_CLIPBOARD &&
+        clipboard_prefetch_response(selection, (VDAgentClipboard *)data,
+                                    size - sizeof(VDAgentClipboard))) {
+        return;
+    }
+
     if (!active_session_conn) {
         syslog(LOG_WARNING,
                "Could not find an agent connection belonging to the "
@@ -259,17 +566,9 @@ static void do_client_clipboard(VirtioPort *vport,
         return;
     }
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-      selection = data[0];
-      data += 4;
-      size -= 4;
-    }
-
     switch (message_header->type) {
     case VD_AGENT_CLIPBOARD_GRAB:
-        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                    VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
+        if (client_caps.clipboard_grab_serial) {
             serial = *(guint32 *)data;
             data += 4;
             size -= 4;
@@ -287,6 +586,8 @@ static void do_client_clipboard(VirtioPort *vport,
 
         msg_type = VDAGENTD_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = 0;
+        clipboard_cache_clear(selection);
+        clipboard_prefetch_cancel(&clipboard_prefetch[selection]);
         break;
     case VD_AGENT_CLIPBOARD_REQUEST: {
         VDAgentClipboardRequest *req = (VDAgentClipboardRequest *)data;
@@ -298,21 +599,78 @@ static void do_client_clipboard(VirtioPort *vport,
     }
     case VD_AGENT_CLIPBOARD: {
         VDAgentClipboard *clipboard = (VDAgentClipboard *)data;
-        msg_type = VDAGENTD_CLIPBOARD_DATA;
+        GBytes *bytes;
+
         data_type = clipboard->type;
         size = size - sizeof(VDAgentClipboard);
-        data = clipboard->data;
-        break;
+        if (size == 0 || size > clipboard_cache_limit()) {
+            msg_type = VDAGENTD_CLIPBOARD_DATA;
+            data = clipboard->data;
+            break;
+        }
+        /* the cached copy is also the one that's sent */
+        bytes = g_bytes_new(clipboard->data, size);
+        clipboard_cache_store(selection, data_type, bytes);
+        udscs_writev(active_session_conn, VDAGENTD_CLIPBOARD_DATA,
+                     selection, data_type, &bytes, 1,
+                     VDAGENT_CONNECTION_PRIORITY_CONTROL);
+        g_bytes_unref(bytes);
+        return;
     }
     case VD_AGENT_CLIPBOARD_RELEASE:
         msg_type = VDAGENTD_CLIPBOARD_RELEASE;
         data = NULL;
         size = 0;
+        clipboard_cache_clear(selection);
+        clipboard_prefetch_cancel(&clipboard_prefetch[selection]);
         break;
     }
 
     udscs_write(active_session_conn, msg_type, selection, data_type,
                 data, size);
+
+    if (msg_type == VDAGENTD_CLIPBOARD_GRAB) {
+        clipboard_prefetch_start(selection, (const uint32_t *)data,
+                                 size / sizeof(uint32_t));
+    }
+}
+
+/* Compressed clipboard data is passed on to do_client_clipboard()
+   as if the client had sent it uncompressed. Without the capability
+   the type is taken as it is. */
+static void do_client_clipboard_data(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    uint32_t prefix_size = sizeof(VDAgentClipboard);
+    VDAgentClipboard *clipboard;
+    VDAgentMessage header;
+    GError *err = NULL;
+    GBytes *bytes;
+
+    if (client_caps.clipboard_selection)
+        prefix_size += 4;
+    clipboard = (VDAgentClipboard *)(data + prefix_size - sizeof(VDAgentClipboard));
+    if (!client_caps.clipboard_compression ||
+        !(clipboard->type & VD_AGENT_CLIPBOARD_COMPRESSED)) {
+        do_client_clipboard(vport, port_nr, message_header, data);
+        return;
+    }
+
+    clipboard->type &= ~VD_AGENT_CLIPBOARD_COMPRESSED;
+    bytes = clipboard_decompress(data, prefix_size, clipboard->data,
+                                 message_header->size - prefix_size, &err);
+    if (!bytes) {
+        syslog(LOG_WARNING, "dropping client clipboard: %s", err->message);
+        g_error_free(err);
+        /* relayed empty, so that a paste waiting for it fails */
+        bytes = g_bytes_new(data, prefix_size);
+    }
+
+    header = *message_header;
+    header.size = g_bytes_get_size(bytes);
+    do_client_clipboard(vport, port_nr, &header,
+                        (uint8_t *)g_bytes_get_data(bytes, NULL));
+    g_bytes_unref(bytes);
 }
 
 /* Send file-xfer status to the client. In the case status is an error,
@@ -326,8 +684,7 @@ static void send_file_xfer_status(VirtioPort *vport,
     /* Replace new detailed errors with older generic VD_AGENT_FILE_XFER_STATUS_ERROR
      * when not supported by client */
     if (xfer_status > VD_AGENT_FILE_XFER_STATUS_SUCCESS &&
-        !VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                 VD_AGENT_CAP_FILE_XFER_DETAILED_ERRORS)) {
+        !client_caps.file_xfer_detailed_errors) {
         xfer_status = VD_AGENT_FILE_XFER_STATUS_ERROR;
         data_size = 0;
     }
@@ -349,7 +706,7 @@ static void send_file_xfer_status(VirtioPort *vport,
     g_free(status);
 }
 
-static void do_client_file_xfer(VirtioPort *vport,
+static void do_client_file_xfer(VirtioPort *vport, int port_nr,
                                 VDAgentMessage *message_header,
                                 uint8_t *data)
 {
@@ -373,6 +730,15 @@ static void do_client_file_xfer(VirtioPort *vport,
                s->id, VD_AGENT_FILE_XFER_STATUS_SESSION_LOCKED, NULL, 0);
             return;
         }
+        check_active_session_is_user();
+        if (session_info && !session_info_is_user(session_info)) {
+            /* also while the session type isn't known yet */
+            send_file_xfer_status(vport,
+               "Active session doesn't belong to a user (or isn't known to "
+               "yet), cancelling client file-xfer request %u",
+               s->id, VD_AGENT_FILE_XFER_STATUS_DISABLED, NULL, 0);
+            return;
+        }
         udscs_write(active_session_conn, VDAGENTD_FILE_XFER_START, 0, 0,
                     data, message_header->size);
         return;
@@ -402,6 +768,9 @@ static void do_client_file_xfer(VirtioPort *vport,
     udscs_write(conn, msg_type, 0, 0, data, message_header->size);
 }
 
+/* Monitor configs may overtake clipboard and file data on the way
+   to the agent, so the graphics device info they are applied with
+   must as well */
 static void forward_data_to_session_agent(uint32_t type, uint8_t *data, size_t size)
 {
     if (active_session_conn == NULL) {
@@ -409,39 +778,209 @@ static void forward_data_to_session_agent(uint32_t type, uint8_t *data, size_t s
         return;
     }
 
-    udscs_write(active_session_conn, type, 0, 0, data, size);
-}
-
-static gsize vdagent_message_min_size[] =
-{
-    -1, /* Does not exist */
-    sizeof(VDAgentMouseState), /* VD_AGENT_MOUSE_STATE */
-    sizeof(VDAgentMonitorsConfig), /* VD_AGENT_MONITORS_CONFIG */
-    sizeof(VDAgentReply), /* VD_AGENT_REPLY */
-    sizeof(VDAgentClipboard), /* VD_AGENT_CLIPBOARD */
-    sizeof(VDAgentDisplayConfig), /* VD_AGENT_DISPLAY_CONFIG */
-    sizeof(VDAgentAnnounceCapabilities), /* VD_AGENT_ANNOUNCE_CAPABILITIES */
-    sizeof(VDAgentClipboardGrab), /* VD_AGENT_CLIPBOARD_GRAB */
-    sizeof(VDAgentClipboardRequest), /* VD_AGENT_CLIPBOARD_REQUEST */
-    sizeof(VDAgentClipboardRelease), /* VD_AGENT_CLIPBOARD_RELEASE */
-    sizeof(VDAgentFileXferStartMessage), /* VD_AGENT_FILE_XFER_START */
-    sizeof(VDAgentFileXferStatusMessage), /* VD_AGENT_FILE_XFER_STATUS */
-    sizeof(VDAgentFileXferDataMessage), /* VD_AGENT_FILE_XFER_DATA */
-    0, /* VD_AGENT_CLIENT_DISCONNECTED */
-    sizeof(VDAgentMaxClipboard), /* VD_AGENT_MAX_CLIPBOARD */
-    sizeof(VDAgentAudioVolumeSync), /* VD_AGENT_AUDIO_VOLUME_SYNC */
-    sizeof(VDAgentGraphicsDeviceInfo), /* VD_AGENT_GRAPHICS_DEVICE_INFO */
+    udscs_write_with_priority(active_session_conn, type, 0, 0, data, size,
+                              VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
+}
+
+static void do_client_disconnected(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+    do_client_disconnect();
+}
+
+static void do_client_max_clipboard(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    max_clipboard = ((VDAgentMaxClipboard *)data)->max;
+    syslog(LOG_DEBUG, "Set max clipboard: %d", max_clipboard);
+}
+
+static VDAgentGraphicsDeviceInfo *device_info = NULL;
+static size_t device_info_size = 0;
+static void do_client_graphics_device_info(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    if (device_info) {
+        g_free(device_info);
+        device_info = NULL;
+        device_info_size = 0;
+    }
+    // store device info for re-sending when a session agent reconnects
+    device_info = g_memdup(data, message_header->size);
+    device_info_size = message_header->size;
+    forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, data, message_header->size);
+}
+
+/* Mouse states are applied once per main loop iteration, so that
+   the pointer doesn't replay stale positions after a stall. Consecutive
+   states that only differ in position are merged into the latest one,
+   button and wheel changes are all applied in order. */
+static VDAgentMouseState pending_mouse;
+static guint pending_mouse_id = 0;
+
+static gboolean apply_pending_mouse(gpointer user_data)
+{
+    pending_mouse_id = 0;
+    do_client_mouse(&uinput, &pending_mouse);
+    return G_SOURCE_REMOVE;
+}
+
+static void drop_pending_mouse(void)
+{
+    if (pending_mouse_id) {
+        g_source_remove(pending_mouse_id);
+        pending_mouse_id = 0;
+    }
+}
+
+static void do_client_mouse_state(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    VDAgentMouseState *mouse = (VDAgentMouseState *)data;
+
+    if (pending_mouse_id && pending_mouse.buttons != mouse->buttons) {
+        drop_pending_mouse();
+        apply_pending_mouse(NULL);
+    }
+    pending_mouse = *mouse;
+    if (pending_mouse_id == 0)
+        pending_mouse_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                           apply_pending_mouse, NULL, NULL);
+}
+
+static void vdagent_message_uint32_from_le(VDAgentMessage *message_header,
+        uint8_t *data)
+{
+    virtio_msg_uint32_from_le(data, message_header->size, 0);
+}
+
+static void vdagent_message_volume_sync_from_le(VDAgentMessage *message_header,
+        uint8_t *data)
+{
+    virtio_msg_uint16_from_le(data, message_header->size,
+        offsetof(VDAgentAudioVolumeSync, volume));
+}
+
+static void vdagent_message_clipboard_from_le(VDAgentMessage *message_header,
+        uint8_t *data);
+static void vdagent_message_file_xfer_from_le(VDAgentMessage *message_header,
+        uint8_t *data);
+
+/* Description of the messages that can be received from the client,
+   indexed by the message type */
+struct client_message_type {
+    const char *name;
+    /* size of the fixed part of the message body */
+    uint32_t base_size;
+    /* TRUE if the body may be larger than min_size */
+    gboolean variable_size;
+    /* TRUE if the body starts with the clipboard selection
+       when VD_AGENT_CAP_CLIPBOARD_SELECTION is set */
+    gboolean has_selection;
+    /* base_size and the fields enabled by the client's capabilities,
+       see client_caps_update() */
+    uint32_t min_size;
+    /* converts the body to host byte order, may be NULL */
+    void (*from_le)(VDAgentMessage *message_header, uint8_t *data);
+    /* NULL for messages that are accepted and ignored */
+    void (*handler)(VirtioPort *vport, int port_nr,
+                    VDAgentMessage *message_header, uint8_t *data);
+
+    /* statistics */
+    guint64 count;
+    guint64 bytes;
+    guint64 rejects;
 };
 
+static struct client_message_type client_message_types[] = {
+    [VD_AGENT_MOUSE_STATE] = {
+        "mouse-state", sizeof(VDAgentMouseState), FALSE, FALSE, 0,
+        vdagent_message_uint32_from_le, do_client_mouse_state },
+    [VD_AGENT_MONITORS_CONFIG] = {
+        "monitors-config", sizeof(VDAgentMonitorsConfig), TRUE, FALSE, 0,
+        vdagent_message_uint32_from_le, do_client_monitors },
+    [VD_AGENT_REPLY] = {
+        "reply", sizeof(VDAgentReply), FALSE, FALSE, 0,
+        NULL, NULL },
+    [VD_AGENT_CLIPBOARD] = {
+        "clipboard", sizeof(VDAgentClipboard), TRUE, TRUE, 0,
+        vdagent_message_clipboard_from_le, do_client_clipboard_data },
+    [VD_AGENT_DISPLAY_CONFIG] = {
+        "display-config", sizeof(VDAgentDisplayConfig), FALSE, FALSE, 0,
+        NULL, NULL },
+    [VD_AGENT_ANNOUNCE_CAPABILITIES] = {
+        "announce-capabilities", sizeof(VDAgentAnnounceCapabilities), TRUE, FALSE, 0,
+        vdagent_message_uint32_from_le, do_client_capabilities },
+    [VD_AGENT_CLIPBOARD_GRAB] = {
+        "clipboard-grab", sizeof(VDAgentClipboardGrab), TRUE, TRUE, 0,
+        vdagent_message_clipboard_from_le, do_client_clipboard },
+    [VD_AGENT_CLIPBOARD_REQUEST] = {
+        "clipboard-request", sizeof(VDAgentClipboardRequest), FALSE, TRUE, 0,
+        vdagent_message_clipboard_from_le, do_client_clipboard },
+    [VD_AGENT_CLIPBOARD_RELEASE] = {
+        "clipboard-release", sizeof(VDAgentClipboardRelease), FALSE, TRUE, 0,
+        vdagent_message_clipboard_from_le, do_client_clipboard },
+    [VD_AGENT_FILE_XFER_START] = {
+        "file-xfer-start", sizeof(VDAgentFileXferStartMessage), TRUE, FALSE, 0,
+        vdagent_message_file_xfer_from_le, do_client_file_xfer },
+    [VD_AGENT_FILE_XFER_STATUS] = {
+        "file-xfer-status", sizeof(VDAgentFileXferStatusMessage), FALSE, FALSE, 0,
+        vdagent_message_file_xfer_from_le, do_client_file_xfer },
+    [VD_AGENT_FILE_XFER_DATA] = {
+        "file-xfer-data", sizeof(VDAgentFileXferDataMessage), TRUE, FALSE, 0,
+        vdagent_message_file_xfer_from_le, do_client_file_xfer },
+    [VD_AGENT_CLIENT_DISCONNECTED] = {
+        "client-disconnected", 0, FALSE, FALSE, 0,
+        NULL, do_client_disconnected },
+    [VD_AGENT_MAX_CLIPBOARD] = {
+        "max-clipboard", sizeof(VDAgentMaxClipboard), FALSE, FALSE, 0,
+        vdagent_message_uint32_from_le, do_client_max_clipboard },
+    [VD_AGENT_AUDIO_VOLUME_SYNC] = {
+        "audio-volume-sync", sizeof(VDAgentAudioVolumeSync), TRUE, FALSE, 0,
+        vdagent_message_volume_sync_from_le, do_client_volume_sync },
+    [VD_AGENT_GRAPHICS_DEVICE_INFO] = {
+        "graphics-device-info", sizeof(VDAgentGraphicsDeviceInfo), TRUE, FALSE, 0,
+        NULL, do_client_graphics_device_info },
+};
+
+static void client_caps_update(const uint32_t *caps, int caps_size)
+{
+    struct client_message_type *msg_type;
+    guint i;
+
+    client_caps.clipboard_by_demand = VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+        VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+    client_caps.clipboard_selection = VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+        VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    client_caps.clipboard_grab_serial = VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+        VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+#ifdef WITH_CLIPBOARD_COMPRESSION
+    /* only set if both sides announced it */
+    client_caps.clipboard_compression = VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+        VDAGENTD_CAP_CLIPBOARD_COMPRESSION);
+#endif
+    client_caps.file_xfer_detailed_errors = VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+        VD_AGENT_CAP_FILE_XFER_DETAILED_ERRORS);
+
+    for (i = 0; i < G_N_ELEMENTS(client_message_types); i++) {
+        msg_type = &client_message_types[i];
+        msg_type->min_size = msg_type->base_size;
+        if (msg_type->has_selection && client_caps.clipboard_selection)
+            msg_type->min_size += 4;
+    }
+    if (client_caps.clipboard_grab_serial)
+        client_message_types[VD_AGENT_CLIPBOARD_GRAB].min_size += 4;
+}
+
 static void vdagent_message_clipboard_from_le(VDAgentMessage *message_header,
         uint8_t *data)
 {
-    gsize min_size = vdagent_message_min_size[message_header->type];
+    gsize offset = client_message_types[message_header->type].base_size;
     uint32_t *data_type = (uint32_t *) data;
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        min_size += 4;
+    if (client_caps.clipboard_selection) {
+        offset += 4;
         data_type++;
     }
 
@@ -451,7 +990,7 @@ static void vdagent_message_clipboard_from_le(VDAgentMessage *message_header,
         *data_type = GUINT32_FROM_LE(*data_type);
         break;
     case VD_AGENT_CLIPBOARD_GRAB:
-        virtio_msg_uint32_from_le(data, message_header->size, min_size);
+        virtio_msg_uint32_from_le(data, message_header->size, offset);
         break;
     case VD_AGENT_CLIPBOARD_RELEASE:
         break;
@@ -479,147 +1018,392 @@ static void vdagent_message_file_xfer_from_le(VDAgentMessage *message_header,
     }
 }
 
-static gboolean vdagent_message_check_size(const VDAgentMessage *message_header)
+/* Validates the header of a message from the client and accounts for it,
+   returns the description of its type or NULL if the message is invalid */
+static struct client_message_type *client_message_check(
+        const VDAgentMessage *message_header)
 {
-    uint32_t min_size = 0;
+    struct client_message_type *msg_type;
 
     if (message_header->protocol != VD_AGENT_PROTOCOL) {
         syslog(LOG_ERR, "message with wrong protocol version ignoring");
-        return FALSE;
+        return NULL;
     }
 
-    if (!message_header->type ||
-        message_header->type >= G_N_ELEMENTS(vdagent_message_min_size)) {
+    if (message_header->type >= G_N_ELEMENTS(client_message_types) ||
+        client_message_types[message_header->type].name == NULL) {
         syslog(LOG_WARNING, "unknown message type %d, ignoring",
                message_header->type);
-        return FALSE;
+        return NULL;
+    }
+
+    msg_type = &client_message_types[message_header->type];
+    if (message_header->size < msg_type->min_size ||
+        (!msg_type->variable_size && message_header->size != msg_type->min_size)) {
+        syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
+               message_header->size, message_header->type);
+        msg_type->rejects++;
+        return NULL;
+    }
+
+    msg_type->count++;
+    msg_type->bytes += message_header->size;
+    return msg_type;
+}
+
+static void client_message_log_stats(void)
+{
+    struct client_message_type *msg_type;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(client_message_types); i++) {
+        msg_type = &client_message_types[i];
+        if (msg_type->count == 0 && msg_type->rejects == 0)
+            continue;
+        syslog(LOG_DEBUG, "%s: %" G_GUINT64_FORMAT " messages, %"
+               G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT " rejected",
+               msg_type->name, msg_type->count, msg_type->bytes,
+               msg_type->rejects);
+    }
+}
+
+static void virtio_port_read_complete(
+        VirtioPort *vport,
+        int port_nr,
+        VDAgentMessage *message_header,
+        uint8_t *data)
+{
+    struct client_message_type *msg_type;
+
+    msg_type = client_message_check(message_header);
+    if (msg_type == NULL)
+        return;
+
+    if (msg_type->from_le)
+        msg_type->from_le(message_header, data);
+    if (msg_type->handler)
+        msg_type->handler(vport, port_nr, message_header, data);
+    else if (debug)
+        syslog(LOG_DEBUG, "ignoring %s message", msg_type->name);
+}
+
+static void stream_relay_clear(struct stream_relay *relay)
+{
+    g_clear_pointer(&relay->inflater, clipboard_inflater_free);
+    g_clear_pointer(&relay->cache, g_byte_array_unref);
+    g_clear_pointer(&relay->chunk, g_byte_array_unref);
+    g_clear_object(&relay->conn);
+    relay->msg = NULL;
+    relay->remaining = 0;
+    relay->out_remaining = 0;
+    relay->discard = FALSE;
+}
+
+typedef void (*AppendFunc)(gpointer conn, gpointer msg, GBytes *bytes);
+
+/* Completes the open message @msg with @size bytes of zeros, passed
+ * to @append in pieces of up to 64 KiB.
+ *
+ * Once the header of a message has gone out, the only way to keep
+ * the connection in sync when the rest of its data won't come is to
+ * make it up: the spice protocol has no way to abort a message, and
+ * neither has a udscs message that's under way. */
+static void append_zeros(AppendFunc append, gpointer conn, gpointer msg,
+                         uint32_t size)
+{
+    GBytes *zeros, *tail;
+    gsize n;
+
+    if (size == 0) {
+        return;
+    }
+
+    n = MIN(size, 64 * 1024);
+    zeros = g_bytes_new_take(g_malloc0(n), n);
+    while (size >= n) {
+        append(conn, msg, zeros);
+        size -= n;
+    }
+    if (size > 0) {
+        tail = g_bytes_new_from_bytes(zeros, 0, size);
+        append(conn, msg, tail);
+        g_bytes_unref(tail);
+    }
+    g_bytes_unref(zeros);
+}
+
+static void agent_message_append(gpointer conn, gpointer msg, GBytes *bytes)
+{
+    vdagent_connection_append(conn, msg, bytes);
+}
+
+static void virtio_message_append(gpointer vport, gpointer msg, GBytes *bytes)
+{
+    vdagent_virtio_port_message_send_append(vport, msg, bytes);
+}
+
+/* The agent has already been sent the header of the file-xfer data
+   message, it cancels the transfer on VDAGENTD_CLIENT_DISCONNECTED */
+static void stream_relay_pad(struct stream_relay *relay)
+{
+    append_zeros(agent_message_append, relay->conn, relay->msg,
+                 relay->out_remaining);
+    relay->out_remaining = 0;
+}
+
+static void stream_relay_flush_chunk(struct stream_relay *relay)
+{
+    if (relay->chunk->len == 0) {
+        return;
+    }
+    udscs_write(relay->conn, VDAGENTD_CLIPBOARD_DATA_CHUNK,
+                relay->selection, relay->data_type,
+                relay->chunk->data, relay->chunk->len);
+    g_byte_array_set_size(relay->chunk, 0);
+}
+
+static void stream_relay_write_chunks(struct stream_relay *relay,
+                                      const uint8_t *data, gsize size)
+{
+    gsize n;
+
+    while (size > 0) {
+        n = MIN(size, VDAGENTD_CLIPBOARD_CHUNK_SIZE - relay->chunk->len);
+        g_byte_array_append(relay->chunk, data, n);
+        data += n;
+        size -= n;
+        if (relay->chunk->len == VDAGENTD_CLIPBOARD_CHUNK_SIZE)
+            stream_relay_flush_chunk(relay);
     }
+}
+
+/* Clipboard data that won't be complete is dropped by the agent
+   on VDAGENTD_CLIPBOARD_DATA_ABORT, file-xfer data is padded. */
+static void stream_relay_cut_short(struct stream_relay *relay)
+{
+    if (relay->msg) {
+        stream_relay_pad(relay);
+    } else if (relay->chunk) {
+        udscs_write(relay->conn, VDAGENTD_CLIPBOARD_DATA_ABORT,
+                    relay->selection, relay->data_type, NULL, 0);
+        g_clear_pointer(&relay->chunk, g_byte_array_unref);
+    }
+    relay->out_remaining = 0;
+}
 
-    min_size = vdagent_message_min_size[message_header->type];
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        switch (message_header->type) {
-        case VD_AGENT_CLIPBOARD_GRAB:
-        case VD_AGENT_CLIPBOARD_REQUEST:
-        case VD_AGENT_CLIPBOARD:
-        case VD_AGENT_CLIPBOARD_RELEASE:
-          min_size += 4;
+static void stream_relay_append(struct stream_relay *relay,
+                                const uint8_t *data, uint32_t size)
+{
+    GBytes *bytes = NULL;
+    GError *err = NULL;
+    gsize out_size = size;
+
+    relay->remaining -= size;
+    if (relay->inflater) {
+        bytes = clipboard_inflater_feed(relay->inflater, data, size, &err);
+        if (bytes) {
+            data = g_bytes_get_data(bytes, &out_size);
+        } else {
+            syslog(LOG_WARNING, "dropping client clipboard: %s", err->message);
+            g_error_free(err);
+            g_clear_pointer(&relay->inflater, clipboard_inflater_free);
+            g_clear_pointer(&relay->cache, g_byte_array_unref);
+            stream_relay_cut_short(relay);
+            relay->discard = TRUE;
         }
     }
+    if (relay->discard) {
+        out_size = 0;
+    }
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)
-        && message_header->type == VD_AGENT_CLIPBOARD_GRAB) {
-        min_size += 4;
+    if (out_size > 0) {
+        if (relay->msg)
+            udscs_write_append(relay->conn, relay->msg, data, out_size);
+        else
+            stream_relay_write_chunks(relay, data, out_size);
+        relay->out_remaining -= out_size;
+        if (relay->cache)
+            g_byte_array_append(relay->cache, data, out_size);
+    }
+    g_clear_pointer(&bytes, g_bytes_unref);
+
+    if (relay->remaining == 0) {
+        if (relay->out_remaining > 0) {
+            /* the compressed stream ended early */
+            g_clear_pointer(&relay->cache, g_byte_array_unref);
+            stream_relay_cut_short(relay);
+        } else if (relay->chunk) {
+            stream_relay_flush_chunk(relay);
+        }
+        if (relay->cache) {
+            bytes = g_byte_array_free_to_bytes(relay->cache);
+            relay->cache = NULL;
+            clipboard_cache_store(relay->selection, relay->data_type, bytes);
+            g_bytes_unref(bytes);
+        }
+        stream_relay_clear(relay);
     }
+}
+
+/* The agent is told about the lost client
+   by VDAGENTD_CLIENT_DISCONNECTED right after. */
+static void stream_relay_abort(struct stream_relay *relay)
+{
+    if (relay->conn == NULL) {
+        return;
+    }
+    syslog(LOG_WARNING, "message relay interrupted, %u bytes missing",
+           relay->out_remaining);
+
+    stream_relay_cut_short(relay);
+    stream_relay_clear(relay);
+}
+
+static void stream_relays_abort(void)
+{
+    int i;
+
+    for (i = 0; i < VDP_END_PORT; i++) {
+        stream_relay_abort(&stream_relays[i]);
+    }
+}
+
+/* Starts relaying a clipboard or file-xfer data message to the agent
+   it's meant for, @data is the first piece of the message body. */
+static gboolean stream_relay_start(struct stream_relay *relay,
+                                   VDAgentMessage *message_header,
+                                   const uint8_t *data, uint32_t size)
+{
+    uint8_t xfer_header[sizeof(VDAgentFileXferDataMessage)];
+    VDAgentFileXferDataMessage *xfer;
+    uint32_t prefix_size, selection, data_type, out_size;
+    gboolean compressed;
+
+    if (!client_message_check(message_header))
+        return FALSE;
 
     switch (message_header->type) {
-    case VD_AGENT_MONITORS_CONFIG:
-    case VD_AGENT_FILE_XFER_START:
-    case VD_AGENT_FILE_XFER_DATA:
     case VD_AGENT_CLIPBOARD:
-    case VD_AGENT_CLIPBOARD_GRAB:
-    case VD_AGENT_AUDIO_VOLUME_SYNC:
-    case VD_AGENT_ANNOUNCE_CAPABILITIES:
-    case VD_AGENT_GRAPHICS_DEVICE_INFO:
-        if (message_header->size < min_size) {
-            syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
-                   message_header->size, message_header->type);
+        selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+        prefix_size = sizeof(VDAgentClipboard);
+        if (client_caps.clipboard_selection) {
+            selection = data[0];
+            prefix_size += 4;
+        }
+        if (size < prefix_size)
             return FALSE;
+
+        memcpy(&data_type, data + prefix_size - sizeof(VDAgentClipboard),
+               sizeof(data_type));
+        data_type = GUINT32_FROM_LE(data_type);
+        /* the flag only means something with the capability */
+        compressed = client_caps.clipboard_compression &&
+                     (data_type & VD_AGENT_CLIPBOARD_COMPRESSED) != 0;
+        if (compressed)
+            data_type &= ~VD_AGENT_CLIPBOARD_COMPRESSED;
+
+        /* prefetch responses are handled once complete */
+        if (!active_session_conn ||
+            clipboard_response_match(selection, data_type, FALSE) !=
+                CLIPBOARD_RESPONSE_AGENT)
+            return FALSE;
+
+        out_size = message_header->size - prefix_size;
+        if (compressed) {
+            /* the uncompressed size is needed to start relaying */
+            if (size < prefix_size + sizeof(out_size))
+                return FALSE;
+            memcpy(&out_size, data + prefix_size, sizeof(out_size));
+            out_size = GUINT32_FROM_LE(out_size);
+            if (out_size > CLIPBOARD_DECOMPRESS_MAX_SIZE)
+                return FALSE;
+            relay->inflater = clipboard_inflater_new();
         }
+        clipboard_response_match(selection, data_type, TRUE);
+
+        relay->conn = g_object_ref(active_session_conn);
+        relay->selection = selection;
+        relay->data_type = data_type;
+        udscs_write(relay->conn, VDAGENTD_CLIPBOARD_DATA_BEGIN,
+                    selection, data_type, (uint8_t *)&out_size, sizeof(out_size));
+        relay->chunk = g_byte_array_sized_new(
+            MIN(out_size, VDAGENTD_CLIPBOARD_CHUNK_SIZE));
+        /* grown as the data comes in, the announced size may not arrive */
+        if (out_size <= MIN(clipboard_cache_limit(), CLIPBOARD_STREAM_CACHE_MAX))
+            relay->cache = g_byte_array_new();
         break;
-    case VD_AGENT_MOUSE_STATE:
-    case VD_AGENT_FILE_XFER_STATUS:
-    case VD_AGENT_DISPLAY_CONFIG:
-    case VD_AGENT_REPLY:
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD_RELEASE:
-    case VD_AGENT_MAX_CLIPBOARD:
-    case VD_AGENT_CLIENT_DISCONNECTED:
-        if (message_header->size != min_size) {
-            syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
-                   message_header->size, message_header->type);
+    case VD_AGENT_FILE_XFER_DATA:
+        prefix_size = sizeof(xfer_header);
+        if (size < prefix_size)
+            return FALSE;
+
+        memcpy(xfer_header, data, prefix_size);
+        vdagent_message_file_xfer_from_le(message_header, xfer_header);
+        xfer = (VDAgentFileXferDataMessage *)xfer_header;
+        /* unknown transfers are logged and dropped by do_client_file_xfer() */
+        relay->conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(xfer->id));
+        if (!relay->conn)
+            return FALSE;
+
+        relay->msg = udscs_write_begin(relay->conn, VDAGENTD_FILE_XFER_DATA,
+                                       0, 0, message_header->size);
+        if (!relay->msg) {
+            relay->conn = NULL;
             return FALSE;
         }
+        g_object_ref(relay->conn);
+        udscs_write_append(relay->conn, relay->msg, xfer_header, prefix_size);
+        out_size = message_header->size - prefix_size;
         break;
     default:
-        g_warn_if_reached();
         return FALSE;
     }
+
+    relay->remaining = message_header->size - prefix_size;
+    relay->out_remaining = out_size;
+    stream_relay_append(relay, data + prefix_size, size - prefix_size);
     return TRUE;
 }
 
-static VDAgentGraphicsDeviceInfo *device_info = NULL;
-static size_t device_info_size = 0;
-static void virtio_port_read_complete(
+static gboolean virtio_port_stream_data(
         VirtioPort *vport,
         int port_nr,
         VDAgentMessage *message_header,
-        uint8_t *data)
+        const uint8_t *data,
+        uint32_t offset,
+        uint32_t size)
 {
-    if (!vdagent_message_check_size(message_header))
-        return;
-
-    switch (message_header->type) {
-    case VD_AGENT_MOUSE_STATE:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_mouse(&uinput, (VDAgentMouseState *)data);
-        break;
-    case VD_AGENT_MONITORS_CONFIG:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_monitors(vport, port_nr, message_header,
-                    (VDAgentMonitorsConfig *)data);
-        break;
-    case VD_AGENT_ANNOUNCE_CAPABILITIES:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_capabilities(vport, message_header,
-                        (VDAgentAnnounceCapabilities *)data);
-        break;
-    case VD_AGENT_CLIPBOARD_GRAB:
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD:
-    case VD_AGENT_CLIPBOARD_RELEASE:
-        vdagent_message_clipboard_from_le(message_header, data);
-        do_client_clipboard(vport, message_header, data);
-        break;
-    case VD_AGENT_FILE_XFER_START:
-    case VD_AGENT_FILE_XFER_STATUS:
-    case VD_AGENT_FILE_XFER_DATA:
-        vdagent_message_file_xfer_from_le(message_header, data);
-        do_client_file_xfer(vport, message_header, data);
-        break;
-    case VD_AGENT_CLIENT_DISCONNECTED:
-        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
-        do_client_disconnect();
-        break;
-    case VD_AGENT_MAX_CLIPBOARD: {
-        max_clipboard = GUINT32_FROM_LE(((VDAgentMaxClipboard *)data)->max);
-        syslog(LOG_DEBUG, "Set max clipboard: %d", max_clipboard);
-        break;
-    }
-    case VD_AGENT_GRAPHICS_DEVICE_INFO: {
-        if (device_info) {
-            g_free(device_info);
-            device_info = NULL;
-            device_info_size = 0;
-        }
-        // store device info for re-sending when a session agent reconnects
-        device_info = g_memdup(data, message_header->size);
-        device_info_size = message_header->size;
-        forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, data, message_header->size);
-        break;
+    struct stream_relay *relay = &stream_relays[port_nr];
+    gboolean relaying = relay->conn != NULL, streaming = TRUE;
+
+    if (offset == 0 && data) {
+        streaming = stream_relay_start(relay, message_header, data, size);
+    } else if (relay->conn) {
+        /* the rest of the message is dropped if the agent went away */
+        if (data)
+            stream_relay_append(relay, data, size);
+        else
+            stream_relay_abort(relay);
     }
-    case VD_AGENT_AUDIO_VOLUME_SYNC: {
-        VDAgentAudioVolumeSync *vdata = (VDAgentAudioVolumeSync *)data;
-        virtio_msg_uint16_from_le((uint8_t *)vdata, message_header->size,
-            offsetof(VDAgentAudioVolumeSync, volume));
 
-        do_client_volume_sync(vport, port_nr, message_header, vdata);
-        break;
-    }
-    default:
-        g_warn_if_reached();
-    }
+    /* reading may only stop in between relayed messages */
+    if ((relay->conn != NULL) != relaying)
+        update_flow_control();
+    return streaming;
+}
+
+static void virtio_port_error_cb(VDAgentConnection *conn, GError *err);
+
+static VirtioPort *virtio_port_open(void)
+{
+    VirtioPort *vport;
+
+    vport = vdagent_virtio_port_create(portdev,
+                                       virtio_port_read_complete,
+                                       virtio_port_error_cb);
+    if (vport)
+        vdagent_virtio_port_set_stream_callback(vport, virtio_port_stream_data);
+    return vport;
 }
 
 static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
@@ -629,59 +1413,258 @@ static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
                      err ? err->message : "");
     g_clear_error(&err);
 
+    stream_relays_abort();
+    clipboard_stream_drop();
     vdagent_connection_destroy(virtio_port);
-    virtio_port = vdagent_virtio_port_create(portdev,
-                                             virtio_port_read_complete,
-                                             virtio_port_error_cb);
+    virtio_port = virtio_port_open();
     if (virtio_port == NULL) {
         syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
         vdagentd_quit(1);
         return;
     }
+    setup_flow_control(VDAGENT_CONNECTION(virtio_port));
     do_client_disconnect();
     client_connected = old_client_connected;
+    update_flow_control();
+}
+
+/* @data is relayed by reference, it may be NULL if there's no data */
+static void virtio_send_clipboard(uint8_t selection, uint32_t msg_type,
+    uint32_t data_type, GBytes *data)
+{
+    VirtioPortMessage *msg;
+
+    msg = vdagent_virtio_port_message_new(VDP_CLIENT_PORT, msg_type, 0);
+
+    if (client_caps.clipboard_selection) {
+        uint8_t sel[4] = { selection, 0, 0, 0 };
+        vdagent_virtio_port_message_append(msg, sel, 4);
+    }
+    if (data_type != -1) {
+        data_type = GUINT32_TO_LE(data_type);
+        vdagent_virtio_port_message_append(msg, (uint8_t*)&data_type, 4);
+    }
+
+    if (msg_type == VD_AGENT_CLIPBOARD_GRAB && client_caps.clipboard_grab_serial) {
+        uint32_t serial = GUINT32_TO_LE(clipboard_serial[selection]++);
+        vdagent_virtio_port_message_append(msg, (uint8_t*)&serial, sizeof(serial));
+    }
+    if (data) {
+        vdagent_virtio_port_message_append_bytes(msg, data);
+    }
+    vdagent_virtio_port_message_send(virtio_port, msg);
 }
 
+/* Like virtio_send_clipboard(), but the data is compressed
+   if the client supports it */
 static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
-    uint32_t data_type, uint8_t *data, uint32_t data_size)
+    uint32_t data_type, GBytes *data)
 {
-    uint32_t size = data_size;
+    GBytes *compressed = NULL;
+
+    if (msg_type == VD_AGENT_CLIPBOARD && data &&
+        client_caps.clipboard_compression) {
+        compressed = clipboard_compress(data_type, data);
+        if (compressed) {
+            data = compressed;
+            data_type |= VD_AGENT_CLIPBOARD_COMPRESSED;
+        }
+    }
+    virtio_send_clipboard(selection, msg_type, data_type, data);
+    g_clear_pointer(&compressed, g_bytes_unref);
+}
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        size += 4;
+static void agent_disconnect(VDAgentConnection *conn, GError *err);
+
+static void clipboard_stream_clear(void)
+{
+    g_clear_pointer(&clipboard_stream.deflater, clipboard_deflater_free);
+    g_clear_pointer(&clipboard_stream.sample, g_byte_array_unref);
+    clipboard_stream.conn = NULL;
+    clipboard_stream.msg = NULL;
+    clipboard_stream.remaining = 0;
+    update_flow_control();
+}
+
+/* Called before virtio_port is destroyed along with the open message,
+   the rest of the data is dropped as it comes in */
+static void clipboard_stream_drop(void)
+{
+    clipboard_stream.msg = NULL;
+    g_clear_pointer(&clipboard_stream.deflater, clipboard_deflater_free);
+    g_clear_pointer(&clipboard_stream.sample, g_byte_array_unref);
+}
+
+static void clipboard_stream_abort(void)
+{
+    if (clipboard_stream.conn == NULL) {
+        return;
     }
-    if (msg_type == VD_AGENT_CLIPBOARD_GRAB
-        && VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                   VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
-        size += sizeof(uint32_t);
+    syslog(LOG_WARNING, "clipboard data of selection %u, type %u interrupted, "
+           "%u bytes missing", clipboard_stream.selection,
+           clipboard_stream.data_type, clipboard_stream.remaining);
+
+    if (clipboard_stream.msg) {
+        /* the client gets zeros instead of the missing data */
+        append_zeros(virtio_message_append, virtio_port, clipboard_stream.msg,
+                     clipboard_stream.remaining);
+    } else if (clipboard_stream.deflater) {
+        virtio_send_clipboard(clipboard_stream.selection, VD_AGENT_CLIPBOARD,
+                              VD_AGENT_CLIPBOARD_NONE, NULL);
     }
-    if (data_type != -1) {
-        size += 4;
+    clipboard_stream_clear();
+}
+
+static void clipboard_stream_finish(void)
+{
+    GBytes *bytes;
+
+    if (clipboard_stream.deflater) {
+        bytes = clipboard_deflater_finish(clipboard_stream.deflater);
+        if (bytes) {
+            virtio_send_clipboard(clipboard_stream.selection, VD_AGENT_CLIPBOARD,
+                clipboard_stream.data_type | VD_AGENT_CLIPBOARD_COMPRESSED, bytes);
+            g_bytes_unref(bytes);
+        } else {
+            virtio_send_clipboard(clipboard_stream.selection, VD_AGENT_CLIPBOARD,
+                                  VD_AGENT_CLIPBOARD_NONE, NULL);
+        }
     }
+    clipboard_stream_clear();
+}
 
-    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
-                                    0, size);
+/* Opens the VD_AGENT_CLIPBOARD message the data is sent in as it comes */
+static void clipboard_stream_send_begin(void)
+{
+    VirtioPortMessage *msg;
+    uint32_t prefix_size = sizeof(VDAgentClipboard), le_type;
+
+    msg = vdagent_virtio_port_message_new(VDP_CLIENT_PORT,
+                                          VD_AGENT_CLIPBOARD, 0);
+    if (client_caps.clipboard_selection) {
+        uint8_t sel[4] = { clipboard_stream.selection, 0, 0, 0 };
+        vdagent_virtio_port_message_append(msg, sel, 4);
+        prefix_size += 4;
+    }
+    le_type = GUINT32_TO_LE(clipboard_stream.data_type);
+    vdagent_virtio_port_message_append(msg, (uint8_t *)&le_type, 4);
+    if (vdagent_virtio_port_message_send_begin(virtio_port, msg,
+                                               prefix_size + clipboard_stream.size))
+        clipboard_stream.msg = msg;
+}
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        uint8_t sel[4] = { selection, 0, 0, 0 };
-        vdagent_virtio_port_write_append(virtio_port, sel, 4);
+/* The size of compressed data is only known once all of it has been
+   compressed, so it can't be sent on as it comes: only the compressed
+   data is held. The data is also kept until it's known to compress
+   well, so that it can still be sent as is. */
+static void clipboard_stream_deflate(const uint8_t *data, uint32_t size)
+{
+    GByteArray *sample = clipboard_stream.sample;
+    GBytes *bytes;
+    uint32_t n = size;
+
+    if (sample) {
+        n = MIN(size, CLIPBOARD_COMPRESS_SAMPLE_SIZE - sample->len);
+        g_byte_array_append(sample, data, n);
     }
-    if (data_type != -1) {
-        data_type = GUINT32_TO_LE(data_type);
-        vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&data_type, 4);
+    if (clipboard_deflater_feed(clipboard_stream.deflater, data, size)) {
+        if (sample && sample->len == CLIPBOARD_COMPRESS_SAMPLE_SIZE)
+            g_clear_pointer(&clipboard_stream.sample, g_byte_array_unref);
+        return;
     }
 
-    if (msg_type == VD_AGENT_CLIPBOARD_GRAB) {
-        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                    VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
-            uint32_t serial = GUINT32_TO_LE(clipboard_serial[selection]++);
-            vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&serial, sizeof(serial));
+    g_clear_pointer(&clipboard_stream.deflater, clipboard_deflater_free);
+    if (!sample) {
+        /* the compressor failed, there's nothing that could be sent */
+        syslog(LOG_WARNING, "failed to compress clipboard data, discarding");
+        virtio_send_clipboard(clipboard_stream.selection, VD_AGENT_CLIPBOARD,
+                              VD_AGENT_CLIPBOARD_NONE, NULL);
+        return;
+    }
+
+    clipboard_stream.sample = NULL;
+    bytes = g_byte_array_free_to_bytes(sample);
+    clipboard_stream_send_begin();
+    if (clipboard_stream.msg) {
+        vdagent_virtio_port_message_send_append(virtio_port,
+                                                clipboard_stream.msg, bytes);
+        if (n < size) {
+            g_bytes_unref(bytes);
+            bytes = g_bytes_new(data + n, size - n);
+            vdagent_virtio_port_message_send_append(virtio_port,
+                                                    clipboard_stream.msg, bytes);
         }
-        virtio_msg_uint32_to_le(data, data_size, 0);
     }
-    vdagent_virtio_port_write_append(virtio_port, data, data_size);
+    g_bytes_unref(bytes);
+}
+
+/* Unless the client can take the data compressed, it's sent right away
+   in an open message, holding only the chunks that are in flight. */
+static void clipboard_stream_begin(UdscsConnection *conn, uint8_t selection,
+                                   uint32_t data_type, uint32_t size)
+{
+    if (clipboard_stream.conn) {
+        syslog(LOG_ERR, "clipboard data started before the previous one ended");
+        clipboard_stream_abort();
+    }
+
+    clipboard_stream.conn = conn;
+    clipboard_stream.selection = selection;
+    clipboard_stream.data_type = data_type;
+    clipboard_stream.size = size;
+    clipboard_stream.remaining = size;
+    update_flow_control();
+
+    if (max_clipboard != -1 && size > max_clipboard) {
+        syslog(LOG_WARNING, "clipboard is too large (%u > %d), discarding",
+               size, max_clipboard);
+        virtio_write_clipboard(selection, VD_AGENT_CLIPBOARD, data_type, NULL);
+    } else {
+        if (client_caps.clipboard_compression &&
+            size <= CLIPBOARD_STREAM_COMPRESS_MAX)
+            clipboard_stream.deflater = clipboard_deflater_new(data_type, size);
+        if (clipboard_stream.deflater)
+            clipboard_stream.sample = g_byte_array_sized_new(
+                MIN(size, CLIPBOARD_COMPRESS_SAMPLE_SIZE));
+        else
+            clipboard_stream_send_begin();
+    }
+
+    if (size == 0)
+        clipboard_stream_finish();
+}
+
+static void clipboard_stream_chunk(UdscsConnection *conn,
+        struct udscs_message_header *header, uint8_t *data)
+{
+    GBytes *bytes;
+
+    /* the beginning was refused, e.g. the agent isn't the active one */
+    if (conn != clipboard_stream.conn) {
+        if (debug)
+            syslog(LOG_DEBUG, "%p ignoring clipboard data chunk", conn);
+        return;
+    }
+
+    if (header->arg1 != clipboard_stream.selection ||
+        header->size > clipboard_stream.remaining) {
+        syslog(LOG_ERR, "unexpected clipboard data chunk, disconnecting agent");
+        agent_disconnect(VDAGENT_CONNECTION(conn), NULL);
+        return;
+    }
+
+    if (clipboard_stream.msg) {
+        bytes = udscs_connection_ref_message_data(conn);
+        vdagent_virtio_port_message_send_append(virtio_port,
+                                                clipboard_stream.msg, bytes);
+        g_bytes_unref(bytes);
+    } else if (clipboard_stream.deflater) {
+        clipboard_stream_deflate(data, header->size);
+    }
+    clipboard_stream.remaining -= header->size;
+
+    if (clipboard_stream.remaining == 0)
+        clipboard_stream_finish();
 }
 
 /* vdagentd <-> vdagent communication handling */
@@ -690,9 +1673,9 @@ static void do_agent_clipboard(UdscsConnection *conn,
 {
     uint8_t selection = header->arg1;
     uint32_t msg_type = 0, data_type = -1, size = header->size;
+    GBytes *bytes = NULL, *cached;
 
-    if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                 VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
+    if (!client_caps.clipboard_by_demand)
         goto error;
 
     /* Check that this agent is from the currently active session */
@@ -708,8 +1691,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
         goto error;
     }
 
-    if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                 VD_AGENT_CAP_CLIPBOARD_SELECTION) &&
+    if (!client_caps.clipboard_selection &&
             selection != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD) {
         goto error;
     }
@@ -718,11 +1700,26 @@ static void do_agent_clipboard(UdscsConnection *conn,
     case VDAGENTD_CLIPBOARD_GRAB:
         msg_type = VD_AGENT_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = 1;
+        clipboard_cache_clear(selection);
+        clipboard_prefetch_cancel(&clipboard_prefetch[selection]);
         break;
     case VDAGENTD_CLIPBOARD_REQUEST:
         msg_type = VD_AGENT_CLIPBOARD_REQUEST;
         data_type = header->arg2;
         size = 0;
+        cached = clipboard_cache_lookup(selection, data_type);
+        if (cached && header->size == 0) {
+            if (debug)
+                syslog(LOG_DEBUG, "answering clipboard request from cache");
+            udscs_writev(conn, VDAGENTD_CLIPBOARD_DATA, selection, data_type,
+                         &cached, 1, VDAGENT_CONNECTION_PRIORITY_CONTROL);
+            return;
+        }
+        if (data_type == CLIPBOARD_PREFETCH_TYPE && header->size == 0 &&
+            clipboard_prefetch_agent_request(&clipboard_prefetch[selection])) {
+            /* the response to the prefetch is relayed instead */
+            return;
+        }
         break;
     case VDAGENTD_CLIPBOARD_DATA:
         msg_type = VD_AGENT_CLIPBOARD;
@@ -730,7 +1727,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
         if (max_clipboard != -1 && size > max_clipboard) {
             syslog(LOG_WARNING, "clipboard is too large (%d > %d), discarding",
                    size, max_clipboard);
-            virtio_write_clipboard(selection, msg_type, data_type, NULL, 0);
+            virtio_write_clipboard(selection, msg_type, data_type, NULL);
             return;
         }
         break;
@@ -738,7 +1735,21 @@ static void do_agent_clipboard(UdscsConnection *conn,
         msg_type = VD_AGENT_CLIPBOARD_RELEASE;
         size = 0;
         agent_owns_clipboard[selection] = 0;
+        clipboard_cache_clear(selection);
+        clipboard_prefetch_cancel(&clipboard_prefetch[selection]);
         break;
+    case VDAGENTD_CLIPBOARD_DATA_BEGIN: {
+        uint32_t data_size;
+
+        if (header->size != sizeof(data_size)) {
+            syslog(LOG_ERR, "invalid clipboard data begin, disconnecting agent");
+            agent_disconnect(VDAGENT_CONNECTION(conn), NULL);
+            return;
+        }
+        memcpy(&data_size, data, sizeof(data_size));
+        clipboard_stream_begin(conn, selection, header->arg2, data_size);
+        return;
+    }
     default:
         syslog(LOG_WARNING, "unexpected clipboard message type");
         goto error;
@@ -747,11 +1758,19 @@ static void do_agent_clipboard(UdscsConnection *conn,
     if (size != header->size) {
         syslog(LOG_ERR,
                "unexpected extra data in clipboard msg, disconnecting agent");
-        udscs_server_destroy_connection(server, conn);
+        agent_disconnect(VDAGENT_CONNECTION(conn), NULL);
         return;
     }
 
-    virtio_write_clipboard(selection, msg_type, data_type, data, header->size);
+    if (msg_type == VD_AGENT_CLIPBOARD_GRAB) {
+        virtio_msg_uint32_to_le(data, size, 0);
+    }
+
+    if (size > 0) {
+        bytes = udscs_connection_ref_message_data(conn);
+    }
+    virtio_write_clipboard(selection, msg_type, data_type, bytes);
+    g_clear_pointer(&bytes, g_bytes_unref);
 
     return;
 
@@ -799,17 +1818,17 @@ static void check_xorg_resolution(void)
 
         if (!virtio_port) {
             syslog(LOG_INFO, "opening vdagent virtio channel");
-            virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     virtio_port_error_cb);
+            virtio_port = virtio_port_open();
             if (!virtio_port) {
                 syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
                 vdagentd_quit(1);
                 return;
             }
+            setup_flow_control(VDAGENT_CONNECTION(virtio_port));
             send_capabilities(virtio_port, 1);
         }
     } else {
+        drop_pending_mouse();
 #ifndef WITH_STATIC_UINPUT
         vdagentd_uinput_destroy(&uinput);
 #endif
@@ -819,27 +1838,39 @@ static void check_xorg_resolution(void)
                 vdagentd_quit(0);
                 return;
             }
+            stream_relays_abort();
+            clipboard_stream_drop();
             vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
             g_clear_pointer(&virtio_port, vdagent_connection_destroy);
             syslog(LOG_INFO, "closed vdagent virtio channel");
         }
     }
+
+    update_flow_control();
 }
 
-static int connection_matches_active_session(UdscsConnection *conn,
-    void *priv)
+static void session_agents_add(UdscsConnection *conn, const char *session)
 {
-    UdscsConnection **conn_ret = (UdscsConnection **)priv;
-    struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+    GPtrArray *agents = g_hash_table_lookup(session_agents, session);
 
-    /* Check if this connection matches the currently active session */
-    if (!agent_data->session || !active_session)
-        return 0;
-    if (strcmp(agent_data->session, active_session))
-        return 0;
+    if (agents == NULL) {
+        agents = g_ptr_array_new();
+        g_hash_table_insert(session_agents, g_strdup(session), agents);
+    }
+    g_ptr_array_add(agents, conn);
+}
+
+static void session_agents_remove(UdscsConnection *conn, const char *session)
+{
+    GPtrArray *agents = g_hash_table_lookup(session_agents, session);
+
+    if (agents == NULL)
+        return;
 
-    *conn_ret = conn;
-    return 1;
+    /* keep the agents in the order they connected in */
+    g_ptr_array_remove(agents, conn);
+    if (agents->len == 0)
+        g_hash_table_remove(session_agents, session);
 }
 
 static void release_clipboards(void)
@@ -855,15 +1886,45 @@ static void release_clipboards(void)
     }
 }
 
+/* Disables file-xfer in the active session agent if its session doesn't
+   belong to a user (e.g. a greeter). The session type may only become known
+   after the agent became the active one, so this is checked again whenever
+   session_info has news for us. Until then do_client_file_xfer() refuses
+   transfers itself. */
+static void check_active_session_is_user(void)
+{
+    struct agent_data *agent_data;
+
+    if (!active_session_conn || session_info == NULL)
+        return;
+
+    agent_data = g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
+    if (agent_data->file_xfer_disabled || session_info_is_user(session_info) ||
+        !session_info_is_user_known(session_info))
+        return;
+
+    if (debug)
+        syslog(LOG_DEBUG, "Session agent does not belong to user: "
+               "disabling file-xfer");
+    udscs_write(active_session_conn, VDAGENTD_FILE_XFER_DISABLE, 0, 0,
+                NULL, 0);
+    agent_data->file_xfer_disabled = TRUE;
+}
+
 static void update_active_session_connection(UdscsConnection *new_conn)
 {
     if (session_info) {
+        GPtrArray *agents = NULL;
+
         new_conn = NULL;
         if (!active_session)
             active_session = session_info_get_active_session(session_info);
-        session_count = udscs_server_for_all_clients(server,
-                                         connection_matches_active_session,
-                                         (void*)&new_conn);
+        if (active_session)
+            agents = g_hash_table_lookup(session_agents, active_session);
+
+        session_count = agents ? agents->len : 0;
+        if (session_count > 0)
+            new_conn = g_ptr_array_index(agents, 0);
     } else {
         if (new_conn)
             session_count++;
@@ -884,20 +1945,16 @@ static void update_active_session_connection(UdscsConnection *new_conn)
     if (debug)
         syslog(LOG_DEBUG, "%p is now the active session", new_conn);
 
-    if (active_session_conn &&
-        session_info != NULL &&
-        !session_info_is_user(session_info)) {
-        if (debug)
-            syslog(LOG_DEBUG, "New session agent does not belong to user: "
-                   "disabling file-xfer");
-        udscs_write(active_session_conn, VDAGENTD_FILE_XFER_DISABLE, 0, 0,
-                    NULL, 0);
-    }
+    check_active_session_is_user();
 
     if (active_session_conn && mon_config)
-        udscs_write(active_session_conn, VDAGENTD_MONITORS_CONFIG, 0, 0,
-                    (uint8_t *)mon_config, sizeof(VDAgentMonitorsConfig) +
-                    mon_config->num_of_monitors * sizeof(VDAgentMonConfig));
+        udscs_write_with_priority(active_session_conn,
+                                  VDAGENTD_MONITORS_CONFIG, 0, 0,
+                                  (uint8_t *)mon_config,
+                                  sizeof(VDAgentMonitorsConfig) +
+                                  mon_config->num_of_monitors *
+                                  sizeof(VDAgentMonConfig),
+                                  VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
 
     release_clipboards();
 
@@ -916,12 +1973,29 @@ static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
         return 0;
 }
 
+static void agent_session_found(char *session, gpointer user_data)
+{
+    UdscsConnection *conn = user_data;
+    struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+
+    /* the agent disconnected while its session was looked up */
+    if (agent_data == NULL) {
+        free(session);
+        return;
+    }
+
+    agent_data->session = session;
+    if (agent_data->session)
+        session_agents_add(conn, agent_data->session);
+    update_active_session_connection(conn);
+}
+
 static void agent_connect(UdscsConnection *conn)
 {
     struct agent_data *agent_data;
     agent_data = g_new0(struct agent_data, 1);
     GError *err = NULL;
-    gint pid;
+    gint pid = 0;
 
     if (session_info) {
         pid = vdagent_connection_get_peer_pid(VDAGENT_CONNECTION(conn), &err);
@@ -933,14 +2007,23 @@ static void agent_connect(UdscsConnection *conn)
             udscs_server_destroy_connection(server, conn);
             return;
         }
-
-        agent_data->session = session_info_session_for_pid(session_info, pid);
     }
 
     g_object_set_data(G_OBJECT(conn), "agent_data", agent_data);
+    setup_flow_control(VDAGENT_CONNECTION(conn));
     udscs_write(conn, VDAGENTD_VERSION, 0, 0,
                 (uint8_t *)VERSION, strlen(VERSION) + 1);
-    update_active_session_connection(conn);
+
+    /* The agent only becomes the active one once its session is known,
+     * looking it up must not hold up the main loop */
+    if (session_info)
+        session_info_session_for_pid_async(session_info, pid,
+                                           agent_session_found,
+                                           g_object_ref(conn),
+                                           g_object_unref);
+    else
+        update_active_session_connection(conn);
+    update_flow_control();
 
     if (device_info) {
         forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO,
@@ -951,12 +2034,22 @@ static void agent_connect(UdscsConnection *conn)
 static void agent_disconnect(VDAgentConnection *conn, GError *err)
 {
     struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+    int i;
 
     g_hash_table_foreach_remove(active_xfers, remove_active_xfers, conn);
+    if (clipboard_stream.conn == UDSCS_CONNECTION(conn))
+        clipboard_stream_abort();
+    for (i = 0; i < VDP_END_PORT; i++) {
+        if (stream_relays[i].conn == UDSCS_CONNECTION(conn))
+            stream_relay_clear(&stream_relays[i]);
+    }
 
+    if (agent_data->session)
+        session_agents_remove(UDSCS_CONNECTION(conn), agent_data->session);
     g_clear_pointer(&agent_data->session, g_free);
     g_free(agent_data->screen_info);
     g_free(agent_data);
+    g_object_set_data(G_OBJECT(conn), "agent_data", NULL);
     if (err) {
         syslog(LOG_ERR, "%s", err->message);
         g_error_free(err);
@@ -964,6 +2057,7 @@ static void agent_disconnect(VDAgentConnection *conn, GError *err)
     udscs_server_destroy_connection(server, UDSCS_CONNECTION(conn));
 
     update_active_session_connection(NULL);
+    update_flow_control();
 }
 
 static void do_agent_xorg_resolution(UdscsConnection             *conn,
@@ -986,7 +2080,7 @@ static void do_agent_xorg_resolution(UdscsConnection             *conn,
     if (header->size != n * res_size) {
         syslog(LOG_ERR, "guest xorg resolution message has wrong size, "
                         "disconnecting agent");
-        udscs_server_destroy_connection(server, conn);
+        agent_disconnect(VDAGENT_CONNECTION(conn), NULL);
         return;
     }
 
@@ -1025,6 +2119,7 @@ static void do_agent_file_xfer_status(UdscsConnection             *conn,
         g_hash_table_insert(active_xfers, task_id, conn);
     else
         g_hash_table_remove(active_xfers, task_id);
+    update_flow_control();
 }
 
 static void agent_read_complete(UdscsConnection *conn,
@@ -1038,8 +2133,12 @@ static void agent_read_complete(UdscsConnection *conn,
     case VDAGENTD_CLIPBOARD_REQUEST:
     case VDAGENTD_CLIPBOARD_DATA:
     case VDAGENTD_CLIPBOARD_RELEASE:
+    case VDAGENTD_CLIPBOARD_DATA_BEGIN:
         do_agent_clipboard(conn, header, data);
         break;
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
+        clipboard_stream_chunk(conn, header, data);
+        break;
     case VDAGENTD_FILE_XFER_STATUS:
         do_agent_file_xfer_status(conn, header, data);
         break;
@@ -1056,6 +2155,7 @@ static gboolean si_io_channel_cb(GIOChannel  *source,
 {
     active_session = session_info_get_active_session(session_info);
     update_active_session_connection(NULL);
+    check_active_session_is_user();
     return G_SOURCE_CONTINUE;
 }
 
@@ -1150,6 +2250,11 @@ static GOptionEntry cmd_entries[] = {
       "Disable console kit and systemd-logind integration", NULL },
 #endif
 
+    { "clipboard-prefetch", 'p', 0,
+      G_OPTION_ARG_INT, &clipboard_prefetch_max,
+      "Fetch client clipboard text of up to BYTES as soon as it's grabbed",
+      "BYTES" },
+
     { NULL }
 };
 
@@ -1250,20 +2355,30 @@ int main(int argc, char *argv[])
         syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
     }
 
+    /* no client capabilities are known until the client announces them */
+    client_caps_update(NULL, 0);
     active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    session_agents = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify)g_ptr_array_unref);
 
     udscs_server_start(server);
     loop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(loop);
 
     release_clipboards();
+    stream_relays_abort();
+    clipboard_cache_clear_all();
 
+    drop_pending_mouse();
     vdagentd_uinput_destroy(&uinput);
     if (si_watch_id > 0) {
         g_source_remove(si_watch_id);
     }
     g_clear_pointer(&session_info, session_info_destroy);
     g_clear_pointer(&server, udscs_destroy_server);
+    g_clear_pointer(&session_agents, g_hash_table_destroy);
+    active_session_conn = NULL;
+    clipboard_stream_clear();
     if (virtio_port) {
         vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
         g_clear_pointer(&virtio_port, vdagent_connection_destroy);
@@ -1272,6 +2387,14 @@ int main(int argc, char *argv[])
     /* allow the VDAgentConnection(s) to finalize properly */
     g_main_context_iteration(NULL, FALSE);
 
+    if (debug) {
+        guint64 hits, misses;
+        vdagent_buffer_pool_get_stats(&hits, &misses);
+        syslog(LOG_DEBUG, "buffer pool: %" G_GUINT64_FORMAT " hits, %"
+               G_GUINT64_FORMAT " misses", hits, misses);
+        client_message_log_stats();
+    }
+
     g_main_loop_unref(loop);
 
     /* leave the socket around if it was provided by systemd */
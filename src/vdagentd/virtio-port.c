@@ -26,14 +26,33 @@
 #include <gio/gio.h>
 #include <glib-unix.h>
 
+#include "vdagent-buffer-pool.h"
 #include "vdagent-connection.h"
 #include "virtio-port.h"
 
 
-struct vdagent_virtio_port_buf {
-    uint8_t *buf;
-    size_t size;
-    size_t write_pos;
+struct _VirtioPortMessage {
+    uint32_t port_nr;
+    uint32_t message_type;
+    uint32_t message_opaque;
+    uint32_t data_size;
+
+    /* message header followed by the data
+     * appended before the first GBytes segment */
+    GByteArray *head;
+    /* GBytes segments following head */
+    GPtrArray *segments;
+    /* data copied after the last GBytes segment */
+    GByteArray *tail;
+
+    /* once sent, the position in segments where the next chunk starts
+     * and the number of bytes left */
+    guint seg_idx;
+    gsize seg_offset;
+    gsize remaining;
+    /* bytes of remaining that have been appended so far,
+     * less than remaining while the message is open */
+    gsize available;
 };
 
 /* Data to keep track of the assembling of vdagent messages per chunk port,
@@ -43,6 +62,16 @@ struct vdagent_virtio_port_chunk_port_data {
     int message_data_pos;
     VDAgentMessage message_header;
     uint8_t *message_data;
+    /* the body is passed to the stream callback instead of message_data */
+    gboolean streaming;
+};
+
+/* Outgoing messages of a chunk port. Messages of one port can't be
+   interleaved, so a message is picked by priority once the previous one
+   has been chunked completely. */
+struct vdagent_virtio_port_out_port_data {
+    GQueue queues[VDAGENT_CONNECTION_N_PRIORITIES];
+    VirtioPortMessage *current;
 };
 
 struct _VirtioPort {
@@ -50,16 +79,35 @@ struct _VirtioPort {
 
     /* Per chunk port data */
     struct vdagent_virtio_port_chunk_port_data port_data[VDP_END_PORT];
-
-    struct vdagent_virtio_port_buf write_buf;
+    struct vdagent_virtio_port_out_port_data out_port_data[VDP_END_PORT];
+
+    /* chunks are queued on the connection round-robin between the ports,
+     * WRITE_AHEAD_SIZE bytes at a time so that they can be interleaved */
+    guint next_out_port;
+    /* sizes of the chunks queued on the connection, oldest first */
+    GQueue chunk_sizes;
+    gsize bytes_queued;
+    /* bytes and messages waiting in out_port_data */
+    gsize pending_bytes;
+    guint pending_msgs;
 
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
+    vdagent_virtio_port_stream_callback stream_callback;
     VDAgentConnErrorCb error_cb;
 };
 
 G_DEFINE_TYPE(VirtioPort, virtio_port, VDAGENT_TYPE_CONNECTION)
 
+/* Message bodies passed to the read callback straight from the chunk
+ * must be aligned to this boundary, otherwise they are copied. */
+#define MESSAGE_DATA_ALIGN 4
+
+/* Bytes of chunks handed to the connection at once, more are queued
+ * as these get written. The same as virtio_console takes in one write,
+ * so that a bulk transfer doesn't need more writes than necessary. */
+#define WRITE_AHEAD_SIZE (32 * 1024)
+
 static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                                          gpointer header_data,
                                          gpointer chunk_data);
@@ -90,20 +138,51 @@ static gsize conn_handle_header(VDAgentConnection *conn,
     return header->size;
 }
 
+static void queue_chunks(VirtioPort *vport);
+
+static void conn_messages_written(VDAgentConnection *conn, guint n_msgs)
+{
+    VirtioPort *self = VIRTIO_PORT(conn);
+
+    while (n_msgs-- > 0) {
+        self->bytes_queued -=
+            GPOINTER_TO_SIZE(g_queue_pop_head(&self->chunk_sizes));
+    }
+    queue_chunks(self);
+}
+
 static void virtio_port_init(VirtioPort *self)
 {
+    guint i, prio;
+
+    for (i = 0; i < VDP_END_PORT; i++) {
+        for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+            g_queue_init(&self->out_port_data[i].queues[prio]);
+        }
+    }
+    g_queue_init(&self->chunk_sizes);
 }
 
 static void virtio_port_finalize(GObject *obj)
 {
     VirtioPort *self = VIRTIO_PORT(obj);
-    guint i;
-
-    g_free(self->write_buf.buf);
+    struct vdagent_virtio_port_out_port_data *out;
+    VirtioPortMessage *msg;
+    guint i, prio;
 
     for (i = 0; i < VDP_END_PORT; i++) {
-        g_free(self->port_data[i].message_data);
+        vdagent_buffer_pool_free(self->port_data[i].message_data,
+                                 self->port_data[i].message_header.size);
+
+        out = &self->out_port_data[i];
+        g_clear_pointer(&out->current, vdagent_virtio_port_message_free);
+        for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+            while ((msg = g_queue_pop_head(&out->queues[prio]))) {
+                vdagent_virtio_port_message_free(msg);
+            }
+        }
     }
+    g_queue_clear(&self->chunk_sizes);
 
     G_OBJECT_CLASS(virtio_port_parent_class)->finalize(obj);
 }
@@ -117,6 +196,10 @@ static void virtio_port_class_init(VirtioPortClass *klass)
 
     conn_class->handle_header = conn_handle_header;
     conn_class->handle_message = vdagent_virtio_port_do_chunk;
+    /* chunks are either copied into the message buffer
+     * or aligned by vdagent_virtio_port_do_chunk() itself */
+    conn_class->unaligned_data = TRUE;
+    conn_class->messages_written = conn_messages_written;
 }
 
 VirtioPort *vdagent_virtio_port_create(const char *portname,
@@ -173,65 +256,247 @@ VirtioPort *vdagent_virtio_port_create(const char *portname,
     return vport;
 }
 
-void vdagent_virtio_port_write_start(
-        VirtioPort *vport,
-        uint32_t port_nr,
-        uint32_t message_type,
-        uint32_t message_opaque,
-        uint32_t data_size)
+/* Replies are sent before the other messages, they don't depend on
+ * anything queued before them. Clipboard data stays in order with
+ * the grabs and releases around it. */
+static VDAgentConnPriority message_type_priority(uint32_t message_type)
 {
-    struct vdagent_virtio_port_buf *new_wbuf;
-    VDIChunkHeader *chunk_header;
-    VDAgentMessage *message_header;
+    switch (message_type) {
+    case VD_AGENT_REPLY:
+        return VDAGENT_CONNECTION_PRIORITY_INTERACTIVE;
+    default:
+        return VDAGENT_CONNECTION_PRIORITY_CONTROL;
+    }
+}
 
-    g_return_if_fail(vport->write_buf.buf == NULL);
+VirtioPortMessage *vdagent_virtio_port_message_new(uint32_t port_nr,
+                                                   uint32_t message_type,
+                                                   uint32_t message_opaque)
+{
+    VirtioPortMessage *msg = g_new0(VirtioPortMessage, 1);
+
+    msg->port_nr = port_nr;
+    msg->message_type = message_type;
+    msg->message_opaque = message_opaque;
+    msg->head = g_byte_array_new();
+    g_byte_array_set_size(msg->head, sizeof(VDAgentMessage));
+    msg->segments = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    return msg;
+}
 
-    new_wbuf = &vport->write_buf;
-    new_wbuf->write_pos = 0;
-    new_wbuf->size = sizeof(*chunk_header) + sizeof(*message_header) + data_size;
-    new_wbuf->buf = g_malloc(new_wbuf->size);
+void vdagent_virtio_port_message_append(VirtioPortMessage *msg,
+                                        const uint8_t     *data,
+                                        uint32_t           size)
+{
+    if (msg->segments->len == 0) {
+        g_byte_array_append(msg->head, data, size);
+    } else {
+        if (msg->tail == NULL) {
+            msg->tail = g_byte_array_new();
+        }
+        g_byte_array_append(msg->tail, data, size);
+    }
+    msg->data_size += size;
+}
 
-    chunk_header = (VDIChunkHeader *) (new_wbuf->buf + new_wbuf->write_pos);
-    chunk_header->port = GUINT32_TO_LE(port_nr);
-    chunk_header->size = GUINT32_TO_LE(sizeof(*message_header) + data_size);
-    new_wbuf->write_pos += sizeof(*chunk_header);
+void vdagent_virtio_port_message_append_bytes(VirtioPortMessage *msg,
+                                              GBytes            *bytes)
+{
+    if (g_bytes_get_size(bytes) == 0) {
+        return;
+    }
+    if (msg->tail) {
+        g_ptr_array_add(msg->segments, g_byte_array_free_to_bytes(msg->tail));
+        msg->tail = NULL;
+    }
+    g_ptr_array_add(msg->segments, g_bytes_ref(bytes));
+    msg->data_size += g_bytes_get_size(bytes);
+}
 
-    message_header = (VDAgentMessage *) (new_wbuf->buf + new_wbuf->write_pos);
-    message_header->protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
-    message_header->type = GUINT32_TO_LE(message_type);
-    message_header->opaque = GUINT64_TO_LE(message_opaque);
-    message_header->size = GUINT32_TO_LE(data_size);
-    new_wbuf->write_pos += sizeof(*message_header);
+void vdagent_virtio_port_message_free(VirtioPortMessage *msg)
+{
+    if (msg->head) {
+        g_byte_array_unref(msg->head);
+    }
+    if (msg->tail) {
+        g_byte_array_unref(msg->tail);
+    }
+    g_ptr_array_unref(msg->segments);
+    g_free(msg);
 }
 
-int vdagent_virtio_port_write_append(VirtioPort *vport,
-                                     const uint8_t *data, uint32_t size)
+/* Returns the message to take the next chunk of @out from, if any.
+ * An open message is only chunked once a full chunk is available. */
+static VirtioPortMessage *out_port_next_message(
+        struct vdagent_virtio_port_out_port_data *out)
 {
-    struct vdagent_virtio_port_buf *wbuf;
+    VirtioPortMessage *msg;
+    guint prio;
 
-    if (size == 0) {
-        return 0;
+    for (prio = 0; out->current == NULL && prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        out->current = g_queue_pop_head(&out->queues[prio]);
+    }
+    msg = out->current;
+    if (msg && msg->available < MIN(msg->remaining, VD_AGENT_MAX_DATA_SIZE)) {
+        return NULL;
     }
+    return msg;
+}
 
-    wbuf = &vport->write_buf;
-    if (!wbuf->buf) {
-        syslog(LOG_ERR, "can't append without a buffer");
-        return -1;
+/* Queue the next chunk of the current message of @port_nr,
+ * the data of the message is referenced, not copied */
+static void queue_chunk(VirtioPort *vport, guint port_nr)
+{
+    struct vdagent_virtio_port_out_port_data *out = &vport->out_port_data[port_nr];
+    VirtioPortMessage *msg = out->current;
+    VDIChunkHeader chunk_header;
+    GPtrArray *chunk;
+    GBytes *segment;
+    gsize size, left, n, segment_size;
+
+    size = MIN(msg->remaining, VD_AGENT_MAX_DATA_SIZE);
+    chunk_header.port = GUINT32_TO_LE(port_nr);
+    chunk_header.size = GUINT32_TO_LE(size);
+
+    chunk = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    g_ptr_array_add(chunk, g_bytes_new(&chunk_header, sizeof(chunk_header)));
+    for (left = size; left > 0; left -= n) {
+        segment = g_ptr_array_index(msg->segments, msg->seg_idx);
+        segment_size = g_bytes_get_size(segment);
+        n = MIN(segment_size - msg->seg_offset, left);
+        if (n == segment_size) {
+            g_ptr_array_add(chunk, g_bytes_ref(segment));
+        } else {
+            g_ptr_array_add(chunk, g_bytes_new_from_bytes(segment, msg->seg_offset, n));
+        }
+        msg->seg_offset += n;
+        if (msg->seg_offset == segment_size) {
+            msg->seg_idx++;
+            msg->seg_offset = 0;
+        }
+    }
+    /* drop the segments that have been chunked completely */
+    if (msg->seg_idx > 0) {
+        g_ptr_array_remove_range(msg->segments, 0, msg->seg_idx);
+        msg->seg_idx = 0;
     }
+    msg->remaining -= size;
+    msg->available -= size;
 
-    if (wbuf->size - wbuf->write_pos < size) {
-        syslog(LOG_ERR, "can't append to full buffer");
-        return -1;
+    vport->pending_bytes -= size;
+    if (msg->remaining == 0) {
+        vport->pending_msgs--;
+        g_clear_pointer(&out->current, vdagent_virtio_port_message_free);
     }
+    vdagent_connection_set_pending(VDAGENT_CONNECTION(vport),
+                                   vport->pending_bytes, vport->pending_msgs);
+
+    vdagent_connection_writev(VDAGENT_CONNECTION(vport),
+                              (GBytes **)chunk->pdata, chunk->len,
+                              VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    g_ptr_array_unref(chunk);
+    g_queue_push_tail(&vport->chunk_sizes,
+                      GSIZE_TO_POINTER(sizeof(chunk_header) + size));
+    vport->bytes_queued += sizeof(chunk_header) + size;
+}
 
-    memcpy(wbuf->buf + wbuf->write_pos, data, size);
-    wbuf->write_pos += size;
+/* Hand chunks over to the connection, taking turns between the ports.
+ *
+ * They are all queued with the same priority, since the chunks of
+ * a port must be written in order, the priority of the messages
+ * is taken into account by out_port_next_message(). */
+static void queue_chunks(VirtioPort *vport)
+{
+    guint i, port_nr = 0;
 
-    if (wbuf->write_pos == wbuf->size) {
-        vdagent_connection_write(VDAGENT_CONNECTION(vport), wbuf->buf, wbuf->size);
-        wbuf->buf = NULL;
+    while (vport->bytes_queued < WRITE_AHEAD_SIZE) {
+        for (i = 0; i < VDP_END_PORT; i++) {
+            port_nr = (vport->next_out_port + i) % VDP_END_PORT;
+            if (out_port_next_message(&vport->out_port_data[port_nr])) {
+                break;
+            }
+        }
+        if (i == VDP_END_PORT) {
+            return;
+        }
+        queue_chunk(vport, port_nr);
+        vport->next_out_port = port_nr + 1;
+    }
+}
+
+static void message_queue(VirtioPort        *vport,
+                          VirtioPortMessage *msg,
+                          uint32_t           data_size)
+{
+    VDAgentMessage *message_header;
+
+    message_header = (VDAgentMessage *)msg->head->data;
+    message_header->protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
+    message_header->type = GUINT32_TO_LE(msg->message_type);
+    message_header->opaque = GUINT64_TO_LE(msg->message_opaque);
+    message_header->size = GUINT32_TO_LE(data_size);
+
+    g_ptr_array_insert(msg->segments, 0, g_byte_array_free_to_bytes(msg->head));
+    msg->head = NULL;
+    if (msg->tail) {
+        g_ptr_array_add(msg->segments, g_byte_array_free_to_bytes(msg->tail));
+        msg->tail = NULL;
+    }
+
+    msg->remaining = sizeof(*message_header) + data_size;
+    msg->available = sizeof(*message_header) + msg->data_size;
+
+    g_queue_push_tail(&vport->out_port_data[msg->port_nr]
+                          .queues[message_type_priority(msg->message_type)], msg);
+    vport->pending_bytes += msg->available;
+    vport->pending_msgs++;
+    vdagent_connection_set_pending(VDAGENT_CONNECTION(vport),
+                                   vport->pending_bytes, vport->pending_msgs);
+    queue_chunks(vport);
+}
+
+void vdagent_virtio_port_message_send(VirtioPort        *vport,
+                                      VirtioPortMessage *msg)
+{
+    if (msg->port_nr >= VDP_END_PORT) {
+        syslog(LOG_ERR, "vdagent_virtio_port_message_send port out of range");
+        vdagent_virtio_port_message_free(msg);
+        return;
+    }
+    message_queue(vport, msg, msg->data_size);
+}
+
+gboolean vdagent_virtio_port_message_send_begin(VirtioPort        *vport,
+                                                VirtioPortMessage *msg,
+                                                uint32_t           data_size)
+{
+    if (msg->port_nr >= VDP_END_PORT || data_size < msg->data_size) {
+        syslog(LOG_ERR, "vdagent_virtio_port_message_send_begin invalid message");
+        vdagent_virtio_port_message_free(msg);
+        return FALSE;
     }
-    return 0;
+    message_queue(vport, msg, data_size);
+    return TRUE;
+}
+
+void vdagent_virtio_port_message_send_append(VirtioPort        *vport,
+                                             VirtioPortMessage *msg,
+                                             GBytes            *bytes)
+{
+    gsize size = g_bytes_get_size(bytes);
+
+    g_return_if_fail(msg->available + size <= msg->remaining);
+
+    if (size == 0) {
+        return;
+    }
+    g_ptr_array_add(msg->segments, g_bytes_ref(bytes));
+    msg->available += size;
+
+    vport->pending_bytes += size;
+    vdagent_connection_set_pending(VDAGENT_CONNECTION(vport),
+                                   vport->pending_bytes, vport->pending_msgs);
+    queue_chunks(vport);
 }
 
 void vdagent_virtio_port_write(
@@ -242,21 +507,63 @@ void vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size)
 {
-    vdagent_virtio_port_write_start(vport, port_nr, message_type,
-                                    message_opaque, data_size);
-    vdagent_virtio_port_write_append(vport, data, data_size);
+    VirtioPortMessage *msg;
+
+    msg = vdagent_virtio_port_message_new(port_nr, message_type, message_opaque);
+    vdagent_virtio_port_message_append(msg, data, data_size);
+    vdagent_virtio_port_message_send(vport, msg);
+}
+
+void vdagent_virtio_port_set_stream_callback(VirtioPort *vport,
+    vdagent_virtio_port_stream_callback stream_callback)
+{
+    vport->stream_callback = stream_callback;
 }
 
 void vdagent_virtio_port_reset(VirtioPort *vport, int port)
 {
+    struct vdagent_virtio_port_chunk_port_data *port_data;
+
     if (port >= VDP_END_PORT) {
         syslog(LOG_ERR, "vdagent_virtio_port_reset port out of range");
         return;
     }
-    g_free(vport->port_data[port].message_data);
+    port_data = &vport->port_data[port];
+    if (port_data->streaming) {
+        vport->stream_callback(vport, port, &port_data->message_header, NULL,
+                               port_data->message_data_pos,
+                               port_data->message_header.size -
+                               port_data->message_data_pos);
+    }
+    vdagent_buffer_pool_free(vport->port_data[port].message_data,
+                             vport->port_data[port].message_header.size);
     memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
 }
 
+static void message_header_from_le(VDAgentMessage *header)
+{
+    header->protocol = GUINT32_FROM_LE(header->protocol);
+    header->type = GUINT32_FROM_LE(header->type);
+    header->opaque = GUINT64_FROM_LE(header->opaque);
+    header->size = GUINT32_FROM_LE(header->size);
+}
+
+/* Passes the message of @port_nr with the body @data to the read callback
+ * and resets the port for the next message. */
+static void finish_message(VirtioPort *vport, int port_nr, uint8_t *data)
+{
+    struct vdagent_virtio_port_chunk_port_data *port = &vport->port_data[port_nr];
+
+    if (vport->read_callback && !port->streaming) {
+        vport->read_callback(vport, port_nr, &port->message_header, data);
+    }
+    port->message_header_read = 0;
+    port->message_data_pos = 0;
+    port->streaming = FALSE;
+    vdagent_buffer_pool_free(port->message_data, port->message_header.size);
+    port->message_data = NULL;
+}
+
 static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                                          gpointer header_data,
                                          gpointer chunk_data)
@@ -266,8 +573,28 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
     VDIChunkHeader *chunk_header = header_data;
     struct vdagent_virtio_port_chunk_port_data *port =
         &vport->port_data[chunk_header->port];
-
-    if (port->message_header_read < sizeof(port->message_header)) {
+    uint8_t *data;
+
+    if (port->message_header_read == 0 &&
+        chunk_header->size >= sizeof(port->message_header)) {
+        memcpy(&port->message_header, chunk_data, sizeof(port->message_header));
+        message_header_from_le(&port->message_header);
+        port->message_header_read = sizeof(port->message_header);
+        pos = sizeof(port->message_header);
+
+        /* most messages fit into a single chunk,
+         * these are passed on straight from the chunk */
+        if (chunk_header->size - pos == port->message_header.size) {
+            data = (uint8_t *)chunk_data + pos;
+            if ((guintptr)data % MESSAGE_DATA_ALIGN != 0) {
+                port->message_data = vdagent_buffer_pool_alloc(port->message_header.size);
+                memcpy(port->message_data, data, port->message_header.size);
+                data = port->message_data;
+            }
+            finish_message(vport, chunk_header->port, data);
+            return;
+        }
+    } else if (port->message_header_read < sizeof(port->message_header)) {
         read = sizeof(port->message_header) - port->message_header_read;
         if (read > chunk_header->size) {
             read = chunk_header->size;
@@ -276,15 +603,7 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                chunk_data, read);
         port->message_header_read += read;
         if (port->message_header_read == sizeof(port->message_header)) {
-
-            port->message_header.protocol = GUINT32_FROM_LE(port->message_header.protocol);
-            port->message_header.type = GUINT32_FROM_LE(port->message_header.type);
-            port->message_header.opaque = GUINT64_FROM_LE(port->message_header.opaque);
-            port->message_header.size = GUINT32_FROM_LE(port->message_header.size);
-
-            if (port->message_header.size) {
-                port->message_data = g_malloc(port->message_header.size);
-            }
+            message_header_from_le(&port->message_header);
         }
         pos = read;
     }
@@ -304,19 +623,31 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
             read = avail;
 
         if (read) {
-            memcpy(port->message_data + port->message_data_pos,
-                   chunk_data + pos, read);
+            data = (uint8_t *)chunk_data + pos;
+            if (port->message_data_pos == 0) {
+                /* the consumer may take the body of a message that spans
+                 * several chunks as it comes instead of having it buffered */
+                port->streaming = vport->stream_callback &&
+                    read < port->message_header.size &&
+                    vport->stream_callback(vport, chunk_header->port,
+                                           &port->message_header, data, 0, read);
+                if (!port->streaming) {
+                    port->message_data =
+                        vdagent_buffer_pool_alloc(port->message_header.size);
+                }
+            } else if (port->streaming) {
+                vport->stream_callback(vport, chunk_header->port,
+                                       &port->message_header, data,
+                                       port->message_data_pos, read);
+            }
+            if (!port->streaming) {
+                memcpy(port->message_data + port->message_data_pos, data, read);
+            }
             port->message_data_pos += read;
         }
 
         if (port->message_data_pos == port->message_header.size) {
-            if (vport->read_callback) {
-                vport->read_callback(vport, chunk_header->port,
-                                     &port->message_header, port->message_data);
-            }
-            port->message_header_read = 0;
-            port->message_data_pos = 0;
-            g_clear_pointer(&port->message_data, g_free);
+            finish_message(vport, chunk_header->port, port->message_data);
         }
     }
 }
@@ -40,24 +40,76 @@ typedef void (*vdagent_virtio_port_read_callback)(
     VDAgentMessage *message_header,
     uint8_t *data);
 
+/* Callbacks with this type are offered the body of a message that spans
+   several chunks as soon as its first piece has been received.
+   Returning TRUE takes the message over: the rest of the body is passed
+   piece by piece as it comes in, with offset being the position of data
+   within the body, and the read callback isn't called for it.
+   Returning FALSE lets the message be reassembled as usual.
+   If the port is reset before the body is complete, the callback is called
+   once more with data set to NULL and size being the number of bytes lost.
+   The return value is only used for the first piece. */
+typedef gboolean (*vdagent_virtio_port_stream_callback)(
+    VirtioPort *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    const uint8_t *data,
+    uint32_t offset,
+    uint32_t size);
+
 /* Create a vdagent virtio port object for port portname */
 VirtioPort *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
     VDAgentConnErrorCb error_cb);
 
-/* Queue a message for delivery, either bit by bit, or all at once */
-void vdagent_virtio_port_write_start(
-        VirtioPort *vport,
+/* Builder of a message composed of several pieces,
+ * any number of messages can be composed at once. */
+typedef struct _VirtioPortMessage VirtioPortMessage;
+
+VirtioPortMessage *vdagent_virtio_port_message_new(
         uint32_t port_nr,
         uint32_t message_type,
-        uint32_t message_opaque,
-        uint32_t data_size);
+        uint32_t message_opaque);
 
-int vdagent_virtio_port_write_append(
-        VirtioPort *vport,
+/* Append a copy of data to the message */
+void vdagent_virtio_port_message_append(
+        VirtioPortMessage *msg,
         const uint8_t *data,
         uint32_t size);
 
+/* Append a reference to bytes to the message, the data isn't copied */
+void vdagent_virtio_port_message_append_bytes(
+        VirtioPortMessage *msg,
+        GBytes *bytes);
+
+/* Queue the message for delivery and free msg */
+void vdagent_virtio_port_message_send(
+        VirtioPort *vport,
+        VirtioPortMessage *msg);
+
+/* Like vdagent_virtio_port_message_send(), but the message carries
+ * data_size bytes of data in total, the part that hasn't been appended
+ * yet follows with vdagent_virtio_port_message_send_append().
+ *
+ * Nothing else is sent on the port of msg until the message is complete.
+ * msg is valid until the last byte has been appended or vport is
+ * destroyed. Returns FALSE if msg was invalid and has been freed. */
+gboolean vdagent_virtio_port_message_send_begin(
+        VirtioPort *vport,
+        VirtioPortMessage *msg,
+        uint32_t data_size);
+
+/* Append a reference to bytes to a message started with
+ * vdagent_virtio_port_message_send_begin() */
+void vdagent_virtio_port_message_send_append(
+        VirtioPort *vport,
+        VirtioPortMessage *msg,
+        GBytes *bytes);
+
+/* Free msg without sending it */
+void vdagent_virtio_port_message_free(VirtioPortMessage *msg);
+
+/* Queue a message for delivery all at once */
 void vdagent_virtio_port_write(
         VirtioPort *vport,
         uint32_t port_nr,
@@ -66,6 +118,9 @@ void vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size);
 
+void vdagent_virtio_port_set_stream_callback(VirtioPort *vport,
+    vdagent_virtio_port_stream_callback stream_callback);
+
 void vdagent_virtio_port_reset(VirtioPort *vport, int port);
 
 G_END_DECLS
@@ -28,117 +28,148 @@
 #include <errno.h>
 #include <limits.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <glib.h>
+#include <gio/gio.h>
 #include "xorg-conf.h"
 
-#define FPRINTF(...) \
-    do { \
-        r = fprintf(f, __VA_ARGS__); \
-        if (r < 0) { \
-            syslog(LOG_ERR, "Error writing to %s: %m", xorg_conf); \
-            fclose(f); \
-            pci_system_cleanup(); \
-            return; \
-        } \
-    } while(0)
+#ifdef HAVE_PCIACCESS
 
-void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
+#define XORG_CONF     "/run/spice-vdagentd/xorg.conf.spice"
+#define XORG_CONF_OLD "/run/spice-vdagentd/xorg.conf.spice.old"
+
+struct qxl_device {
+    int bus;
+    int dev;
+    int func;
+};
+
+/* The QXL devices don't change while we're running,
+ * so the PCI bus is only scanned until a scan succeeds */
+static GArray *qxl_devices = NULL;
+
+/* The xorg.conf last handed to the writer thread, monitor configs
+ * resulting in the same file don't cause it to be written again */
+static gchar *xorg_conf_last = NULL;
+/* Only one write is in flight, the newest xorg.conf generated meanwhile
+ * is written once it's done */
+static gboolean xorg_conf_writing = FALSE;
+static gchar *xorg_conf_pending = NULL;
+
+static void xorg_conf_write_start(gchar *contents);
+
+/* Don't leave an xorg.conf from a previous run behind
+ * when we're not going to generate one */
+static void xorg_conf_remove(void)
 {
-#ifdef HAVE_PCIACCESS
-    int i, r, count, min_x = INT_MAX, min_y = INT_MAX;
-    FILE *f;
+    if (rename(XORG_CONF, XORG_CONF_OLD) && errno != ENOENT)
+        syslog(LOG_ERR, "Error renaming %s to %s: %m", XORG_CONF, XORG_CONF_OLD);
+}
+
+static gboolean xorg_conf_scan_qxl_devices(void)
+{
+    int r;
     struct pci_device_iterator *it;
     struct pci_device *dev;
+    GArray *devices;
     const struct pci_id_match qxl_id_match = {
         .vendor_id = 0x1b36,
         .device_id = 0x0100,
         .subvendor_id = PCI_MATCH_ANY,
         .subdevice_id = PCI_MATCH_ANY,
     };
-    const char *xorg_conf = "/run/spice-vdagentd/xorg.conf.spice";
-    const char *xorg_conf_old = "/run/spice-vdagentd/xorg.conf.spice.old";
-
-    r = rename(xorg_conf, xorg_conf_old);
-    if (r && errno != ENOENT) {
-        syslog(LOG_ERR,
-               "Error renaming %s to %s: %m, not generating xorg.conf",
-               xorg_conf, xorg_conf_old);
-        return;
-    }
+
+    if (qxl_devices)
+        return qxl_devices->len > 0;
 
     r = pci_system_init();
     if (r) {
         syslog(LOG_ERR, "Error initializing libpciaccess: %d, not generating xorg.conf", r);
-        return;
+        xorg_conf_remove();
+        return FALSE;
     }
 
     it = pci_id_match_iterator_create(&qxl_id_match);
     if (!it) {
         syslog(LOG_ERR, "Error could not create pci id iterator for QXL devices, not generating xorg.conf");
         pci_system_cleanup();
-        return;
+        xorg_conf_remove();
+        return FALSE;
     }
 
-    dev = pci_device_next(it);
-    if (!dev) {
-        syslog(LOG_ERR, "No QXL devices found, not generating xorg.conf");
-        pci_system_cleanup();
-        return;
+    devices = g_array_new(FALSE, FALSE, sizeof(struct qxl_device));
+    while ((dev = pci_device_next(it))) {
+        struct qxl_device qxl = {
+            .bus = dev->bus,
+            .dev = dev->dev,
+            .func = dev->func,
+        };
+        g_array_append_val(devices, qxl);
     }
+    pci_iterator_destroy(it);
+    pci_system_cleanup();
+    qxl_devices = devices;
 
-    f = fopen(xorg_conf, "w");
-    if (!f) {
-        syslog(LOG_ERR, "Error opening %s for writing: %m", xorg_conf);
-        pci_system_cleanup();
-        return;
+    if (qxl_devices->len == 0) {
+        syslog(LOG_ERR, "No QXL devices found, not generating xorg.conf");
+        xorg_conf_remove();
+        return FALSE;
     }
+    return TRUE;
+}
+
+static gchar *xorg_conf_generate(VDAgentMonitorsConfig *monitor_conf)
+{
+    GString *conf = g_string_new(NULL);
+    int i, count, min_x = INT_MAX, min_y = INT_MAX;
 
-    FPRINTF("# xorg.conf generated by spice-vdagentd\n");
-    FPRINTF("# generated from monitor info provided by the client\n\n");
+    g_string_append(conf, "# xorg.conf generated by spice-vdagentd\n");
+    g_string_append(conf, "# generated from monitor info provided by the client\n\n");
 
     if (monitor_conf->num_of_monitors == 1) {
-        FPRINTF("# Client has only 1 monitor\n");
-        FPRINTF("# This works best with no xorg.conf, leaving xorg.conf empty\n");
-        fclose(f);
-        pci_system_cleanup();
-        return;
+        g_string_append(conf, "# Client has only 1 monitor\n");
+        g_string_append(conf, "# This works best with no xorg.conf, leaving xorg.conf empty\n");
+        return g_string_free(conf, FALSE);
     }
 
-    FPRINTF("Section \"ServerFlags\"\n");
-    FPRINTF("\tOption\t\t\"Xinerama\"\t\"true\"\n");
-    FPRINTF("EndSection\n\n");
-
-    i = 0;
-    do {
-        FPRINTF("Section \"Device\"\n");
-        FPRINTF("\tIdentifier\t\"qxl%d\"\n", i++);
-        FPRINTF("\tDriver\t\t\"qxl\"\n");
-        FPRINTF("\tBusID\t\t\"PCI:%02d:%02d:%d\"\n",
-                dev->bus, dev->dev, dev->func);
-        FPRINTF("\tOption\t\t\"NumHeads\"\t\"1\"\n");
-        FPRINTF("EndSection\n\n");
-    } while ((dev = pci_device_next(it)));
+    g_string_append(conf, "Section \"ServerFlags\"\n");
+    g_string_append(conf, "\tOption\t\t\"Xinerama\"\t\"true\"\n");
+    g_string_append(conf, "EndSection\n\n");
+
+    for (i = 0; i < (int)qxl_devices->len; i++) {
+        struct qxl_device *dev = &g_array_index(qxl_devices, struct qxl_device, i);
+
+        g_string_append(conf, "Section \"Device\"\n");
+        g_string_append_printf(conf, "\tIdentifier\t\"qxl%d\"\n", i);
+        g_string_append(conf, "\tDriver\t\t\"qxl\"\n");
+        g_string_append_printf(conf, "\tBusID\t\t\"PCI:%02d:%02d:%d\"\n",
+                               dev->bus, dev->dev, dev->func);
+        g_string_append(conf, "\tOption\t\t\"NumHeads\"\t\"1\"\n");
+        g_string_append(conf, "EndSection\n\n");
+    }
 
     if (i < monitor_conf->num_of_monitors) {
-        FPRINTF("# Client has %d monitors, but only %d qxl devices found\n",
-                monitor_conf->num_of_monitors, i);
-        FPRINTF("# Only generation %d \"Screen\" sections\n\n", i);
+        g_string_append_printf(conf, "# Client has %d monitors, but only %d qxl devices found\n",
+                               monitor_conf->num_of_monitors, i);
+        g_string_append_printf(conf, "# Only generation %d \"Screen\" sections\n\n", i);
         count = i;
     } else {
         count = monitor_conf->num_of_monitors;
     }
 
     for (i = 0; i < count; i++) {
-        FPRINTF("Section \"Screen\"\n");
-        FPRINTF("\tIdentifier\t\"Screen%d\"\n", i);
-        FPRINTF("\tDevice\t\t\"qxl%d\"\n", i);
-        FPRINTF("\tDefaultDepth\t24\n");
-        FPRINTF("\tSubSection \"Display\"\n");
-        FPRINTF("\t\tViewport\t0 0\n");
-        FPRINTF("\t\tDepth\t\t24\n");
-        FPRINTF("\t\tModes\t\t\"%dx%d\"\n", monitor_conf->monitors[i].width,
-                monitor_conf->monitors[i].height);
-        FPRINTF("\tEndSubSection\n");
-        FPRINTF("EndSection\n\n");
+        g_string_append(conf, "Section \"Screen\"\n");
+        g_string_append_printf(conf, "\tIdentifier\t\"Screen%d\"\n", i);
+        g_string_append_printf(conf, "\tDevice\t\t\"qxl%d\"\n", i);
+        g_string_append(conf, "\tDefaultDepth\t24\n");
+        g_string_append(conf, "\tSubSection \"Display\"\n");
+        g_string_append(conf, "\t\tViewport\t0 0\n");
+        g_string_append(conf, "\t\tDepth\t\t24\n");
+        g_string_append_printf(conf, "\t\tModes\t\t\"%dx%d\"\n",
+                               monitor_conf->monitors[i].width,
+                               monitor_conf->monitors[i].height);
+        g_string_append(conf, "\tEndSubSection\n");
+        g_string_append(conf, "EndSection\n\n");
     }
 
     /* monitor_conf may contain negative values, convert these to 0 - # */
@@ -151,16 +182,102 @@ void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
         }
     }
 
-    FPRINTF("Section \"ServerLayout\"\n");
-    FPRINTF("\tIdentifier\t\"layout\"\n");
+    g_string_append(conf, "Section \"ServerLayout\"\n");
+    g_string_append(conf, "\tIdentifier\t\"layout\"\n");
     for (i = 0; i < count; i++) {
-        FPRINTF("\tScreen\t\t\"Screen%d\" %d %d\n", i,
-                monitor_conf->monitors[i].x - min_x,
-                monitor_conf->monitors[i].y - min_y);
+        g_string_append_printf(conf, "\tScreen\t\t\"Screen%d\" %d %d\n", i,
+                               monitor_conf->monitors[i].x - min_x,
+                               monitor_conf->monitors[i].y - min_y);
     }
-    FPRINTF("EndSection\n");
+    g_string_append(conf, "EndSection\n");
 
-    fclose(f);
-    pci_system_cleanup();
+    return g_string_free(conf, FALSE);
+}
+
+/* Runs in a worker thread */
+static void xorg_conf_write_thread(GTask        *task,
+                                   gpointer      source_object,
+                                   gpointer      task_data,
+                                   GCancellable *cancellable)
+{
+    const gchar *contents = task_data;
+    GError *err = NULL;
+
+    /* Keep the previous file around as xorg.conf.spice.old */
+    if (g_file_test(XORG_CONF, G_FILE_TEST_EXISTS)) {
+        unlink(XORG_CONF_OLD);
+        if (link(XORG_CONF, XORG_CONF_OLD))
+            syslog(LOG_WARNING, "Error linking %s to %s: %m",
+                   XORG_CONF, XORG_CONF_OLD);
+    }
+
+    /* Writes a temporary file and renames it over XORG_CONF,
+     * so the X server never sees a partially written file */
+    if (!g_file_set_contents(XORG_CONF, contents, -1, &err)) {
+        g_task_return_error(task, err);
+        return;
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+static void xorg_conf_write_done(GObject      *source_object,
+                                 GAsyncResult *res,
+                                 gpointer      user_data)
+{
+    GError *err = NULL;
+    gchar *pending;
+
+    if (!g_task_propagate_boolean(G_TASK(res), &err)) {
+        syslog(LOG_ERR, "Error writing %s: %s", XORG_CONF, err->message);
+        g_error_free(err);
+        /* Try again with the next monitors config */
+        if (xorg_conf_pending == NULL)
+            g_clear_pointer(&xorg_conf_last, g_free);
+    }
+
+    xorg_conf_writing = FALSE;
+    pending = xorg_conf_pending;
+    xorg_conf_pending = NULL;
+    if (pending)
+        xorg_conf_write_start(pending);
+}
+
+/* Takes ownership of contents */
+static void xorg_conf_write_start(gchar *contents)
+{
+    GTask *task;
+
+    task = g_task_new(NULL, NULL, xorg_conf_write_done, NULL);
+    g_task_set_task_data(task, contents, g_free);
+    xorg_conf_writing = TRUE;
+    g_task_run_in_thread(task, xorg_conf_write_thread);
+    g_object_unref(task);
+}
+
+#endif
+
+void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
+{
+#ifdef HAVE_PCIACCESS
+    gchar *contents;
+
+    if (!xorg_conf_scan_qxl_devices())
+        return;
+
+    contents = xorg_conf_generate(monitor_conf);
+    if (g_strcmp0(contents, xorg_conf_last) == 0) {
+        g_free(contents);
+        return;
+    }
+
+    g_free(xorg_conf_last);
+    xorg_conf_last = g_strdup(contents);
+
+    if (xorg_conf_writing) {
+        g_free(xorg_conf_pending);
+        xorg_conf_pending = contents;
+        return;
+    }
+    xorg_conf_write_start(contents);
 #endif
 }
@@ -0,0 +1,134 @@
+/*  test-buffer-pool.c  - test the message buffer pool
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <glib.h>
+
+#include "vdagent-buffer-pool.h"
+
+#define KiB 1024
+#define MiB (1024 * 1024)
+
+static guint64 hits, misses;
+
+/* Checks that the pool counted @new_hits hits and @new_misses misses
+ * since the last call */
+static void check_stats(guint64 new_hits, guint64 new_misses)
+{
+    guint64 cur_hits, cur_misses;
+
+    vdagent_buffer_pool_get_stats(&cur_hits, &cur_misses);
+    g_assert_cmpuint(cur_hits - hits, ==, new_hits);
+    g_assert_cmpuint(cur_misses - misses, ==, new_misses);
+    hits = cur_hits;
+    misses = cur_misses;
+}
+
+/* a freed buffer is handed out again for any size of the same class */
+static void test_reuse(gsize size, gsize same_class_size)
+{
+    gpointer buf, buf2;
+
+    buf = vdagent_buffer_pool_alloc(size);
+    g_assert_nonnull(buf);
+    memset(buf, 0xaa, size);
+    check_stats(0, 1);
+
+    vdagent_buffer_pool_free(buf, size);
+    buf2 = vdagent_buffer_pool_alloc(same_class_size);
+    g_assert_true(buf2 == buf);
+    memset(buf2, 0x55, same_class_size);
+    check_stats(1, 0);
+
+    vdagent_buffer_pool_free(buf2, same_class_size);
+    buf = vdagent_buffer_pool_alloc(size);
+    g_assert_true(buf == buf2);
+    check_stats(1, 0);
+
+    /* keep the buffer out of the pool, so that the next test starts
+     * with an empty class */
+    g_free(buf);
+}
+
+static void test_oversized(void)
+{
+    gpointer buf, buf2;
+    gsize size = 2 * MiB;
+
+    buf = vdagent_buffer_pool_alloc(size);
+    g_assert_nonnull(buf);
+    memset(buf, 0xaa, size);
+    check_stats(0, 1);
+
+    /* too large to be kept around */
+    vdagent_buffer_pool_free(buf, size);
+    buf2 = vdagent_buffer_pool_alloc(size);
+    g_assert_nonnull(buf2);
+    check_stats(0, 1);
+    vdagent_buffer_pool_free(buf2, size);
+}
+
+static void test_empty(void)
+{
+    g_assert_null(vdagent_buffer_pool_alloc(0));
+    vdagent_buffer_pool_free(NULL, 0);
+    vdagent_buffer_pool_free(NULL, 100);
+    check_stats(0, 0);
+}
+
+/* no more than 4 MiB of free buffers are retained */
+static void test_retained_limit(void)
+{
+    gpointer bufs[8];
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(bufs); i++) {
+        bufs[i] = vdagent_buffer_pool_alloc(MiB);
+        g_assert_nonnull(bufs[i]);
+    }
+    check_stats(0, G_N_ELEMENTS(bufs));
+
+    for (i = 0; i < G_N_ELEMENTS(bufs); i++) {
+        vdagent_buffer_pool_free(bufs[i], MiB);
+    }
+    for (i = 0; i < G_N_ELEMENTS(bufs); i++) {
+        bufs[i] = vdagent_buffer_pool_alloc(MiB);
+    }
+    check_stats(4, G_N_ELEMENTS(bufs) - 4);
+
+    for (i = 0; i < G_N_ELEMENTS(bufs); i++) {
+        g_free(bufs[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    test_empty();
+    test_reuse(1, 16);
+    test_reuse(100, 128);
+    test_reuse(2 * KiB, 1500);
+    test_reuse(20 * KiB, 32 * KiB);
+    test_reuse(MiB, 600 * KiB);
+    test_oversized();
+    test_retained_limit();
+
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*  test-clipboard-compress.c  - test clipboard compression
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <spice/vd_agent.h>
+
+#include "clipboard-compress.h"
+
+static GBytes *make_text(gsize size)
+{
+    static const char words[] = "the quick brown fox jumps over the lazy dog\n";
+    guint8 *data = g_malloc(size);
+    gsize i;
+
+    for (i = 0; i < size; i++)
+        data[i] = words[i % (sizeof(words) - 1)];
+    return g_bytes_new_take(data, size);
+}
+
+static GBytes *make_random(gsize size)
+{
+    guint8 *data = g_malloc(size);
+    GRand *rand = g_rand_new_with_seed(42);
+    gsize i;
+
+    for (i = 0; i < size; i++)
+        data[i] = g_rand_int(rand);
+    g_rand_free(rand);
+    return g_bytes_new_take(data, size);
+}
+
+/* Decompresses @compressed in pieces of @piece_size bytes,
+   the way data relayed from the client comes in */
+static GBytes *inflate_in_pieces(GBytes *compressed, gsize piece_size)
+{
+    ClipboardInflater *inflater = clipboard_inflater_new();
+    GByteArray *out = g_byte_array_new();
+    const guint8 *data;
+    gsize size, offset, n;
+    GError *err = NULL;
+    GBytes *bytes;
+
+    data = g_bytes_get_data(compressed, &size);
+    for (offset = 0; offset < size; offset += n) {
+        n = MIN(piece_size, size - offset);
+        bytes = clipboard_inflater_feed(inflater, data + offset, n, &err);
+        g_assert_no_error(err);
+        g_assert_nonnull(bytes);
+        g_byte_array_append(out, g_bytes_get_data(bytes, NULL),
+                            g_bytes_get_size(bytes));
+        g_bytes_unref(bytes);
+    }
+    g_assert_true(clipboard_inflater_is_done(inflater));
+    g_assert_cmpuint(clipboard_inflater_get_size(inflater), ==, out->len);
+    clipboard_inflater_free(inflater);
+    return g_byte_array_free_to_bytes(out);
+}
+
+/* guest -> client: what vdagentd sends must decompress to the original */
+static void test_round_trip(gsize size)
+{
+    GBytes *text = make_text(size);
+    GBytes *compressed, *out;
+    GError *err = NULL;
+
+    compressed = clipboard_compress(VD_AGENT_CLIPBOARD_UTF8_TEXT, text);
+    g_assert_nonnull(compressed);
+    g_assert_cmpuint(g_bytes_get_size(compressed), <, size);
+
+    out = clipboard_decompress(NULL, 0, g_bytes_get_data(compressed, NULL),
+                               g_bytes_get_size(compressed), &err);
+    g_assert_no_error(err);
+    g_assert_true(g_bytes_equal(out, text));
+    g_bytes_unref(out);
+
+    /* with the header of the message in front */
+    out = clipboard_decompress((const uint8_t *)"head", 4,
+                               g_bytes_get_data(compressed, NULL),
+                               g_bytes_get_size(compressed), &err);
+    g_assert_no_error(err);
+    g_assert_cmpuint(g_bytes_get_size(out), ==, size + 4);
+    g_assert_cmpmem(g_bytes_get_data(out, NULL), 4, "head", 4);
+    g_assert_cmpmem((const uint8_t *)g_bytes_get_data(out, NULL) + 4, size,
+                    g_bytes_get_data(text, NULL), size);
+    g_bytes_unref(out);
+
+    g_bytes_unref(compressed);
+    g_bytes_unref(text);
+}
+
+/* client -> guest: compressed data relayed piece by piece */
+static void test_streaming(gsize size, gsize piece_size)
+{
+    GBytes *text = make_text(size);
+    GBytes *compressed, *out;
+
+    compressed = clipboard_compress(VD_AGENT_CLIPBOARD_UTF8_TEXT, text);
+    g_assert_nonnull(compressed);
+
+    out = inflate_in_pieces(compressed, piece_size);
+    g_assert_true(g_bytes_equal(out, text));
+    g_bytes_unref(out);
+
+    g_bytes_unref(compressed);
+    g_bytes_unref(text);
+}
+
+/* guest -> client: data compressed piece by piece as the agent sends it
+   gives the same result as compressing it at once */
+static void test_deflate_in_pieces(gsize size, gsize piece_size)
+{
+    GBytes *text = make_text(size);
+    GBytes *compressed, *out;
+    ClipboardDeflater *deflater;
+    const uint8_t *data;
+    gsize offset, n;
+
+    deflater = clipboard_deflater_new(VD_AGENT_CLIPBOARD_UTF8_TEXT, size);
+    g_assert_nonnull(deflater);
+    data = g_bytes_get_data(text, NULL);
+    for (offset = 0; offset < size; offset += n) {
+        n = MIN(piece_size, size - offset);
+        g_assert_true(clipboard_deflater_feed(deflater, data + offset, n));
+    }
+    compressed = clipboard_deflater_finish(deflater);
+    g_assert_nonnull(compressed);
+    clipboard_deflater_free(deflater);
+
+    out = clipboard_compress(VD_AGENT_CLIPBOARD_UTF8_TEXT, text);
+    g_assert_true(g_bytes_equal(out, compressed));
+    g_bytes_unref(out);
+
+    out = inflate_in_pieces(compressed, 4096);
+    g_assert_true(g_bytes_equal(out, text));
+    g_bytes_unref(out);
+
+    g_bytes_unref(compressed);
+    g_bytes_unref(text);
+}
+
+static void test_skipped(void)
+{
+    GBytes *text = make_text(CLIPBOARD_COMPRESS_MIN_SIZE - 1);
+    GBytes *random = make_random(256 * 1024);
+    ClipboardDeflater *deflater;
+    GBytes *compressed;
+
+    /* too small */
+    g_assert_null(clipboard_compress(VD_AGENT_CLIPBOARD_UTF8_TEXT, text));
+    g_bytes_unref(text);
+
+    /* already compressed formats aren't even tried */
+    text = make_text(64 * 1024);
+    g_assert_null(clipboard_compress(VD_AGENT_CLIPBOARD_IMAGE_PNG, text));
+    g_assert_null(clipboard_compress(VD_AGENT_CLIPBOARD_IMAGE_JPG, text));
+    compressed = clipboard_compress(VD_AGENT_CLIPBOARD_IMAGE_BMP, text);
+    g_assert_nonnull(compressed);
+    g_bytes_unref(compressed);
+    g_bytes_unref(text);
+
+    /* incompressible data is given up on */
+    g_assert_null(clipboard_compress(VD_AGENT_CLIPBOARD_IMAGE_BMP, random));
+
+    /* as soon as that's known */
+    deflater = clipboard_deflater_new(VD_AGENT_CLIPBOARD_IMAGE_BMP,
+                                      g_bytes_get_size(random));
+    g_assert_nonnull(deflater);
+    g_assert_false(clipboard_deflater_feed(deflater,
+                                           g_bytes_get_data(random, NULL),
+                                           64 * 1024));
+    clipboard_deflater_free(deflater);
+    g_bytes_unref(random);
+}
+
+static void test_corrupt(void)
+{
+    GBytes *text = make_text(64 * 1024);
+    GBytes *compressed, *out;
+    guint8 *data;
+    gsize size;
+    uint32_t announced;
+    GError *err = NULL;
+
+    compressed = clipboard_compress(VD_AGENT_CLIPBOARD_UTF8_TEXT, text);
+    g_assert_nonnull(compressed);
+    data = g_bytes_unref_to_data(compressed, &size);
+
+    /* truncated */
+    out = clipboard_decompress(NULL, 0, data, size - 16, &err);
+    g_assert_null(out);
+    g_assert_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&err);
+
+    /* larger than announced */
+    announced = GUINT32_TO_LE(1024);
+    memcpy(data, &announced, sizeof(announced));
+    out = clipboard_decompress(NULL, 0, data, size, &err);
+    g_assert_null(out);
+    g_assert_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&err);
+
+    /* over the limit */
+    announced = GUINT32_TO_LE(CLIPBOARD_DECOMPRESS_MAX_SIZE + 1);
+    memcpy(data, &announced, sizeof(announced));
+    out = clipboard_decompress(NULL, 0, data, size, &err);
+    g_assert_null(out);
+    g_assert_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&err);
+
+    g_free(data);
+    g_bytes_unref(text);
+}
+
+int main(int argc, char *argv[])
+{
+    test_round_trip(CLIPBOARD_COMPRESS_MIN_SIZE);
+    test_round_trip(60 * 1024);
+    test_round_trip(4 * 1024 * 1024 + 7);
+    test_streaming(8 * 1024, 1);
+    test_streaming(1024 * 1024, 3);
+    test_streaming(1024 * 1024, VD_AGENT_MAX_DATA_SIZE);
+    test_streaming(1024 * 1024, 100000);
+    test_deflate_in_pieces(8 * 1024, 1);
+    test_deflate_in_pieces(1024 * 1024, 1000);
+    test_deflate_in_pieces(1024 * 1024, 32 * 1024);
+    test_skipped();
+    test_corrupt();
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*  test-clipboard-prefetch.c  - test matching clipboard prefetch responses
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <glib.h>
+
+#include "clipboard-prefetch.h"
+
+/* the response is cached */
+static void test_answered(void)
+{
+    ClipboardPrefetch prefetch = CLIPBOARD_PREFETCH_NONE;
+
+    g_assert_true(clipboard_prefetch_begin(&prefetch));
+    g_assert_false(clipboard_prefetch_begin(&prefetch));
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, FALSE), ==,
+                    CLIPBOARD_RESPONSE_PREFETCH);
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_PREFETCH);
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_AGENT);
+}
+
+/* the agent asks while the prefetch is in flight, the response is its */
+static void test_agent_waiting(void)
+{
+    ClipboardPrefetch prefetch = CLIPBOARD_PREFETCH_NONE;
+
+    g_assert_true(clipboard_prefetch_begin(&prefetch));
+    g_assert_true(clipboard_prefetch_agent_request(&prefetch));
+    /* still the agent's after the selection changed hands */
+    clipboard_prefetch_cancel(&prefetch);
+    g_assert_false(clipboard_prefetch_begin(&prefetch));
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_AGENT);
+    g_assert_true(clipboard_prefetch_begin(&prefetch));
+}
+
+/* the response to a prefetch of an older grab is dropped */
+static void test_stale(void)
+{
+    ClipboardPrefetch prefetch = CLIPBOARD_PREFETCH_NONE;
+
+    g_assert_true(clipboard_prefetch_begin(&prefetch));
+    clipboard_prefetch_cancel(&prefetch);
+    g_assert_false(clipboard_prefetch_begin(&prefetch));
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_STALE);
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_AGENT);
+}
+
+/* the client never answers a prefetch, the agent's own request
+   of a later grab must still get its response */
+static void test_never_answered(void)
+{
+    ClipboardPrefetch prefetch = CLIPBOARD_PREFETCH_NONE;
+    guint i;
+
+    g_assert_true(clipboard_prefetch_begin(&prefetch));
+    for (i = 0; i < 3; i++) {
+        clipboard_prefetch_cancel(&prefetch);
+        clipboard_prefetch_begin(&prefetch);
+    }
+
+    g_assert_false(clipboard_prefetch_agent_request(&prefetch));
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_AGENT);
+    g_assert_true(clipboard_prefetch_begin(&prefetch));
+}
+
+/* the agent asks without a prefetch in flight */
+static void test_no_prefetch(void)
+{
+    ClipboardPrefetch prefetch = CLIPBOARD_PREFETCH_NONE;
+
+    clipboard_prefetch_cancel(&prefetch);
+    g_assert_false(clipboard_prefetch_agent_request(&prefetch));
+    g_assert_cmpint(clipboard_prefetch_match(&prefetch, TRUE), ==,
+                    CLIPBOARD_RESPONSE_AGENT);
+}
+
+int main(int argc, char *argv[])
+{
+    test_answered();
+    test_agent_waiting();
+    test_stale();
+    test_never_answered();
+    test_no_prefetch();
+
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*  test-connection-priority.c  - test the write order of VDAgentConnection
+
+    Copyright 2020 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "vdagent-connection.h"
+
+#define KiB 1024
+#define MiB (1024 * 1024)
+
+/* larger than what the socket buffers can hold,
+ * so that it can't be written in one go */
+#define BIG_SIZE (4 * MiB)
+
+#define TEST_TYPE_CONNECTION test_connection_get_type()
+G_DECLARE_FINAL_TYPE(TestConnection, test_connection, TEST, CONNECTION, VDAgentConnection)
+
+struct _TestConnection {
+    VDAgentConnection parent_instance;
+};
+
+G_DEFINE_TYPE(TestConnection, test_connection, VDAGENT_TYPE_CONNECTION)
+
+static gsize test_connection_handle_header(VDAgentConnection *conn,
+                                           gpointer           header_buf)
+{
+    return 0;
+}
+
+static void test_connection_handle_message(VDAgentConnection *conn,
+                                           gpointer           header_buf,
+                                           gpointer           data_buf)
+{
+}
+
+static void test_connection_init(TestConnection *self)
+{
+}
+
+static void test_connection_class_init(TestConnectionClass *klass)
+{
+    VDAgentConnectionClass *conn_class = VDAGENT_CONNECTION_CLASS(klass);
+
+    conn_class->handle_header = test_connection_handle_header;
+    conn_class->handle_message = test_connection_handle_message;
+}
+
+static void error_cb(VDAgentConnection *conn, GError *err)
+{
+    g_error("connection error: %s", err ? err->message : "closed by peer");
+}
+
+static VDAgentConnection *conn;
+static int peer_fd = -1;
+static GByteArray *received;
+
+static void setup(void)
+{
+    GError *err = NULL;
+    GSocket *socket;
+    GSocketConnection *socket_conn;
+    int fds[2];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    peer_fd = fds[1];
+    g_assert_cmpint(fcntl(peer_fd, F_SETFL, O_NONBLOCK), ==, 0);
+
+    socket = g_socket_new_from_fd(fds[0], &err);
+    g_assert_no_error(err);
+    socket_conn = g_socket_connection_factory_create_connection(socket);
+    g_object_unref(socket);
+
+    conn = g_object_new(TEST_TYPE_CONNECTION, NULL);
+    vdagent_connection_setup(conn, G_IO_STREAM(socket_conn), FALSE, 1, error_cb);
+
+    received = g_byte_array_new();
+}
+
+static void teardown(void)
+{
+    vdagent_connection_destroy(conn);
+    conn = NULL;
+    close(peer_fd);
+    peer_fd = -1;
+    g_byte_array_unref(received);
+    received = NULL;
+}
+
+static void read_available(void)
+{
+    guint8 buf[64 * KiB];
+    gssize n;
+
+    while ((n = read(peer_fd, buf, sizeof(buf))) > 0) {
+        g_byte_array_append(received, buf, n);
+    }
+}
+
+/* Runs the main loop until at least @size bytes have been received */
+static void receive(gsize size)
+{
+    while (received->len < size) {
+        if (!g_main_context_iteration(NULL, FALSE)) {
+            g_usleep(1000);
+        }
+        read_available();
+    }
+}
+
+/* Runs the main loop for a while, nothing may be received meanwhile */
+static void receive_nothing(void)
+{
+    guint len = received->len;
+    guint i;
+
+    for (i = 0; i < 50; i++) {
+        g_main_context_iteration(NULL, FALSE);
+        g_usleep(1000);
+        read_available();
+    }
+    g_assert_cmpuint(received->len, ==, len);
+}
+
+/* Queues a message of @size bytes filled with @c */
+static void write_filled(gchar c, gsize size, VDAgentConnPriority priority)
+{
+    gpointer data = g_malloc(size);
+
+    memset(data, c, size);
+    vdagent_connection_write_with_priority(conn, data, size, priority);
+}
+
+static GBytes *bytes_filled(gchar c, gsize size)
+{
+    gpointer data = g_malloc(size);
+
+    memset(data, c, size);
+    return g_bytes_new_take(data, size);
+}
+
+/* Checks that the received data is made of runs of the bytes in @order,
+ * each run being as long as the corresponding item in @sizes */
+static void check_received(const gchar *order, const gsize *sizes)
+{
+    gsize pos = 0;
+    guint i;
+
+    for (i = 0; order[i] != '\0'; i++) {
+        gsize j;
+
+        g_assert_cmpuint(pos + sizes[i], <=, received->len);
+        for (j = 0; j < sizes[i]; j++) {
+            if (received->data[pos + j] != order[i]) {
+                g_error("byte %" G_GSIZE_FORMAT " is '%c', expected '%c'",
+                        pos + j, received->data[pos + j], order[i]);
+            }
+        }
+        pos += sizes[i];
+    }
+    g_assert_cmpuint(pos, ==, received->len);
+}
+
+/* messages queued at once go out by priority */
+static void test_priority_order(void)
+{
+    const gsize sizes[] = { 100, 200, 300, 400 };
+
+    setup();
+    write_filled('B', 300, VDAGENT_CONNECTION_PRIORITY_BULK);
+    write_filled('C', 200, VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    write_filled('b', 400, VDAGENT_CONNECTION_PRIORITY_BULK);
+    write_filled('I', 100, VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
+
+    receive(1000);
+    check_received("ICBb", sizes);
+    teardown();
+}
+
+/* a partially written message is finished before anything else,
+ * the messages queued meanwhile go out by priority */
+static void test_partial_write(void)
+{
+    const gsize sizes[] = { BIG_SIZE, 100, 200, 300 };
+
+    setup();
+    write_filled('B', BIG_SIZE, VDAGENT_CONNECTION_PRIORITY_BULK);
+    receive(1);
+    g_assert_cmpuint(received->len, <, BIG_SIZE);
+
+    write_filled('b', 300, VDAGENT_CONNECTION_PRIORITY_BULK);
+    write_filled('C', 200, VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    write_filled('I', 100, VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
+
+    receive(BIG_SIZE + 600);
+    check_received("BICb", sizes);
+    teardown();
+}
+
+/* nothing is written while an open message waits for more data */
+static void test_open_message(void)
+{
+    const gsize sizes[] = { 4 * KiB, 100, 200 };
+    VDAgentConnMessage *msg;
+    GBytes *segment;
+
+    setup();
+    segment = bytes_filled('O', 1 * KiB);
+    msg = vdagent_connection_writev_begin(conn, &segment, 1, 4 * KiB,
+                                          VDAGENT_CONNECTION_PRIORITY_BULK);
+    g_bytes_unref(segment);
+    g_assert_nonnull(msg);
+    receive(1 * KiB);
+
+    write_filled('I', 100, VDAGENT_CONNECTION_PRIORITY_INTERACTIVE);
+    write_filled('C', 200, VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    receive_nothing();
+
+    segment = bytes_filled('O', 1 * KiB);
+    vdagent_connection_append(conn, msg, segment);
+    g_bytes_unref(segment);
+    receive(2 * KiB);
+    receive_nothing();
+
+    segment = bytes_filled('O', 2 * KiB);
+    vdagent_connection_append(conn, msg, segment);
+    g_bytes_unref(segment);
+
+    receive(4 * KiB + 300);
+    check_received("OIC", sizes);
+    teardown();
+}
+
+/* an open message larger than its size is refused */
+static void test_open_message_too_large(void)
+{
+    GBytes *segment;
+
+    setup();
+    segment = bytes_filled('O', 2 * KiB);
+    g_assert_null(vdagent_connection_writev_begin(conn, &segment, 1, 1 * KiB,
+                                                  VDAGENT_CONNECTION_PRIORITY_BULK));
+    g_bytes_unref(segment);
+
+    write_filled('C', 200, VDAGENT_CONNECTION_PRIORITY_CONTROL);
+    receive(200);
+    check_received("C", (const gsize[]) { 200 });
+    teardown();
+}
+
+int main(int argc, char *argv[])
+{
+    test_priority_order();
+    test_partial_write();
+    test_open_message();
+    test_open_message_too_large();
+
+    return 0;
+}